@@ -6,6 +6,7 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -14,318 +15,1832 @@
 #include <limits.h>    /* for PAGESIZE */
 
 #include <sched.h> 
+#include <unistd.h>    // for getopt
+#include <pthread.h>   // generator helper threads
+#include <time.h>
+#include <x86intrin.h>  // __rdtsc
+#include <cpuid.h>
+#include <dirent.h>        // NUMA topology from sysfs
+#include <fcntl.h>
+#include <sys/syscall.h>   // mbind, get_mempolicy without libnuma
+#include <sys/stat.h>      // program cache
 #include "ia32_encode.h"
+#include "ia32_template.h"
+#include "ia32_bulk.h"
+#include "testrig_stats.h"
+#include "fault_guard.h"
+#include "logsink.h"
+
+#ifndef PAGESIZE
+#define PAGESIZE 4096
+#endif
   
 
 // globals to aid debug to start
 volatile char *mptr=0,*next_ptr=0,*mdptr=0, *comm_ptr=0;
 int num_inst=0,i=0;
 int target_ninstrs=MAX_DEF_INSTRS;
-int nthreads=1,pid_task[MAX_THREADS],pid=0;
+int nthreads=1;
 unsigned seed = 12345;
 FILE *logfile = NULL;
 
-typedef struct { 
-	volatile unsigned long *pointer_addr;
-} test_i;
-
-test_i test_info [NUM_PTRS];
 //
-// declarations for holding thread information
+// generator profiles, selected with -p
 //
-typedef volatile unsigned long *tptrs;
-
-volatile unsigned long *mptr_threads[MAX_THREADS];
-volatile unsigned long *mdptr_threads[MAX_THREADS];
-volatile unsigned long *comm_ptr_threads[MAX_THREADS];
-
-
-
-// 
-// declarations for starting test
+// random   : mixed MOV/XADD/XCHG/fence stream (default)
+// fill-mov : one run of MOV reg->[RSI+disp] of a single size
+// fill-xadd: one run of LOCK XADD [RSI+disp],reg of a single size
+// bandwidth: streams wide, non-temporal and REP string moves over the worker's DATA slice
+// stack    : the random stream with balanced PUSH/POP, ENTER/LEAVE, nested CALL/RET and
+//            MOV r,[RSP] mixed in, for the stack engine and the return stack buffer
 //
-typedef int (*funct_t)();
-funct_t start_test;
-int executeit();
+enum gen_profile { PROF_RANDOM = 0, PROF_FILL_MOV, PROF_FILL_XADD, PROF_BANDWIDTH, PROF_STACK, NUM_PROFILES };
+const char *profile_names[NUM_PROFILES] = { "random", "fill-mov", "fill-xadd", "bandwidth", "stack" };
+int profile = PROF_RANDOM;
 
-#ifndef PAGESIZE
-#define PAGESIZE 4096
-#endif
+// a stack profile record can be a whole CALL/RET nest, longer than any one instruction
+#define CALL_MAX_DEPTH     21        // the JMP over the callees is a rel8
+#define CALL_NEST_BYTES(d) (5 + 2 + 6 * ((d) - 1) + 1)
+#define STACK_ENC_SLOT     (CALL_NEST_BYTES(CALL_MAX_DEPTH) + MAX_ENC_SLOT)
+#define ENC_SLOT(p)        ((p) == PROF_STACK ? STACK_ENC_SLOT : MAX_ENC_SLOT)
 
-#ifndef MAP_ANONYMOUS
-#define MAP_ANONYMOUS MAP_ANON
-#endif
+// generator threads per program (-j) and the CPUs they may use
+#define MAX_GEN_THREADS 64
+int gen_threads = 1;
+cpu_set_t gen_cpus;
 
-/*
- * simple routine to randomize numbers in a range
- */
-int rand_range(int min_n, int max_n)
-{
-	return rand() % (max_n - min_n + 1) + min_n;
-}
+// code bytes per thread, grows with the number of instructions
+unsigned long instr_bytes = MAX_INSTR_BYTES;
 
+// data bytes per thread (-S), the bandwidth profile gives every worker its own slice
+#define MAX_DATA_SIZE   (1UL << 30)    // displacements are 32 bit
+unsigned long data_bytes = MAX_DATA_BYTES;
+int have_avx = 0;
+__thread unsigned long bw_pass_bytes;  // bytes moved by one pass of the bandwidth body
 
-main(int argc, char *argv[])
-{
+// mutation campaign (-m, -W): iterations after the first run, instructions changed per iteration
+int mut_iters = 0;
+int mut_window = 4;
 
-	int ibuilt=0;
+// code layout (-A): alignment of the body (and loop head), of every Nth instruction,
+// or every Nth instruction split across a line/page boundary instead
+int align_body = 0;
+int align_every = 0;
+int align_to = 16;
+int align_straddle = 0;
 
-	/* process arguments here */
-	if (argc >= 2) seed = atoi(argv[1]);
-	if (argc >= 3) target_ninstrs = atoi(argv[2]);
-	if (argc >= 4) nthreads = atoi(argv[3]);
+// -L: run the body this many times (R12 loop), 0/1 = straight line
+int loop_iters = 0;
 
-	char logfilename[256] = "";
-	
+// -P: cache state the header leaves the worker's DATA region in before the body runs
+enum precond { PRE_NONE = 0, PRE_FLUSH, PRE_FLUSHOPT, PRE_CLWB, PRE_WARM, PRE_WARM_NTA, NUM_PRECONDS };
+const char *precond_names[NUM_PRECONDS] = { "none", "flush", "flushopt", "clwb", "warm", "warm-nta" };
+int precond = PRE_NONE;
 
-	if (argc >= 5 && strlen(argv[4]) > 0) {
-		strcpy(logfilename, argv[4]);
-		logfile = fopen(logfilename, "w");
-		if (!logfile) {
-			fprintf(logfile, "Error: Cannot open log file %s\n", logfilename);
-			exit(1);
-		}
-		printf("Logging to: %s\n", logfilename);
-	}
+// -N: NUMA placement of the per-worker CODE and DATA slices, off = leave it to the kernel
+enum numa_mode { NUMA_OFF = 0, NUMA_LOCAL, NUMA_REMOTE, NUM_NUMA_MODES };
+const char *numa_mode_names[NUM_NUMA_MODES] = { "off", "local", "remote" };
+int numa_mode = NUMA_OFF;
 
-	printf("\nstarting seed = %d\n", seed);
-	printf("Number of instructions = %d\n", target_ninstrs);
-	printf("Number of threads = %d\n", nthreads);
+// -T: how workers are run, forked processes (default) or threads of this process
+enum worker_backend { WORKER_FORK = 0, WORKER_PTHREAD, NUM_WORKER_BACKENDS };
+const char *worker_backend_names[NUM_WORKER_BACKENDS] = { "fork", "pthread" };
+int worker_backend = WORKER_FORK;
 
-	if (nthreads > MAX_THREADS) {
-		fprintf(logfile,"Sorry only built for %d threads over riding your %d\n", MAX_THREADS, nthreads);
-		fflush(logfile);
-		nthreads=MAX_THREADS;
-	}
+typedef struct {
+	pid_t pid;                // fork backend
+	pthread_t tid;            // pthread backend
+} worker_t;
+worker_t workers[MAX_THREADS];
 
-	srand(seed);
+// -B: benchmark the rig itself into this CSV file instead of running workers
+const char *bench_file = NULL;
+#define BENCH_MAX_INSTRS 100000
 
-	/* allocate buffer to perform stores and loads to  */
+// -I: per instruction shape latency/throughput table of this CPU into this CSV file
+const char *timing_file = NULL;
+#define TIMING_UNROLL   256      // instances per timed body
+#define TIMING_SAMPLES  2001     // timed calls per body
+#define TIMING_WARMUP   32
 
+// -M: POSIX shared memory object holding the live stats block followed by COMM,
+// default /encodeit.<pid>; monitor attaches to it by name
+char stats_name[STATS_NAME_MAX] = "";
+testrig_stats_t *stats;
+unsigned long stats_size;
 
-	test_info[DATA].pointer_addr = mmap(
-		(void *) 0,
-		(MAX_DATA_BYTES+PAGESIZE-1) * nthreads,
-		PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANONYMOUS | MAP_SHARED,
-		0, 0
-		);
+// -J / -t / -F: job mode.  The parent hands (seed, profile, size) jobs to the workers
+// through a ring in COMM until the jobs run out or the -t deadline passes.  A
+// campaign (-F) is a list of runs executed one after the other by the same workers.
+typedef struct {
+	unsigned first_seed;                 // job k uses first_seed+k
+	long njobs;                          // 0 = until the deadline
+	int min, max;                        // instructions per job, 0 = num_instructions
+	int profiles[NUM_PROFILES];
+	int nprofiles;                       // 0 = the -p profile
+	int workers;                         // workers taking jobs, 0 = num_threads
+	int shared;                          // 1 = one DATA region for all, 0 = a slice each
+	long log_every;                      // 0 = -g, else LOG_ALL, LOG_FAILED or 1 in n
+} sched_run_t;
+int sched_mode = 0;
+sched_run_t sched_cmdline;                 // the single run of -J / -t
+sched_run_t *sched_runs = &sched_cmdline;
+int sched_nruns = 1;
+const char *campaign_file = NULL;
+double run_deadline = 0;                   // -t seconds, 0 = none
 
-	/* save the base address for debug like before */
+// -w: the parent kills a worker whose heartbeat is older than this many seconds, 0 = off
+double watchdog_secs = 0;
 
-	mdptr=(volatile char *)test_info[DATA].pointer_addr;
+// -Z: the log file goes through an LZ4 compressing writer thread, rotated by size and/or age
+int log_sink = 0;
+const char *log_sink_path = NULL;          // the logfile argument, the base of the workers' names
+unsigned long log_rotate_bytes = 0;        // compressed bytes per file, 0 = no limit
+double log_rotate_secs = 0;                // seconds per file, 0 = no limit
 
-	if (((int *)test_info[DATA].pointer_addr) == (int *)-1) {
-		perror("Couldn't mmap (MAX_DATA_BYTES)");
-		exit(1);
-	}
+// -g: the instruction level detail of a program goes to a per-worker ring and only
+// reaches the log if the program faults or is one of the 1 in n sampled
+#define LOG_ALL         -1                 // no ring, log everything as it happens
+#define LOG_FAILED      -2                 // failing programs only
+#define LOG_RING_BYTES  (1 << 20)          // detail kept per program, power of 2
+typedef struct {
+	char *buf;                           // allocated by the worker on first use
+	unsigned long head;                  // bytes of detail of the current program
+	long every;                          // LOG_ALL, LOG_FAILED or sample 1 in every
+} log_ring_t;
+long log_every = LOG_ALL;
+log_ring_t log_rings[MAX_THREADS];
 
+// -C / -c: coverage of (type, size, reg1, reg2, mod, lock) bins, dumped to a file,
+// and generation biased toward bins the worker has not hit yet
+const char *cov_file = NULL;
+int cov_directed = 0;
+#define COV_TRIES 8                        // candidates per instruction with -c
 
-	
-	/* allocate buffer to build instructions into */
+// -K: directory of cached program images keyed by the generator parameters
+const char *prog_cache_dir = NULL;
 
-	test_info[CODE].pointer_addr = mmap(
-		(void *) 0,
-		(MAX_INSTR_BYTES+PAGESIZE-1) * nthreads,
-		PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_SHARED,
-		0, 0
-		);
+// -s: the parent builds one position independent program that every worker runs on
+// its own DATA slice, the DATA base is the program's argument (RDI)
+int pic_mode = 0;
+int pic_ninstrs;
+unsigned long pic_bw_bytes;                // its bw_pass_bytes, which is per thread
+unsigned long *cov_maps;                   // COV_WORDS per worker, behind the stats counters
 
-	/* keep a copy to the base here */
+// per-worker results the parent reports on, in a shared mapping
+typedef struct {
+	int cpu, cpu_node, mem_node;      // where the worker ran and where its DATA landed
+	unsigned long cycles;             // TSC cycles of the first run
+	unsigned long instrs;             // instructions executed
+	unsigned long bytes;              // bytes moved (bandwidth profile)
+} worker_result_t;
+worker_result_t *worker_results;
 
-	mptr=(volatile char *)test_info[CODE].pointer_addr;
+// -D: number of interleaved dependency chains the generator steers registers into,
+// 0 = registers picked uniformly
+#define MAX_DEP_STREAMS 5
+int dep_streams = 0;
 
-	if (((int *)test_info[CODE].pointer_addr) == (int *)-1) {
-		perror("Couldn't mmap (MAX_INSTR_BYTES)");
-		exit(1);
-	}
+//
+// litmus mode (-l): small memory ordering tests from a fixed table.  Every role runs
+// its own generated program, all roles start each instance together and the outcomes
+// are histogrammed against the outcome x86-TSO forbids.
+//
+// The shared locations x and y of one instance sit on separate cache lines.  An
+// observable is either a register a role loaded (saved to its result slot) or, for
+// role -1, the final value of location 'slot'.
+//
+#define LITMUS_MAX_ROLES 4
+#define LITMUS_MAX_OPS   2
+#define LITMUS_MAX_OBS   4
+#define LITMUS_LOC_X     0
+#define LITMUS_LOC_Y     1
 
+typedef struct {
+	char kind;       // 'S' store, 'L' load, 0 unused
+	char loc;        // LITMUS_LOC_*
+	char arg;        // value stored, or result slot loaded into
+} litmus_op_t;
 
-	/* allocate buffer to build communications area into */
+typedef struct {
+	const char *name;
+	int nroles;
+	litmus_op_t ops[LITMUS_MAX_ROLES][LITMUS_MAX_OPS];
+	int nobs;
+	struct { signed char role, slot; } obs[LITMUS_MAX_OBS];
+	int forbidden[LITMUS_MAX_OBS];   // the outcome TSO does not allow
+	int needs_fence;                 // forbidden only with -l fence=mfence|lock
+} litmus_test_t;
 
-	test_info[COMM].pointer_addr = mmap(
-		(void *) 0,
-		(MAX_COMM_BYTES+PAGESIZE-1) * nthreads,
-		PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_SHARED,
-		0, 0
-		);
+const litmus_test_t litmus_tests[] = {
+	{ "sb", 2, { { {'S', LITMUS_LOC_X, 1}, {'L', LITMUS_LOC_Y, 0} },
+	             { {'S', LITMUS_LOC_Y, 1}, {'L', LITMUS_LOC_X, 0} } },
+	  2, { {0, 0}, {1, 0} }, {0, 0}, 1 },
+	{ "mp", 2, { { {'S', LITMUS_LOC_X, 1}, {'S', LITMUS_LOC_Y, 1} },
+	             { {'L', LITMUS_LOC_Y, 0}, {'L', LITMUS_LOC_X, 1} } },
+	  2, { {1, 0}, {1, 1} }, {1, 0}, 0 },
+	{ "lb", 2, { { {'L', LITMUS_LOC_X, 0}, {'S', LITMUS_LOC_Y, 1} },
+	             { {'L', LITMUS_LOC_Y, 0}, {'S', LITMUS_LOC_X, 1} } },
+	  2, { {0, 0}, {1, 0} }, {1, 1}, 0 },
+	{ "iriw", 4, { { {'S', LITMUS_LOC_X, 1} },
+	               { {'S', LITMUS_LOC_Y, 1} },
+	               { {'L', LITMUS_LOC_X, 0}, {'L', LITMUS_LOC_Y, 1} },
+	               { {'L', LITMUS_LOC_Y, 0}, {'L', LITMUS_LOC_X, 1} } },
+	  4, { {2, 0}, {2, 1}, {3, 0}, {3, 1} }, {1, 0, 1, 0}, 0 },
+	{ "2+2w", 2, { { {'S', LITMUS_LOC_X, 1}, {'S', LITMUS_LOC_Y, 2} },
+	               { {'S', LITMUS_LOC_Y, 1}, {'S', LITMUS_LOC_X, 2} } },
+	  2, { {-1, LITMUS_LOC_X}, {-1, LITMUS_LOC_Y} }, {1, 1}, 0 },
+};
+#define NUM_LITMUS_TESTS (int)(sizeof(litmus_tests) / sizeof(litmus_tests[0]))
 
-	comm_ptr=(volatile char *)test_info[COMM].pointer_addr;
+enum litmus_fence { LFENCE_NONE = 0, LFENCE_MFENCE, LFENCE_LOCK, NUM_LITMUS_FENCES };
+const char *litmus_fence_names[NUM_LITMUS_FENCES] = { "none", "mfence", "lock" };
 
-	if (((int *)test_info[COMM].pointer_addr) == (int *)-1) {
-		perror("Couldn't mmap (MAX_INSTR_BYTES)");
-		exit(1);
-	}
+const litmus_test_t *litmus = NULL;   // selected test, NULL = normal generation
+int litmus_fence = LFENCE_NONE;
+long litmus_iters = 1000000;
 
-	/* make the standard output and stderrr unbuffered */
+// atomicity check (-X): LOCK XADD increments per worker on each shared line, 0 = off
+#define ATOM_MAX_LINES  64
+#define ATOM_UNROLL     16       // increments per line in one call of the program
+long atom_iters = 0;
+int atom_lines = 1;
+int atom_scale = 0;              // also run with 1..nthreads-1 workers
 
-	setbuf(stdout, (char *) NULL);
-	setbuf(stderr, (char *) NULL);
+// cross-modifying code (-x): worker 1 patches the program worker 0 is running, 0 = off
+#define XMC_MAX_SITES   16
+enum xmc_field { XMC_IMM = 0, XMC_DISP, NUM_XMC_FIELDS };
+const char *xmc_field_names[NUM_XMC_FIELDS] = { "imm", "disp" };
+long xmc_iters = 0;
+long xmc_rounds = 10000;
+int xmc_sites = 4;
+int xmc_field = XMC_IMM;
+int xmc_cpuid = 1;               // SDM protocol: the target serializes before running patched code
 
+// TSC cycles of the last executeit() call in this worker, and the signal that ended it (0 = none)
+__thread unsigned long exec_cycles;
+__thread int exec_signal;
 
-	/* start appropriate # of threads */
+// Instruction types to randomize among
+enum instr_type {
+    INSTR_REG_TO_REG = 0,
+    INSTR_IMM_TO_REG = 1, 
+    INSTR_REG_TO_MEM = 2,
+    INSTR_MEM_TO_REG = 3,
+    INSTR_XADD_REG = 4,      // XADD reg-to-reg
+    INSTR_XADD_MEM = 5,      // XADD reg-to-memory  
+    INSTR_XCHG_REG = 6,      // XCHG reg-to-reg
+    INSTR_XCHG_MEM = 7,      // XCHG reg-to-memory
+    INSTR_MFENCE = 8,        // MFENCE - full memory barrier
+    INSTR_SFENCE = 9,        // SFENCE - store memory barrier  
+    INSTR_LFENCE = 10,       // LFENCE - load memory barrier
+    NUM_INSTR_TYPES,         // the random profile picks from the types above
 
-	for (i=0;i<nthreads;i++) 
-	{
-	
-		next_ptr=(mptr+(i*MAX_INSTR_BYTES));          // init next_ptr
-		fprintf(logfile,"T%d next_ptr=0x%lx\n",i,(unsigned long)next_ptr);
-		fflush(logfile);
-		mdptr_threads[i]=(tptrs)mdptr;  // init threads data pointer
-		mptr_threads[i]=(tptrs)next_ptr;                     // save ptr per thread
-		comm_ptr_threads[i]=(tptrs)comm_ptr;                 // everyone gets the same for now
+    // bandwidth profile, disp is the offset in the DATA slice
+    INSTR_VLOAD = NUM_INSTR_TYPES,   // VMOVDQU ymm,[RSI+disp]
+    INSTR_VSTORE,            // VMOVDQU [RSI+disp],ymm
+    INSTR_VNTSTORE,          // VMOVNTDQ [RSI+disp],ymm
+    INSTR_SSE_LOAD,          // MOVDQA xmm,[RSI+disp]
+    INSTR_SSE_STORE,         // MOVDQA [RSI+disp],xmm
+    INSTR_MOVNTI,            // MOVNTI [RSI+disp],r64
+    INSTR_REP_MOVSB,         // copy imm bytes from [RSI] to [RSI+disp]
+    INSTR_REP_STOSB,         // store AL to imm bytes at [RSI+disp]
 
+    // stack profile, always balanced within a chunk
+    INSTR_PUSH,              // PUSH reg1
+    INSTR_POP,               // POP reg1
+    INSTR_ENTER,             // ENTER imm & 0xFFFF, imm >> 16 (nesting level)
+    INSTR_LEAVE,             // LEAVE, closes the innermost ENTER
+    INSTR_CALL_RET,          // imm nested CALLs and their RETs, self-contained
+    INSTR_STACK_LOAD         // MOV reg1,[RSP] of a value the body pushed (stack sync)
+};
 
-		/* use fork to start a new child process */
+// one generated instruction, kept so the program can be logged and indexed
+typedef struct {
+	unsigned int off;        // byte offset from the start of the body
+	unsigned short pad;      // NOP bytes following the instruction in its slot
+	unsigned char len;       // encoded length
+	unsigned char type;      // enum instr_type
+	unsigned char size;      // ISZ_*
+	unsigned char lock;      // LOCK prefix on memory forms
+	unsigned char reg1, reg2;
+	int disp;                // displacement off RSI, -1 for register forms
+	int imm;
+} gen_insn_t;
 
-		if((pid=fork()) == 0) {
+// a generated program: header, random body, trailer
+#define PROG_MAX_RELOCS 4
+typedef struct {
+	volatile char *start;    // entry point
+	volatile char *body;     // first generated instruction
+	volatile char *body_end; // end of the generated instructions, trailer follows
+	volatile char *end;      // end of the trailer
+	volatile char *limit;    // end of the code buffer less encoder slack
+	gen_insn_t *insn;        // one record per generated instruction
+	int ninsn, cap;
+	volatile char *dirty_lo, *dirty_hi;   // bytes patched since the last prog_flush
+	unsigned reloc[PROG_MAX_RELOCS];      // offsets from start of the MOV imm64s loading the DATA base
+	int nreloc;
+} gen_prog_t;
 
-			fprintf(logfile,"T%d fork\n",i);
-			fflush(logfile);
+gen_prog_t prog_threads[MAX_THREADS];
 
-		if (bind_to_cpu(i, getpid()) != 0) {
-			exit(1);
-		}
+// Helper macro for logging to both stderr and logfile (needs thread_id and logfile in scope)
+#define LOG_AND_PRINT(format, ...) do { \
+	fprintf(stderr, "T%d: " format, thread_id, ##__VA_ARGS__); \
+	fflush(stderr); \
+	if (logfile) { \
+		fprintf(logfile, "T%d: " format, thread_id, ##__VA_ARGS__); \
+		fflush(logfile); \
+	} \
+} while(0)
 
-			//
-			// NOTE:  you could set your sched_setaffinity here...better to make a subroutine to bind
-			// 
-			//
-			ibuilt=build_instructions(mptr_threads[i],i,logfile);  // build instructions
+// instruction level detail: logged as it happens without -g, else kept in the worker's ring
+#define LOG_DETAIL(format, ...) do { \
+	if (log_rings[thread_id].every == LOG_ALL) \
+		LOG_AND_PRINT(format, ##__VA_ARGS__); \
+	else \
+		log_ring_printf(thread_id, "T%d: " format, thread_id, ##__VA_ARGS__); \
+} while(0)
 
-			/* ok now that I built the critters, time to execute them */
+typedef struct { 
+	volatile unsigned long *pointer_addr;
+} test_i;
 
-			start_test=(funct_t) mptr_threads[i];
-			executeit(start_test);
-			fprintf(logfile,"T%d generation program complete, instructions generated: %d\n",i, ibuilt);
-			fflush(logfile);
+test_i test_info [NUM_PTRS];
+//
+// declarations for holding thread information
+//
+typedef volatile unsigned long *tptrs;
 
-			break;
-			
-		}
-		
-                else if (pid_task[i] == -1) {
-			perror("fork me failed");
-			exit(1);
-		} else { // this should be the parent 
+volatile unsigned long *mptr_threads[MAX_THREADS];
+volatile unsigned long *mdptr_threads[MAX_THREADS];
+volatile unsigned long *comm_ptr_threads[MAX_THREADS];
 
-			pid_task[i]=pid; // save pid
 
-			fprintf(logfile,"child T%d started:\n",pid);
-			fflush(logfile);
 
-		}
-	     
-	} // end for nthreads
+// 
+// declarations for starting test
+//
+typedef int (*funct_t)();
+int executeit(funct_t start_addr, volatile char *data);
+int worker_start(int thread_id);
+void worker_wait(int thread_id);
+unsigned long comm_layout_bytes(void);
+int bench_run(const char *path);
+int timing_run(const char *path);
+void cov_report(FILE *logfile);
+void log_ring_printf(int thread_id, const char *format, ...);
+int log_ring_end(int thread_id, FILE *logfile, int failed, unsigned key);
+static inline unsigned cov_bin(const gen_insn_t *in);
+static inline void cov_mark(unsigned long *map, const gen_insn_t *in);
+static inline int cov_test(const unsigned long *map, unsigned b);
+void sched_init(void);
+void sched_run(int started, FILE *logfile);
+void sched_report(int started, FILE *logfile);
+void sched_worker(int thread_id, FILE *logfile);
+int watchdog_check(int started, FILE *logfile);
+void watchdog_wait(int started, FILE *logfile);
+void *stats_open(unsigned long comm_bytes);
+void stats_close(unsigned long comm_bytes);
+void stats_heartbeat(int thread_id);
+void stats_update(int thread_id, unsigned long generated, unsigned long executed, unsigned long instrs,
+		  unsigned long cycles, unsigned long faults, unsigned long miscompares);
+int bind_to_cpu(int thread_id, pid_t pid);
+int build_instructions(volatile char *next_ptr, int thread_id, FILE *logfile);
+int build_program(volatile char *next_ptr, int thread_id, FILE *logfile);
+void mutate_campaign(int thread_id, FILE *logfile);
+void litmus_run(int thread_id, FILE *logfile);
+void atom_run(int thread_id, FILE *logfile);
+int atom_report(FILE *logfile);
+void xmc_run(int thread_id, FILE *logfile);
+int xmc_report(FILE *logfile);
+int worker_cpu(int thread_id);
+int numa_place(int thread_id, FILE *logfile);
+int numa_mem_node(volatile void *addr);
+int numa_node_of_cpu(int cpu);
+void numa_report(FILE *logfile);
+static inline volatile char *add_headeri(int thread_id, volatile char *tgt_addr);
+static inline volatile char *add_endi(volatile char *tgt_addr);
 
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
 
-	// wait for threads to complete
+/*
+ * map a -p argument to its profile, -1 if unknown
+ */
+int profile_by_name(const char *name)
+{
+	int p;
 
-	for (i=0;i<nthreads;i++) {
-		waitpid(pid_task[i], NULL, 0);
-	}
+	for (p = 0; p < NUM_PROFILES; p++)
+		if (strcmp(name, profile_names[p]) == 0)
+			return p;
+	return -1;
+}
 
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-B bench.csv] [-I timing.csv] [-T backend] [-p profile] [-S data_bytes] [-P precond] [-N numa] [-j gen_threads] [-m iters] [-W window] [-A layout] [-L iters] [-D chains]\n"
+	                "          [-l test[,fence=f][,iters=n]] [-X [iters=k][,lines=n][,scale]]\n"
+	                "          [-x [field=f][,sites=n][,iters=k][,rounds=r][,nocpuid]]\n"
+	                "          [-J [jobs=n][,sizes=a-b][,profiles=p+q][,sharing=s]] [-F campaign] [-t secs] [-w secs] [-Z lz4[,size=N][,secs=T]] [-g n|failed|all] [-K cache_dir] [-s] [-C file] [-c] [-M shm_name]\n"
+	                "          [seed] [num_instructions] [num_threads] [logfile]\n", prog);
+	fprintf(stderr, "  -B file      benchmark encoders, generation, execution, startup and logging into a CSV file\n");
+	fprintf(stderr, "  -I file      time every instruction shape (latency and throughput percentiles) into a CSV file\n");
+	fprintf(stderr, "  -T backend   fork (default): one process per worker, pthread: one thread per worker\n");
+	fprintf(stderr, "  -p profile   random (default), fill-mov, fill-xadd, bandwidth, stack\n");
+	fprintf(stderr, "  -S bytes     DATA bytes per worker, K/M/G suffix (default %d)\n", MAX_DATA_BYTES);
+	fprintf(stderr, "  -P mode      before the body: flush, flushopt or clwb the DATA region,\n");
+	fprintf(stderr, "               warm or warm-nta it with prefetches, none (default)\n");
+	fprintf(stderr, "  -N mode      local: bind each worker's CODE/DATA to its CPU's node, remote: DATA on\n");
+	fprintf(stderr, "               the next node (cross-socket), off (default); reports cycles per node pair\n");
+	fprintf(stderr, "  -j n         generate each program on n cores (same bytes for any n)\n");
+	fprintf(stderr, "  -m iters     rerun each program iters times, mutating a window of it in between\n");
+	fprintf(stderr, "  -W n         instructions replaced/inserted/deleted per mutation (default 4)\n");
+	fprintf(stderr, "  -A layout    body=N      align the body / loop head to N bytes\n");
+	fprintf(stderr, "               every=K     also align every Kth instruction ...\n");
+	fprintf(stderr, "               to=N        ... to N bytes (default 16)\n");
+	fprintf(stderr, "               straddle=B  ... or split it across a B byte boundary (64 line, 4096 page)\n");
+	fprintf(stderr, "  -L iters     loop the body iters times\n");
+	fprintf(stderr, "  -D n         steer registers into n dependency chains (1 = one long chain,\n");
+	fprintf(stderr, "               %d = most parallel), 0 = uniform random (default)\n", MAX_DEP_STREAMS);
+	fprintf(stderr, "  -l test      litmus mode: sb, mp, lb, iriw or 2+2w, one worker per role\n");
+	fprintf(stderr, "               fence=F     none (default), mfence or lock (locked stores/loads)\n");
+	fprintf(stderr, "               iters=N     test instances to run (default 1000000)\n");
+	fprintf(stderr, "  -X spec      atomicity check: every worker LOCK XADDs a known amount into shared lines\n");
+	fprintf(stderr, "               iters=K     calls per worker, %d increments per line each (default 100000)\n", ATOM_UNROLL);
+	fprintf(stderr, "               lines=N     shared cache lines (default 1, max %d)\n", ATOM_MAX_LINES);
+	fprintf(stderr, "               scale       repeat with 1..num_threads workers\n");
+	fprintf(stderr, "  -x spec      cross-modifying code: worker 1 patches the program worker 0 runs\n");
+	fprintf(stderr, "               field=F     imm (default) or disp, the field the patcher rewrites\n");
+	fprintf(stderr, "               sites=N     patched instructions, one per line (default 4, max %d)\n", XMC_MAX_SITES);
+	fprintf(stderr, "               iters=K     executions while the patcher races (default 100000)\n");
+	fprintf(stderr, "               rounds=R    patch / serialize / execute handshakes (default 10000)\n");
+	fprintf(stderr, "               nocpuid     skip the CPUID the SDM asks for after a handshake\n");
+	fprintf(stderr, "  -J spec      job mode: workers take (seed, profile, size) jobs from a shared queue\n");
+	fprintf(stderr, "               jobs=N      jobs to run, seeds seed..seed+N-1 (default: until -t)\n");
+	fprintf(stderr, "               sizes=A-B   instructions per job, random in A..B (default num_instructions)\n");
+	fprintf(stderr, "               profiles=P+Q... profiles the jobs cycle through (default -p)\n");
+	fprintf(stderr, "               sharing=S   private (default): a DATA slice per worker, shared: one for all\n");
+	fprintf(stderr, "  -t secs      stop handing out jobs after secs seconds (implies -J)\n");
+	fprintf(stderr, "  -w secs      watchdog: kill a worker without a heartbeat for secs seconds and save its code,\n");
+	fprintf(stderr, "               job mode starts a fresh worker on the next job; secs must cover one run\n");
+	fprintf(stderr, "               with all its -L passes, not with -l, -X or -x\n");
+	fprintf(stderr, "  -Z spec      compress the logfile into logfile.<n>.lz4 on a writer thread, starting a new\n");
+	fprintf(stderr, "               file after size=N compressed bytes (K/M/G) or secs=T; forked workers log\n");
+	fprintf(stderr, "               to logfile.T<i>.<pid>.<n>.lz4 (read with lz4 -dc)\n");
+	fprintf(stderr, "  -g n         log the per instruction detail only of programs that fault or miscompare and of\n");
+	fprintf(stderr, "               1 in n others, failed: those programs only, all (default): everything as it happens\n");
+	fprintf(stderr, "  -F file      campaign: run the job lists of file one after the other, one per line:\n");
+	fprintf(stderr, "               seeds=A-B [sizes=N|A-B] [profiles=P+Q] [workers=N] [sharing=S] [log=n|failed|all]\n");
+	fprintf(stderr, "  -s           build one position independent program, run by every worker on its own DATA\n");
+	fprintf(stderr, "  -K dir       cache generated programs in dir and reuse them when the parameters match\n");
+	fprintf(stderr, "  -C file      write the coverage bins hit by the run to file\n");
+	fprintf(stderr, "  -c           coverage directed: prefer instructions in bins not hit yet\n");
+	fprintf(stderr, "               (program bytes then depend on -j)\n");
+	fprintf(stderr, "  -M name      shared memory object with the live stats for monitor (default /encodeit.<pid>)\n");
+}
 
-	// clean up the allocation before getting out
+/*
+ * parse the -A layout suboptions, 0 on success
+ */
+int parse_layout(char *spec)
+{
+	char *const tokens[] = { "body", "every", "to", "straddle", NULL };
+	char *value;
+	int v;
 
-	munmap((caddr_t)mdptr,(MAX_DATA_BYTES+PAGESIZE-1)*nthreads);
-	munmap((caddr_t)mptr,(MAX_INSTR_BYTES+PAGESIZE-1)*nthreads);
-	munmap((caddr_t)comm_ptr,(MAX_COMM_BYTES+PAGESIZE-1)*nthreads);
+	while (*spec) {
+		char *tok = spec;
+		int which = getsubopt(&spec, tokens, &value);
 
-	// Close log file
-	if (logfile) {
-		fclose(logfile);
+		if (which < 0) {
+			fprintf(stderr, "Unknown -A suboption %s\n", tok);
+			return -1;
+		}
+		if (!value) {
+			fprintf(stderr, "-A %s= needs a value\n", tokens[which]);
+			return -1;
+		}
+		v = atoi(value);
+		if (which == 1 && v <= 0) {
+			fprintf(stderr, "-A every= must be a positive number of instructions, not %s\n", value);
+			return -1;
+		}
+		if (which != 1 && (v <= 0 || (v & (v - 1)) || v > PAGESIZE)) {
+			fprintf(stderr, "-A %s=%d must be a power of two up to %d\n", tokens[which], v, PAGESIZE);
+			return -1;
+		}
+		switch (which) {
+			case 0: align_body = v; break;
+			case 1: align_every = v; break;
+			case 2: align_to = v; break;
+			case 3: align_straddle = v; break;
+		}
 	}
-
+	return 0;
 }
 
 /*
- * Function: executeit
- * 
- * Description:
- *
- * This function will start executing at the function address passed into it 
- * and return an integer return value that will be used to indicate pass(0)/fail(1)
- *
- * INTPUTs:  funct_t start_addr :      function pointer 
- *
- * Returns:  int                :      0 for pass, 1 for fail
- */   
-int executeit(funct_t start_addr) 
+ * parse the -l litmus spec (test name, fence=, iters=), 0 on success
+ */
+int parse_litmus(char *spec)
 {
+	char *const tokens[] = { "fence", "iters", NULL };
+	char *value;
+	int t;
 
-	volatile int i,rc=0;
+	while (*spec) {
+		char *tok = spec;
+		int which = getsubopt(&spec, tokens, &value);
 
-	i=0;
+		switch (which) {
+		case 0:
+			for (t = 0; t < NUM_LITMUS_FENCES; t++)
+				if (value && strcmp(value, litmus_fence_names[t]) == 0)
+					break;
+			if (t == NUM_LITMUS_FENCES) {
+				fprintf(stderr, "Bad -l fence=%s\n", value ? value : "");
+				return -1;
+			}
+			litmus_fence = t;
+			break;
+		case 1:
+			if (!value || (litmus_iters = atol(value)) <= 0) {
+				fprintf(stderr, "Bad -l iters=%s\n", value ? value : "");
+				return -1;
+			}
+			break;
+		default:
+			// getsubopt leaves an unknown token in value
+			for (t = 0; t < NUM_LITMUS_TESTS; t++)
+				if (strcmp(tok, litmus_tests[t].name) == 0)
+					break;
+			if (t == NUM_LITMUS_TESTS) {
+				fprintf(stderr, "Unknown litmus test %s\n", tok);
+				return -1;
+			}
+			litmus = &litmus_tests[t];
+			break;
+		}
+	}
+	if (!litmus) {
+		fprintf(stderr, "-l needs a test name\n");
+		return -1;
+	}
+	return 0;
+}
 
-	rc=(*start_addr)();
+/*
+ * job size range "N" or "A-B", 0 on success
+ */
+static int parse_sizes(const char *value, sched_run_t *run)
+{
+	char end;
+	int n = value ? sscanf(value, "%d-%d%c", &run->min, &run->max, &end) : 0;
 
-	return(0);
+	if (n == 1)
+		run->max = run->min;
+	return (n == 1 || n == 2) && run->min >= 1 && run->max >= run->min ? 0 : -1;
 }
 
-int bind_to_cpu(int thread_id, pid_t pid) {
-    cpu_set_t mask;
-    
-    CPU_ZERO(&mask);                    // Clear all CPU bits
-    CPU_SET(thread_id, &mask);          // Set bit for specific CPU
-    
-    if (sched_setaffinity(pid, sizeof(mask), &mask) == -1) {
-        perror("sched_setaffinity failed");
-        return -1;
-    }
-    
-	fprintf(logfile, "Assigned process %d to CPU_%d\n", pid, thread_id);
-	fflush(logfile);
+/*
+ * profile list "P+Q+...", 0 on success
+ */
+static int parse_profiles(char *value, sched_run_t *run)
+{
+	char *name, *save;
 
-	    cpu_set_t verify_mask;
-    if (sched_getaffinity(pid, sizeof(verify_mask), &verify_mask) == 0) {
-		fprintf(logfile,"Verified: Process %d bound to CPU_%d = %s\n", pid, thread_id, CPU_ISSET(thread_id, &verify_mask) ? "SUCCESS" : "FAILED");
-		fflush(logfile);
-    }
-    return 0;
+	run->nprofiles = 0;
+	for (name = strtok_r(value ? value : "", "+", &save); name; name = strtok_r(NULL, "+", &save)) {
+		if (run->nprofiles == NUM_PROFILES || (run->profiles[run->nprofiles] = profile_by_name(name)) < 0)
+			return -1;
+		run->nprofiles++;
+	}
+	return run->nprofiles ? 0 : -1;
 }
 
-static inline volatile char *enter(short stack_size, char nesting_level, volatile char *tgt_addr)
+/*
+ * DATA sharing of a run, "shared" or "private", 0 on success
+ */
+static int parse_sharing(const char *value, sched_run_t *run)
 {
-    // ENTER instruction opcode
-    *tgt_addr = 0xC8;
-    tgt_addr += BYTE1_OFF;
-    
-    // 16-bit stack size (little-endian format)
-    *(short *)tgt_addr = stack_size;
-    tgt_addr += BYTE2_OFF;
-    
-    // 8-bit nesting level  
-    *tgt_addr = nesting_level;
-    tgt_addr += BYTE1_OFF;
-    
-    return tgt_addr;
+	if (value && strcmp(value, "shared") == 0)
+		run->shared = 1;
+	else if (value && strcmp(value, "private") == 0)
+		run->shared = 0;
+	else
+		return -1;
+	return 0;
 }
 
-static inline volatile char *leave(volatile char *tgt_addr)
+/*
+ * log policy "n", "failed" or "all" of -g and log=, 0 on success
+ */
+static int parse_log_every(const char *value, long *every)
 {
-    // LEAVE instruction: C9
-    *tgt_addr = 0xC9;
-    tgt_addr += BYTE1_OFF;
-    
-    return tgt_addr;
+	char *end;
+
+	if (value && strcmp(value, "all") == 0)
+		*every = LOG_ALL;
+	else if (value && strcmp(value, "failed") == 0)
+		*every = LOG_FAILED;
+	else if (!value || (*every = strtol(value, &end, 0)) <= 0 || *end)
+		return -1;
+	return 0;
 }
 
-static inline volatile char *ret(volatile char *tgt_addr)
+/*
+ * parse the -J job mode spec (jobs=, sizes=, profiles=, sharing=), 0 on success
+ */
+int parse_jobs(char *spec)
 {
-    // RET instruction: C3
-    *tgt_addr = 0xC3;
-    tgt_addr += BYTE1_OFF;
-    
-    return tgt_addr;
+	char *const tokens[] = { "jobs", "sizes", "profiles", "sharing", NULL };
+	sched_run_t *run = &sched_cmdline;
+	char *value;
+
+	sched_mode = 1;
+	while (*spec) {
+		switch (getsubopt(&spec, tokens, &value)) {
+		case 0:
+			if (!value || (run->njobs = atol(value)) <= 0) {
+				fprintf(stderr, "Bad -J jobs=%s\n", value ? value : "");
+				return -1;
+			}
+			break;
+		case 1:
+			if (parse_sizes(value, run) != 0) {
+				fprintf(stderr, "Bad -J sizes=%s, want N or min-max\n", value ? value : "");
+				return -1;
+			}
+			break;
+		case 2:
+			if (parse_profiles(value, run) != 0) {
+				fprintf(stderr, "Bad -J profiles=%s\n", value ? value : "");
+				return -1;
+			}
+			break;
+		case 3:
+			if (parse_sharing(value, run) != 0) {
+				fprintf(stderr, "Bad -J sharing=%s, want shared or private\n", value ? value : "");
+				return -1;
+			}
+			break;
+		default:
+			fprintf(stderr, "Bad -J suboption %s\n", value ? value : "");
+			return -1;
+		}
+	}
+	return 0;
 }
 
-static inline volatile char *add_headeri(volatile char *tgt_addr)
+/*
+ * Function: parse_campaign
+ *
+ * Description: read a campaign spec, one run per line of key=value words:
+ *
+ *   # seeds     sizes       profiles          workers  sharing
+ *   seeds=1-100 sizes=100-1000 profiles=random  workers=4 sharing=shared
+ *   seeds=500   sizes=20000    profiles=fill-mov+fill-xadd workers=2 log=failed
+ *
+ *              seeds is required, the rest default to num_instructions, -p,
+ *              num_threads, private and -g.  '#' starts a comment.
+ *
+ * Returns: 0 on success, the runs are left in sched_runs
+ */
+int parse_campaign(const char *path)
 {
-	// Create stack frame with ENTER $2048, 0
-    tgt_addr = enter(2048, 0, tgt_addr);
-	
+	FILE *f = fopen(path, "r");
+	char line[1024];
+	int lineno = 0;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	sched_runs = NULL;
+	sched_nruns = 0;
+	while (fgets(line, sizeof(line), f)) {
+		sched_run_t run;
+		char *word, *save, *value, why[300] = "";
+		int bad = 0, have_seeds = 0, nwords = 0;
+		unsigned last;
+
+		lineno++;
+		if ((word = strchr(line, '#')) != NULL)
+			*word = 0;
+		memset(&run, 0, sizeof(run));
+		for (word = strtok_r(line, " \t\r\n", &save); word && !bad; word = strtok_r(NULL, " \t\r\n", &save)) {
+			value = strchr(word, '=');
+			if (!value) {
+				snprintf(why, sizeof(why), "%s is not key=value", word);
+				bad = 1;
+				break;
+			}
+			*value++ = 0;
+			nwords++;
+			if (strcmp(word, "seeds") == 0) {
+				int n = sscanf(value, "%u-%u", &run.first_seed, &last);
+
+				if (n == 1)
+					last = run.first_seed;
+				bad = n < 1 || last < run.first_seed;
+				run.njobs = (long)last - run.first_seed + 1;
+				have_seeds = 1;
+			} else if (strcmp(word, "sizes") == 0) {
+				bad = parse_sizes(value, &run);
+			} else if (strcmp(word, "profiles") == 0) {
+				bad = parse_profiles(value, &run);
+			} else if (strcmp(word, "workers") == 0) {
+				run.workers = atoi(value);
+				bad = run.workers < 1 || run.workers > MAX_THREADS;
+			} else if (strcmp(word, "sharing") == 0) {
+				bad = parse_sharing(value, &run);
+			} else if (strcmp(word, "log") == 0) {
+				bad = parse_log_every(value, &run.log_every);
+			} else {
+				snprintf(why, sizeof(why), "unknown key %s=, want seeds, sizes, profiles, workers, sharing or log",
+					 word);
+				bad = 1;
+			}
+			if (bad && !why[0])
+				snprintf(why, sizeof(why), "bad %s=%s", word, value);
+		}
+		if (!bad && !nwords)
+			continue;   // blank line
+		if (bad || !have_seeds) {
+			fprintf(stderr, "%s:%d: bad run spec, %s\n", path, lineno, bad ? why : "seeds= is required");
+			fclose(f);
+			return -1;
+		}
+		sched_runs = realloc(sched_runs, (sched_nruns + 1) * sizeof(*sched_runs));
+		if (!sched_runs) {
+			fclose(f);
+			return -1;
+		}
+		sched_runs[sched_nruns++] = run;
+	}
+	fclose(f);
+	if (!sched_nruns) {
+		fprintf(stderr, "%s: no runs\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * parse the -X atomicity check spec (iters=, lines=, scale), 0 on success
+ */
+int parse_atom(char *spec)
+{
+	char *const tokens[] = { "iters", "lines", "scale", NULL };
+	char *value;
+
+	atom_iters = 100000;
+	while (*spec) {
+		switch (getsubopt(&spec, tokens, &value)) {
+		case 0:
+			if (!value || (atom_iters = atol(value)) <= 0) {
+				fprintf(stderr, "Bad -X iters=%s\n", value ? value : "");
+				return -1;
+			}
+			break;
+		case 1:
+			atom_lines = value ? atoi(value) : 0;
+			if (atom_lines < 1 || atom_lines > ATOM_MAX_LINES) {
+				fprintf(stderr, "-X lines must be 1..%d\n", ATOM_MAX_LINES);
+				return -1;
+			}
+			break;
+		case 2:
+			atom_scale = 1;
+			break;
+		default:
+			fprintf(stderr, "Bad -X suboption %s\n", value ? value : "");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * parse the -x cross-modifying code spec (field=, sites=, iters=, rounds=, nocpuid), 0 on success
+ */
+int parse_xmc(char *spec)
+{
+	char *const tokens[] = { "field", "sites", "iters", "rounds", "nocpuid", NULL };
+	char *value;
+	int f;
+
+	xmc_iters = 100000;
+	while (*spec) {
+		switch (getsubopt(&spec, tokens, &value)) {
+		case 0:
+			for (f = 0; f < NUM_XMC_FIELDS; f++)
+				if (value && strcmp(value, xmc_field_names[f]) == 0)
+					break;
+			if (f == NUM_XMC_FIELDS) {
+				fprintf(stderr, "Bad -x field=%s (imm or disp)\n", value ? value : "");
+				return -1;
+			}
+			xmc_field = f;
+			break;
+		case 1:
+			xmc_sites = value ? atoi(value) : 0;
+			if (xmc_sites < 1 || xmc_sites > XMC_MAX_SITES) {
+				fprintf(stderr, "-x sites must be 1..%d\n", XMC_MAX_SITES);
+				return -1;
+			}
+			break;
+		case 2:
+			if (!value || (xmc_iters = atol(value)) <= 0) {
+				fprintf(stderr, "Bad -x iters=%s\n", value ? value : "");
+				return -1;
+			}
+			break;
+		case 3:
+			if (!value || (xmc_rounds = atol(value)) < 0) {
+				fprintf(stderr, "Bad -x rounds=%s\n", value ? value : "");
+				return -1;
+			}
+			break;
+		case 4:
+			xmc_cpuid = 0;
+			break;
+		default:
+			fprintf(stderr, "Bad -x suboption %s\n", value ? value : "");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * parse -Z lz4[,size=N[KMG]][,secs=T]
+ */
+int parse_logsink(char *spec)
+{
+	char *const tokens[] = { "lz4", "size", "secs", NULL };
+	char *value, *end;
+
+	log_sink = 1;
+	while (*spec) {
+		switch (getsubopt(&spec, tokens, &value)) {
+		case 0:
+			break;
+		case 1:
+			if (!value || (log_rotate_bytes = strtoul(value, &end, 0)) == 0) {
+				fprintf(stderr, "Bad -Z size=%s\n", value ? value : "");
+				return -1;
+			}
+			switch (*end) {
+				case 'g': case 'G': log_rotate_bytes <<= 10;   // fall through
+				case 'm': case 'M': log_rotate_bytes <<= 10;   // fall through
+				case 'k': case 'K': log_rotate_bytes <<= 10;
+			}
+			break;
+		case 2:
+			if (!value || (log_rotate_secs = atof(value)) <= 0) {
+				fprintf(stderr, "Bad -Z secs=%s\n", value ? value : "");
+				return -1;
+			}
+			break;
+		default:
+			fprintf(stderr, "Bad -Z suboption %s\n", value ? value : "");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * simple routine to randomize numbers in a range
+ */
+int rand_range(int min_n, int max_n)
+{
+	return rand() % (max_n - min_n + 1) + min_n;
+}
+
+
+main(int argc, char *argv[])
+{
+
+	int opt, rc = 0, started;
+	unsigned long comm_bytes;
+	struct timespec t0, t1;
+
+	/* process options first, getopt moves them ahead of the positional arguments */
+	while ((opt = getopt(argc, argv, "B:I:T:p:S:P:N:j:m:W:A:L:D:l:X:x:M:J:t:w:Z:g:C:cF:K:s")) != -1) {
+		switch (opt) {
+		case 'B':
+			bench_file = optarg;
+			break;
+		case 'I':
+			timing_file = optarg;
+			break;
+		case 'C':
+			cov_file = optarg;
+			break;
+		case 'c':
+			cov_directed = 1;
+			break;
+		case 'F':
+			campaign_file = optarg;
+			break;
+		case 'K':
+			prog_cache_dir = optarg;
+			break;
+		case 's':
+			pic_mode = 1;
+			break;
+		case 'J':
+			if (parse_jobs(optarg) != 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 't':
+			if ((run_deadline = atof(optarg)) <= 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			sched_mode = 1;
+			break;
+		case 'w':
+			if ((watchdog_secs = atof(optarg)) <= 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'M':
+			if (optarg[0] != '/' || strlen(optarg) >= STATS_NAME_MAX || strchr(optarg + 1, '/')) {
+				fprintf(stderr, "-M: name must be /name, at most %d characters\n", STATS_NAME_MAX - 1);
+				exit(1);
+			}
+			strcpy(stats_name, optarg);
+			break;
+		case 'T':
+			for (worker_backend = 0; worker_backend < NUM_WORKER_BACKENDS; worker_backend++)
+				if (strcmp(optarg, worker_backend_names[worker_backend]) == 0)
+					break;
+			if (worker_backend == NUM_WORKER_BACKENDS) {
+				fprintf(stderr, "Unknown -T backend %s\n", optarg);
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'p':
+			if ((profile = profile_by_name(optarg)) < 0) {
+				fprintf(stderr, "Unknown profile %s\n", optarg);
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'S': {
+			char *end;
+
+			data_bytes = strtoul(optarg, &end, 0);
+			switch (*end) {
+				case 'g': case 'G': data_bytes <<= 10;   // fall through
+				case 'm': case 'M': data_bytes <<= 10;   // fall through
+				case 'k': case 'K': data_bytes <<= 10;
+			}
+			if (data_bytes < MAX_DATA_BYTES || data_bytes > MAX_DATA_SIZE) {
+				fprintf(stderr, "-S must be %d..%lu bytes\n", MAX_DATA_BYTES, MAX_DATA_SIZE);
+				exit(1);
+			}
+			data_bytes = (data_bytes + PAGESIZE - 1) & ~(unsigned long)(PAGESIZE - 1);
+			break;
+		}
+		case 'P':
+			for (precond = 0; precond < NUM_PRECONDS; precond++)
+				if (strcmp(optarg, precond_names[precond]) == 0)
+					break;
+			if (precond == NUM_PRECONDS) {
+				fprintf(stderr, "Unknown -P mode %s\n", optarg);
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'N':
+			for (numa_mode = 0; numa_mode < NUM_NUMA_MODES; numa_mode++)
+				if (strcmp(optarg, numa_mode_names[numa_mode]) == 0)
+					break;
+			if (numa_mode == NUM_NUMA_MODES) {
+				fprintf(stderr, "Unknown -N mode %s\n", optarg);
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'j':
+			gen_threads = atoi(optarg);
+			if (gen_threads < 1) gen_threads = 1;
+			if (gen_threads > MAX_GEN_THREADS) gen_threads = MAX_GEN_THREADS;
+			break;
+		case 'm':
+			mut_iters = atoi(optarg);
+			break;
+		case 'W':
+			mut_window = atoi(optarg);
+			if (mut_window < 1) mut_window = 1;
+			break;
+		case 'A':
+			if (parse_layout(optarg) != 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'L':
+			loop_iters = atoi(optarg);
+			break;
+		case 'D':
+			dep_streams = atoi(optarg);
+			if (dep_streams < 0) dep_streams = 0;
+			if (dep_streams > MAX_DEP_STREAMS) dep_streams = MAX_DEP_STREAMS;
+			break;
+		case 'l':
+			if (parse_litmus(optarg) != 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'X':
+			if (parse_atom(optarg) != 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'x':
+			if (parse_xmc(optarg) != 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'Z':
+			if (parse_logsink(optarg) != 0) {
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'g':
+			if (parse_log_every(optarg, &log_every) != 0) {
+				fprintf(stderr, "Bad -g %s, want n, failed or all\n", optarg);
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		default:
+			usage(argv[0]);
+			exit(1);
+		}
+	}
+	argv += optind - 1;   // argv[1] is the first positional argument again
+	argc -= optind - 1;
+
+	/* process arguments here */
+	if (argc >= 2) seed = atoi(argv[1]);
+	if (argc >= 3) target_ninstrs = atoi(argv[2]);
+	if (argc >= 4) nthreads = atoi(argv[3]);
+	{
+		int t;
+
+		for (t = 0; t < MAX_THREADS; t++)
+			log_rings[t].every = log_every;
+	}
+
+	char logfilename[256] = "";
+	
+
+	if (argc >= 5 && strlen(argv[4]) > 0) {
+		strcpy(logfilename, argv[4]);
+		log_sink_path = logfilename;
+		logfile = log_sink ? logsink_open(logfilename, log_rotate_bytes, log_rotate_secs) : fopen(logfilename, "w");
+		if (!logfile) {
+			fprintf(stderr, "Error: Cannot open log file %s\n", logfilename);
+			exit(1);
+		}
+		printf("Logging to: %s%s\n", logfilename, log_sink ? ".<n>.lz4" : "");
+	} else if (log_sink) {
+		fprintf(stderr, "-Z needs a logfile argument\n");
+		exit(1);
+	}
+
+	printf("\nstarting seed = %d\n", seed);
+	printf("Number of instructions = %d\n", target_ninstrs);
+	printf("Number of threads = %d\n", nthreads);
+	printf("Profile = %s\n", profile_names[profile]);
+	printf("Data bytes per thread = %lu\n", data_bytes);
+	printf("Generator threads = %d\n", gen_threads);
+	if (log_every == LOG_FAILED)
+		printf("Log detail = faulting programs\n");
+	else if (log_every > 0)
+		printf("Log detail = faulting programs and 1 in %ld\n", log_every);
+
+	if (litmus) {
+		// the test decides the number of workers
+		nthreads = litmus->nroles;
+		printf("Litmus test = %s, fence = %s, %ld iterations on %d workers\n", litmus->name,
+		       litmus_fence_names[litmus_fence], litmus_iters, nthreads);
+	} else if (atom_iters) {
+		printf("Atomicity check = %ld iterations on %d lines%s\n", atom_iters, atom_lines,
+		       atom_scale ? ", scaling from 1 worker" : "");
+	} else if (xmc_iters) {
+		// a target and its patcher
+		nthreads = 2;
+		printf("Cross-modifying code = %s field of %d sites, %ld racing executions, %ld %s handshakes\n",
+		       xmc_field_names[xmc_field], xmc_sites, xmc_iters, xmc_rounds, xmc_cpuid ? "CPUID" : "unserialized");
+	}
+
+	if (campaign_file) {
+		if (parse_campaign(campaign_file) != 0)
+			exit(1);
+		sched_mode = 1;
+	}
+	if (sched_mode) {
+		int r, max_size = 0, max_workers = 0;
+
+		if (litmus || atom_iters || xmc_iters || bench_file || timing_file || worker_backend != WORKER_FORK) {
+			fprintf(stderr, "Job mode needs the fork backend and does not mix with -l, -X, -x, -B or -I\n");
+			exit(1);
+		}
+		if (!sched_runs[0].njobs && !run_deadline) {
+			fprintf(stderr, "Job mode needs jobs= or a -t deadline\n");
+			exit(1);
+		}
+		sched_cmdline.first_seed = seed;
+		for (r = 0; r < sched_nruns; r++) {
+			sched_run_t *run = &sched_runs[r];
+
+			if (!run->min)
+				run->min = run->max = target_ninstrs;
+			if (!run->nprofiles)
+				run->profiles[run->nprofiles++] = profile;
+			if (!run->workers)
+				run->workers = nthreads;
+			if (!run->log_every)
+				run->log_every = log_every;
+			if (run->max > max_size)
+				max_size = run->max;
+			if (run->workers > max_workers)
+				max_workers = run->workers;
+			printf("Run %d = seeds %u-%lu (%ld jobs, 0 = unlimited), %d-%d instructions, %d workers, %s DATA\n", r,
+			       run->first_seed, run->first_seed + (run->njobs ? run->njobs - 1 : 0), run->njobs,
+			       run->min, run->max, run->workers, run->shared ? "shared" : "private");
+		}
+		// the buffers and workers are set up once for the largest run
+		target_ninstrs = max_size;
+		nthreads = max_workers;
+		if (run_deadline)
+			printf("Deadline = %.1f s\n", run_deadline);
+	}
+
+	if (pic_mode) {
+		// the workers share the code, so nothing may rewrite it under them
+		if (sched_mode || litmus || atom_iters || xmc_iters || bench_file || timing_file || mut_iters) {
+			fprintf(stderr, "-s does not mix with job mode, -l, -X, -x, -B, -I or -m\n");
+			exit(1);
+		}
+		printf("Position independent program shared by all workers\n");
+	}
+
+	if (watchdog_secs > 0) {
+		// a thread cannot be killed on its own
+		if (worker_backend != WORKER_FORK) {
+			fprintf(stderr, "The watchdog needs the fork backend\n");
+			exit(1);
+		}
+		// the other workers would wait for a killed one at the next barrier forever
+		if (litmus || atom_iters || xmc_iters) {
+			fprintf(stderr, "The watchdog does not mix with -l, -X or -x, their workers run in lockstep\n");
+			exit(1);
+		}
+		printf("Watchdog = %.1f s without a heartbeat\n", watchdog_secs);
+	}
+
+	if (nthreads > MAX_THREADS) {
+		fprintf(logfile,"Sorry only built for %d threads over riding your %d\n", MAX_THREADS, nthreads);
+		fflush(logfile);
+		nthreads=MAX_THREADS;
+	}
+
+	srand(seed);
+
+	have_avx = __builtin_cpu_supports("avx");
+
+	// CLFLUSHOPT and CLWB are CPUID.(EAX=7,ECX=0):EBX bits 23 and 24
+	if (precond == PRE_FLUSHOPT || precond == PRE_CLWB) {
+		unsigned int a, b = 0, c, d;
+
+		__get_cpuid_count(7, 0, &a, &b, &c, &d);
+		if (!(b & (1U << (precond == PRE_FLUSHOPT ? 23 : 24)))) {
+			printf("No %s on this CPU, preconditioning with clflush\n", precond_names[precond]);
+			precond = PRE_FLUSH;
+		}
+	}
+	printf("Preconditioning = %s\n", precond_names[precond]);
+
+	if (prog_cache_dir) {
+		if (mkdir(prog_cache_dir, 0755) != 0 && errno != EEXIST) {
+			perror(prog_cache_dir);
+			exit(1);
+		}
+		printf("Program cache = %s\n", prog_cache_dir);
+	}
+
+	// generator helpers may use every CPU we started with, workers get bound below
+	if (sched_getaffinity(0, sizeof(gen_cpus), &gen_cpus) != 0) {
+		CPU_ZERO(&gen_cpus);
+		CPU_SET(0, &gen_cpus);
+	}
+
+	// the benchmark builds programs up to BENCH_MAX_INSTRS in worker 0's buffers
+	if (bench_file) {
+		target_ninstrs = BENCH_MAX_INSTRS;
+		nthreads = 1;
+	}
+	// the timing bodies go in worker 0's CODE too, header and trailer fit in the slack
+	if (timing_file) {
+		target_ninstrs = TIMING_UNROLL;
+		nthreads = 1;
+	}
+
+	// size the code buffers for the worst case encoding of every instruction plus -A padding
+	{
+		unsigned long slot = ENC_SLOT(profile), need;
+		int r, k;
+
+		for (r = 0; sched_mode && r < sched_nruns; r++)
+			for (k = 0; k < sched_runs[r].nprofiles; k++)
+				if (ENC_SLOT(sched_runs[r].profiles[k]) > slot)
+					slot = ENC_SLOT(sched_runs[r].profiles[k]);
+		need = (unsigned long)target_ninstrs * slot + align_body;
+
+		if (align_every)
+			need += ((unsigned long)target_ninstrs / align_every + 1) * (align_straddle ? align_straddle : align_to);
+		if (need + PAGESIZE > instr_bytes)
+			instr_bytes = (need + 2 * PAGESIZE) & ~(unsigned long)(PAGESIZE - 1);
+	}
+
+	/* allocate buffer to perform stores and loads to  */
+
+
+	test_info[DATA].pointer_addr = mmap(
+		(void *) 0,
+		(data_bytes+PAGESIZE-1) * nthreads,
+		PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANONYMOUS | MAP_SHARED,
+		0, 0
+		);
+
+	/* save the base address for debug like before */
+
+	mdptr=(volatile char *)test_info[DATA].pointer_addr;
+
+	if (((int *)test_info[DATA].pointer_addr) == (int *)-1) {
+		perror("Couldn't mmap (MAX_DATA_BYTES)");
+		exit(1);
+	}
+
+
+	
+	/* allocate buffer to build instructions into */
+
+	test_info[CODE].pointer_addr = mmap(
+		(void *) 0,
+		(instr_bytes+PAGESIZE-1) * nthreads,
+		PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_ANONYMOUS | MAP_SHARED,
+		0, 0
+		);
+
+	/* keep a copy to the base here */
+
+	mptr=(volatile char *)test_info[CODE].pointer_addr;
+
+	if (((int *)test_info[CODE].pointer_addr) == (int *)-1) {
+		perror("Couldn't mmap (MAX_INSTR_BYTES)");
+		exit(1);
+	}
+
+
+	/* allocate buffer to build communications area into, big enough for the lockstep modes' layout,
+	   in shared memory behind the live stats block */
+
+	comm_bytes = (MAX_COMM_BYTES+PAGESIZE-1) * nthreads;
+	if (comm_bytes < comm_layout_bytes())
+		comm_bytes = comm_layout_bytes();
+
+	test_info[COMM].pointer_addr = stats_open(comm_bytes);
+
+	comm_ptr=(volatile char *)test_info[COMM].pointer_addr;
+
+	if (((int *)test_info[COMM].pointer_addr) == (int *)-1) {
+		perror("Couldn't mmap (MAX_INSTR_BYTES)");
+		exit(1);
+	}
+
+	worker_results = mmap(NULL, MAX_THREADS * sizeof(worker_result_t), PROT_READ | PROT_WRITE,
+			      MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+	if (worker_results == MAP_FAILED) {
+		perror("Couldn't mmap (worker results)");
+		exit(1);
+	}
+
+	/* make the standard output and stderrr unbuffered */
+
+	setbuf(stdout, (char *) NULL);
+	setbuf(stderr, (char *) NULL);
+
+
+	// a fault in generated code ends that run, not the worker
+	guard_install();
+
+	if (bench_file)
+		rc = bench_run(bench_file);
+	if (timing_file)
+		rc |= timing_run(timing_file);
+
+	if (sched_mode)
+		sched_init();
+
+	// -s: one build in worker 0's CODE, before any worker can run it
+	if (pic_mode) {
+		mptr_threads[0]=(tptrs)mptr;
+		mdptr_threads[0]=(tptrs)mdptr;
+		pic_ninstrs=build_program(mptr,0,logfile);
+		pic_bw_bytes = bw_pass_bytes;
+		log_ring_end(0, logfile, 0, seed);   // sampled now, the workers did not build it
+		stats_update(0, 1, 0, 0, 0, 0, 0);
+	}
+
+	/* start appropriate # of threads */
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i=0;i<nthreads && !bench_file && !timing_file;i++) 
+	{
+	
+		next_ptr=(mptr+(i*instr_bytes));              // init next_ptr
+		fprintf(logfile,"T%d next_ptr=0x%lx\n",i,(unsigned long)next_ptr);
+		fflush(logfile);
+		mdptr_threads[i]=(tptrs)mdptr;  // init threads data pointer
+		if (profile == PROF_BANDWIDTH || numa_mode != NUMA_OFF || sched_mode || pic_mode)
+			mdptr_threads[i]=(tptrs)(mdptr + i * data_bytes);  // a slice each
+
+		// pages are not touched yet, so the policy decides where they land
+		if (numa_mode != NUMA_OFF && numa_place(i, logfile) != 0)
+			exit(1);
+		mptr_threads[i]=(tptrs)(pic_mode ? mptr : next_ptr);  // save ptr per thread
+		comm_ptr_threads[i]=(tptrs)comm_ptr;                 // everyone gets the same for now
+
+		if (worker_start(i) != 0) {
+			rc = 1;
+			break;
+		}
+	     
+	} // end for nthreads
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	started = i;
+	if (started)
+		printf("Started %d workers (%s) in %.3f ms\n", started, worker_backend_names[worker_backend],
+		       ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / 1e6);
+
+
+	// feed the job queue until it is drained or the deadline passes
+	if (sched_mode)
+		sched_run(started, logfile);
+
+	// wait for threads to complete
+
+	if (watchdog_secs > 0)
+		watchdog_wait(started, logfile);
+	else for (i=0;i<started;i++) {
+		worker_wait(i);
+	}
+
+	if (sched_mode)
+		sched_report(started, logfile);
+	if (!litmus && !atom_iters && !xmc_iters && !bench_file && !timing_file)
+		cov_report(logfile);
+	if (atom_iters && atom_report(logfile) != 0)
+		rc = 1;
+	if (xmc_iters && xmc_report(logfile) != 0)
+		rc = 1;
+	if (numa_mode != NUMA_OFF)
+		numa_report(logfile);
+	for (i = 0; i < started; i++)
+		if (stats->worker[i].hangs)
+			rc = 1;
+	stats->done = 1;
+
+
+	// clean up the allocation before getting out
+
+	munmap((caddr_t)mdptr,(data_bytes+PAGESIZE-1)*nthreads);
+	munmap((caddr_t)mptr,(instr_bytes+PAGESIZE-1)*nthreads);
+	stats_close(comm_bytes);
+	munmap(worker_results, MAX_THREADS * sizeof(worker_result_t));
+
+	// Close log file
+	if (logfile) {
+		fclose(logfile);
+	}
+
+	return rc;
+}
+
+/*
+ * Function: executeit
+ * 
+ * Description:
+ *
+ * This function will start executing at the function address passed into it 
+ * and return an integer return value that will be used to indicate pass(0)/fail(1)
+ * A signal raised by the code ends the run, exec_signal says which one.
+ *
+ * INTPUTs:  funct_t start_addr :      function pointer 
+ *           volatile char *data:      DATA base, the first argument (only -s programs use it)
+ *
+ * Returns:  int                :      0 for pass, 1 for fail
+ */   
+int executeit(funct_t start_addr, volatile char *data) 
+{
+
+	volatile int i,rc=0;
+	unsigned long t0;
+
+	i=0;
+
+	// LFENCE keeps the TSC reads from moving across the test
+	_mm_lfence();
+	t0 = __rdtsc();
+	_mm_lfence();
+
+	rc=guard_call(start_addr, (void *)data, &exec_signal);
+
+	_mm_lfence();
+	exec_cycles = __rdtsc() - t0;
+
+	return(exec_signal ? 1 : 0);
+}
+
+/*
+ * CPU a worker is bound to: the workers go round robin over the CPUs we were
+ * started on, sharing them when there are more workers than CPUs
+ */
+int worker_cpu(int thread_id)
+{
+	int n = CPU_COUNT(&gen_cpus), cpu;
+
+	if (n == 0)
+		return 0;
+	thread_id %= n;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &gen_cpus) && thread_id-- == 0)
+			return cpu;
+	return 0;
+}
+
+/*
+ * Function: worker_main
+ *
+ * Description: everything one worker does, on either backend: bind to its CPU,
+ *              then run the selected mode
+ *
+ * Returns: 0 on success
+ */
+int worker_main(int thread_id)
+{
+	unsigned long passes = loop_iters > 1 ? loop_iters : 1;
+	worker_result_t *res = &worker_results[thread_id];
+	int ibuilt;
+
+	// the thread id, which is the process id on the fork backend
+	if (bind_to_cpu(worker_cpu(thread_id), (pid_t)syscall(SYS_gettid)) != 0)
+		return 1;
+	stats_update(thread_id, 0, 0, 0, 0, 0, 0);   // first heartbeat
+
+	if (litmus) {
+		litmus_run(thread_id, logfile);
+		return 0;
+	}
+	if (sched_mode) {
+		sched_worker(thread_id, logfile);
+		return 0;
+	}
+	if (atom_iters) {
+		atom_run(thread_id, logfile);
+		return 0;
+	}
+	if (xmc_iters) {
+		xmc_run(thread_id, logfile);
+		return 0;
+	}
+
+	if (pic_mode) {
+		// the parent built the shared program
+		ibuilt = pic_ninstrs;
+		bw_pass_bytes = pic_bw_bytes;
+		LOG_AND_PRINT("running the shared program at 0x%lx on DATA 0x%lx\n", (long)mptr_threads[thread_id],
+			      (long)mdptr_threads[thread_id]);
+	} else {
+		ibuilt=build_program((volatile char *)mptr_threads[thread_id],thread_id,logfile);  // build instructions
+		stats_update(thread_id, 0, 0, 0, 0, 0, 0);   // heartbeat, the watchdog times the run alone
+	}
+
+	/* ok now that I built the critters, time to execute them */
+
+	if (executeit((funct_t)mptr_threads[thread_id], (volatile char *)mdptr_threads[thread_id]) != 0)
+		LOG_AND_PRINT("fault: signal %d\n", exec_signal);
+	stats_update(thread_id, !pic_mode, 1, (unsigned long)ibuilt * passes, exec_cycles, exec_signal != 0, 0);
+	log_ring_end(thread_id, logfile, exec_signal != 0, seed + thread_id);
+	fprintf(logfile,"T%d execution cycles: %lu\n", thread_id, exec_cycles);
+	if (profile == PROF_BANDWIDTH && exec_cycles)
+		fprintf(logfile,"T%d bandwidth: %lu bytes, %.2f bytes/cycle\n", thread_id,
+			bw_pass_bytes * passes, (double)bw_pass_bytes * passes / exec_cycles);
+
+	res->cpu = worker_cpu(thread_id);
+	res->cpu_node = numa_node_of_cpu(res->cpu);
+	res->mem_node = numa_mem_node(mdptr_threads[thread_id]);
+	res->cycles = exec_cycles;
+	res->instrs = (unsigned long)ibuilt * passes;
+	res->bytes = bw_pass_bytes * passes;
+	fprintf(logfile,"T%d generation program complete, instructions generated: %d\n",thread_id, ibuilt);
+	fflush(logfile);
+
+	if (mut_iters > 0)
+		mutate_campaign(thread_id, logfile);
+	return 0;
+}
+
+static void *worker_thread(void *arg)
+{
+	return (void *)(long)worker_main((int)(long)arg);
+}
+
+/*
+ * Function: worker_start
+ *
+ * Description: start worker thread_id on the selected backend.  Forked workers
+ *              exit when done, threads are created already pinned to their CPU.
+ *
+ * Returns: 0, or -1 if the worker could not be started
+ */
+int worker_start(int thread_id)
+{
+	if (worker_backend == WORKER_PTHREAD) {
+		pthread_attr_t attr;
+		cpu_set_t mask;
+		int err;
+
+		CPU_ZERO(&mask);
+		CPU_SET(worker_cpu(thread_id), &mask);
+		pthread_attr_init(&attr);
+		pthread_attr_setaffinity_np(&attr, sizeof(mask), &mask);
+		err = pthread_create(&workers[thread_id].tid, &attr, worker_thread, (void *)(long)thread_id);
+		pthread_attr_destroy(&attr);
+		if (err) {
+			fprintf(stderr, "T%d: pthread_create: %s\n", thread_id, strerror(err));
+			return -1;
+		}
+		return 0;
+	}
+
+	/* use fork to start a new child process */
+
+	if ((workers[thread_id].pid = fork()) == 0) {
+		if (log_sink) {
+			// the parent's writer thread is not in this process, log through one of our own;
+			// the pid keeps a worker respawned by -w from truncating the hung one's log
+			char name[300];
+
+			snprintf(name, sizeof(name), "%s.T%d.%d", log_sink_path, thread_id, (int)getpid());
+			logfile = logsink_open(name, log_rotate_bytes, log_rotate_secs);
+			if (!logfile) {
+				fprintf(stderr, "T%d: Cannot open log file %s.0.lz4\n", thread_id, name);
+				exit(1);
+			}
+		}
+		fprintf(logfile,"T%d fork\n",thread_id);
+		fflush(logfile);
+		exit(worker_main(thread_id));
+	}
+	if (workers[thread_id].pid == -1) {
+		perror("fork me failed");
+		return -1;
+	}
+
+	fprintf(logfile,"child T%d started:\n",workers[thread_id].pid);
+	fflush(logfile);
+	return 0;
+}
+
+/*
+ * wait for worker thread_id to finish
+ */
+void worker_wait(int thread_id)
+{
+	if (worker_backend == WORKER_PTHREAD)
+		pthread_join(workers[thread_id].tid, NULL);
+	else
+		waitpid(workers[thread_id].pid, NULL, 0);
+}
+
+int bind_to_cpu(int thread_id, pid_t pid) {
+    cpu_set_t mask;
+    
+    CPU_ZERO(&mask);                    // Clear all CPU bits
+    CPU_SET(thread_id, &mask);          // Set bit for specific CPU
+    
+    if (sched_setaffinity(pid, sizeof(mask), &mask) == -1) {
+        perror("sched_setaffinity failed");
+        return -1;
+    }
+    
+	fprintf(logfile, "Assigned process %d to CPU_%d\n", pid, thread_id);
+	fflush(logfile);
+
+	    cpu_set_t verify_mask;
+    if (sched_getaffinity(pid, sizeof(verify_mask), &verify_mask) == 0) {
+		fprintf(logfile,"Verified: Process %d bound to CPU_%d = %s\n", pid, thread_id, CPU_ISSET(thread_id, &verify_mask) ? "SUCCESS" : "FAILED");
+		fflush(logfile);
+    }
+    return 0;
+}
+
+static inline volatile char *enter(short stack_size, char nesting_level, volatile char *tgt_addr)
+{
+    // ENTER instruction opcode
+    *tgt_addr = 0xC8;
+    tgt_addr += BYTE1_OFF;
+    
+    // 16-bit stack size (little-endian format)
+    *(short *)tgt_addr = stack_size;
+    tgt_addr += BYTE2_OFF;
+    
+    // 8-bit nesting level  
+    *tgt_addr = nesting_level;
+    tgt_addr += BYTE1_OFF;
+    
+    return tgt_addr;
+}
+
+static inline volatile char *leave(volatile char *tgt_addr)
+{
+    // LEAVE instruction: C9
+    *tgt_addr = 0xC9;
+    tgt_addr += BYTE1_OFF;
+    
+    return tgt_addr;
+}
+
+static inline volatile char *ret(volatile char *tgt_addr)
+{
+    // RET instruction: C3
+    *tgt_addr = 0xC3;
+    tgt_addr += BYTE1_OFF;
+    
+    return tgt_addr;
+}
+
+/*
+ * depth nested calls, position independent:
+ *
+ *       CALL f1 ; JMP end ; f1: CALL f2 ; RET ; ... ; f<depth>: RET ; end:
+ *
+ * every RET returns to the instruction after its CALL, so the return stack buffer
+ * predicts all of them unless depth is more than it holds
+ */
+static inline volatile char *call_nest(int depth, volatile char *tgt_addr)
+{
+    int k;
+
+    // CALL rel32 to f1, right behind the 2-byte JMP
+    *tgt_addr++ = 0xE8;
+    *(volatile int *)tgt_addr = 2;
+    tgt_addr += BYTE4_OFF;
+    *tgt_addr++ = 0xEB;
+    *tgt_addr++ = 6 * (depth - 1) + 1;
+
+    for (k = 1; k < depth; k++) {
+        *tgt_addr++ = 0xE8;
+        *(volatile int *)tgt_addr = 1;   // over the RET of this level
+        tgt_addr += BYTE4_OFF;
+        tgt_addr = ret(tgt_addr);
+    }
+    return ret(tgt_addr);
+}
+
+/*
+ * MOV reg,[RSP], an explicit RSP use (build_mov_memory_to_register has no SIB for RSP)
+ */
+static inline volatile char *load_rsp(int reg, volatile char *tgt_addr)
+{
+    *tgt_addr++ = REX_BASE | REX_W | (reg >= 8 ? REX_R : 0);
+    *tgt_addr++ = 0x8B;
+    return build_modrm_mem(reg, REG_RSP, 0, tgt_addr);
+}
+
+//
+// generator tables
+//
+
+// Available registers (excluding RBP=5, RSP=4, RSI=6, R12=12, R13=13)
+static const int safe_registers[] = {0, 1, 2, 3, 7, 8, 9, 10, 11, 14, 15};
+static const int num_safe_regs = 11;
+
+// Displacement types for memory operations
+enum disp_type {
+    DISP_0 = 0,
+    DISP_8 = 1,
+    DISP_32 = 2
+};
+static const int num_disp_types = 3;
+
+// Valid instruction sizes
+static const int valid_sizes[] = {ISZ_1, ISZ_4, ISZ_8};
+static const int valid_sizes_all[] = {ISZ_1, ISZ_2, ISZ_4, ISZ_8};
+
+// streams that are not body chunks
+#define STREAM_PROGRAM  -1      // per-program choices (e.g. the size of a fill run)
+#define STREAM_MUTATE   -2      // mutation campaign
+#define STREAM_JOB      -3      // job mode: size of a job, drawn from the job's seed
+#define STREAM_REGINIT  -64     // initial register values, two per register
+
+/*
+ * derive the rand_r() stream of one chunk of one thread's program.  Every chunk
+ * gets its own stream so the program does not depend on how many cores build it.
+ * Negative chunk numbers are the STREAM_* streams below.
+ */
+unsigned chunk_seed(unsigned seed, int thread_id, int chunk)
+{
+	unsigned long z = ((unsigned long)seed << 32) ^ ((unsigned long)thread_id << 24) ^ (unsigned)chunk;
+
+	// splitmix64 finalizer
+	z += 0x9E3779B97F4A7C15UL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9UL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBUL;
+	return (unsigned)(z ^ (z >> 31));
+}
+
+/*
+ * known starting value of a safe register, set up by add_headeri
+ */
+unsigned long reg_init_value(int thread_id, int reg)
+{
+	return ((unsigned long)chunk_seed(seed, thread_id, STREAM_REGINIT - 2 * reg) << 32)
+	     | chunk_seed(seed, thread_id, STREAM_REGINIT - 2 * reg - 1);
+}
+
+/*
+ * MOV reg, DATA base of thread_id.  The imm64 goes in the program's relocations so a
+ * cached copy can be pointed at another DATA region.  A -s program has the base in
+ * RSI from the start of the header, so it needs no address at all.
+ */
+static volatile char *add_data_base(int thread_id, int reg, volatile char *tgt_addr)
+{
+	gen_prog_t *prog = &prog_threads[thread_id];
+
+	if (pic_mode)
+		return reg == REG_RSI ? tgt_addr : build_mov_register_to_register(ISZ_8, REG_RSI, reg, tgt_addr);
+
+	tgt_addr = build_imm_to_register(ISZ_8, (long)mdptr_threads[thread_id], reg, tgt_addr);
+	if (prog->nreloc < PROG_MAX_RELOCS)
+		prog->reloc[prog->nreloc++] = (tgt_addr - 8) - prog->start;
+	return tgt_addr;
+}
+
+/*
+ * cache preconditioning pass over the worker's DATA region, clobbers RDI and RCX
+ */
+static volatile char *add_precondition(int thread_id, volatile char *tgt_addr)
+{
+	static const int ops[NUM_PRECONDS] = { 0, CACHE_CLFLUSH, CACHE_CLFLUSHOPT, CACHE_CLWB,
+	                                       CACHE_PREFETCHT0, CACHE_PREFETCHNTA };
+	volatile char *loop;
+
+	tgt_addr = add_data_base(thread_id, REG_RDI, tgt_addr);
+	tgt_addr = build_imm_to_register(ISZ_4, data_bytes / 64, REG_RCX, tgt_addr);
+
+	loop = tgt_addr;
+	tgt_addr = build_cache_line_op(ops[precond], REG_RDI, 0, tgt_addr);
+	tgt_addr = build_add_imm(ISZ_8, REG_RDI, 64, tgt_addr);
+	tgt_addr = build_dec_reg(ISZ_8, REG_RCX, tgt_addr);
+	tgt_addr = build_jnz(loop, tgt_addr);
+
+	// flushes and write backs are done once the fence retires
+	if (precond <= PRE_CLWB)
+		tgt_addr = build_mfence(tgt_addr);
+	return tgt_addr;
+}
+
+static inline volatile char *add_headeri(int thread_id, volatile char *tgt_addr)
+{
+	int r;
+
+	// Create stack frame with ENTER $2048, 0
+    tgt_addr = enter(2048, 0, tgt_addr);
+	
     // Save callee-saved registers (x86-64 ABI)
     // Push RBX (no REX needed)
     tgt_addr = build_push_reg(REG_RBX, 0, tgt_addr);
@@ -341,238 +1856,3606 @@ static inline volatile char *add_headeri(volatile char *tgt_addr)
     
     // Push R15 (needs REX.B)
     tgt_addr = build_push_reg(REG_R15, 1, tgt_addr);
+
+    // -s: the DATA base comes in as the argument, RDI is one of the seeded registers
+    if (pic_mode)
+        tgt_addr = build_mov_register_to_register(ISZ_8, REG_RDI, REG_RSI, tgt_addr);
+
+    // Put DATA in a known cache state
+    if (precond != PRE_NONE)
+        tgt_addr = add_precondition(thread_id, tgt_addr);
+
+    // Seed every register the generator may use with a known value
+    for (r = 0; r < num_safe_regs; r++)
+        tgt_addr = build_imm_to_register(ISZ_8, reg_init_value(thread_id, safe_registers[r]), safe_registers[r], tgt_addr);
+    
+    return tgt_addr;
+}
+
+static inline volatile char *add_endi(volatile char *tgt_addr)
+{    
+    // Restore callee-saved registers in REVERSE order (LIFO stack)
+    // Order: R15, R14, R13, R12, RBX
+    
+    // Pop R15 (needs REX.B)
+    tgt_addr = build_pop_reg(REG_R15, 1, tgt_addr);
+    
+    // Pop R14 (needs REX.B)
+    tgt_addr = build_pop_reg(REG_R14, 1, tgt_addr);
+    
+    // Pop R13 (needs REX.B)
+    tgt_addr = build_pop_reg(REG_R13, 1, tgt_addr);
+    
+    // Pop R12 (needs REX.B)
+    tgt_addr = build_pop_reg(REG_R12, 1, tgt_addr);
+    
+    // Pop RBX (no REX needed)
+    tgt_addr = build_pop_reg(REG_RBX, 0, tgt_addr);
+	
+	// Release stack frame
+    tgt_addr = leave(tgt_addr);
+    
+    // Return to caller
+    tgt_addr = ret(tgt_addr);
+    
+    return tgt_addr;
+}
+
+//
+// register dataflow
+//
+// The generator keeps a view of the register file while it picks instructions:
+// the length of the dependency chain ending in each register, and with -D n the
+// register holding the head of each of n chains.  The safe registers are split
+// into n groups (safe_registers[j] belongs to group j % n) and instruction k
+// extends chain k % n: it reads the chain head and writes a register of the
+// same group, so n = 1 is one long latency-bound chain and larger n gives
+// independent streams.  The view restarts at each chunk boundary.
+//
+typedef struct {
+	int last[MAX_DEP_STREAMS];   // register holding the head of each chain
+	int next;                    // chain of the next instruction
+	int depth[16];               // chain length of the value in each register
+	int max_depth;
+} gen_regstate_t;
+
+void regstate_init(gen_regstate_t *st)
+{
+	int s;
+
+	memset(st, 0, sizeof(*st));
+	for (s = 0; s < dep_streams; s++)
+		st->last[s] = safe_registers[s];
+}
+
+/*
+ * random register of chain group s other than exclude
+ */
+static int stream_reg(int s, int exclude, unsigned *rs)
+{
+	int n = (num_safe_regs - s + dep_streams - 1) / dep_streams;   // members of group s
+	int r;
+
+	do {
+		r = safe_registers[s + dep_streams * (rand_r(rs) % n)];
+	} while (r == exclude);
+	return r;
+}
+
+/*
+ * pick reg1/reg2 so the instruction extends chain s, returns the new chain head
+ */
+static void stream_regs(gen_regstate_t *st, int instr_type, unsigned *rs, int *reg1, int *reg2)
+{
+	int s = st->next++ % dep_streams;
+	int head = st->last[s];
+
+	switch (instr_type) {
+		case INSTR_REG_TO_REG:          // MOV head -> new head
+			*reg1 = head;
+			*reg2 = st->last[s] = stream_reg(s, head, rs);
+			break;
+		case INSTR_XADD_REG:            // sum lands in reg1
+		case INSTR_XCHG_REG:            // head value moves to reg1
+			*reg2 = head;
+			*reg1 = st->last[s] = stream_reg(s, head, rs);
+			break;
+		case INSTR_REG_TO_MEM:          // store the head
+			*reg1 = *reg2 = head;
+			break;
+		case INSTR_XADD_MEM:            // head is read and written in place
+		case INSTR_XCHG_MEM:
+			*reg1 = *reg2 = head;
+			break;
+		default:                        // loads/immediates start a fresh value elsewhere
+			*reg1 = *reg2 = stream_reg(s, head, rs);
+			break;
+	}
+}
+
+/*
+ * update the chain lengths for a picked instruction
+ */
+static void regstate_update(gen_regstate_t *st, const gen_insn_t *in)
+{
+	int *d = st->depth, t;
+
+	switch (in->type) {
+		case INSTR_REG_TO_REG: d[in->reg2] = d[in->reg1] + 1; break;
+		case INSTR_IMM_TO_REG: d[in->reg1] = 0; break;
+		case INSTR_MEM_TO_REG: d[in->reg1] = 1; break;
+		case INSTR_POP:
+		case INSTR_STACK_LOAD: d[in->reg1] = 1; break;
+		case INSTR_XCHG_MEM:   d[in->reg2] = 1; break;
+		case INSTR_XADD_MEM:   d[in->reg2]++; break;
+		case INSTR_XADD_REG:
+			d[in->reg1] = d[in->reg2] = (d[in->reg1] > d[in->reg2] ? d[in->reg1] : d[in->reg2]) + 1;
+			break;
+		case INSTR_XCHG_REG:
+			t = d[in->reg1]; d[in->reg1] = d[in->reg2] + 1; d[in->reg2] = t + 1;
+			break;
+		default:
+			return;
+	}
+	if (d[in->reg1] > st->max_depth) st->max_depth = d[in->reg1];
+	if (d[in->reg2] > st->max_depth) st->max_depth = d[in->reg2];
+}
+
+/*
+ * Function: gen_pick
+ *
+ * Description: pick one random instruction for the random profile
+ *
+ * INPUTS: rs (rand_r state of the chunk), st (register view, NULL = uniform registers),
+ *         in (filled in)
+ */
+void gen_pick(unsigned *rs, gen_regstate_t *st, gen_insn_t *in)
+{
+        // Pick random instruction type
+        int instr_type = rand_r(rs) % NUM_INSTR_TYPES;
+        int reg1, reg2;
+        
+        if (st && dep_streams) {
+            // registers follow the dependency chains
+            stream_regs(st, instr_type, rs, &reg1, &reg2);
+        } else {
+        // Pick random registers
+        reg1 = safe_registers[rand_r(rs) % num_safe_regs];
+        reg2 = safe_registers[rand_r(rs) % num_safe_regs];
+        
+        // Ensure reg1 != reg2 for reg-to-reg operations
+        while (reg1 == reg2 && (instr_type == INSTR_REG_TO_REG || 
+                               instr_type == INSTR_XADD_REG || 
+                               instr_type == INSTR_XCHG_REG)) {
+            reg2 = safe_registers[rand_r(rs) % num_safe_regs];
+        }
+        }
+        
+		// Pick random size - FIXED VERSION
+		int size;
+
+		// Fence instructions don't need size, but we'll set a default
+		if (instr_type >= INSTR_MFENCE && instr_type <= INSTR_LFENCE) {
+			size = ISZ_4;  // Default size for fence instructions (not actually used)
+		}
+		// Special handling for XADD/XCHG (no ISZ_8 support)
+		else if (instr_type >= INSTR_XADD_REG && instr_type <= INSTR_XCHG_MEM) {
+			if (reg1 >= 8 || reg2 >= 8) {
+				int xadd_sizes[] = {ISZ_1, ISZ_4};  // No ISZ_2, ISZ_8
+				size = xadd_sizes[rand_r(rs) % 2];
+			} else {
+				int xadd_sizes_all[] = {ISZ_1, ISZ_2, ISZ_4};  // No ISZ_8
+				size = xadd_sizes_all[rand_r(rs) % 3];
+			}
+		} else {
+			// Original logic for MOV instructions (includes ISZ_8)
+			if (reg1 >= 8 || reg2 >= 8) {
+				size = valid_sizes[rand_r(rs) % 3];
+			} else {
+				size = valid_sizes_all[rand_r(rs) % 4];
+			}
+		}
+        
+        // Generate random immediate value
+        int imm_val = rand_r(rs) % 65536;
+        
+        // Generate random displacement for memory operations
+        long displacement = -1;
+        if (instr_type == INSTR_REG_TO_MEM || instr_type == INSTR_MEM_TO_REG || 
+            instr_type == INSTR_XADD_MEM || instr_type == INSTR_XCHG_MEM) {
+            int disp_type = rand_r(rs) % num_disp_types;
+            switch (disp_type) {
+                case DISP_0: displacement = 0; break;
+                case DISP_8: displacement = rand_r(rs) % 128; break;
+                case DISP_32: displacement = rand_r(rs) % 2000; break;
+            }
+        }
+        
+        // Random LOCK prefix for XADD/XCHG memory forms (50% chance)
+        int use_lock = (rand_r(rs) % 2);
+        if (instr_type != INSTR_XADD_MEM && instr_type != INSTR_XCHG_MEM)
+            use_lock = 0;
+
+        in->type = instr_type;
+        in->size = size;
+        in->reg1 = reg1;
+        in->reg2 = reg2;
+        in->lock = use_lock;
+        in->disp = displacement;
+        in->imm = imm_val;
+
+        if (st)
+            regstate_update(st, in);
+}
+
+/*
+ * Function: gen_bw_pick
+ *
+ * Description: pick one instruction of the bandwidth profile.  The accesses walk the
+ *              DATA slice sequentially in 32 byte steps by program position gidx, so
+ *              the program still does not depend on the chunking.  Without AVX the
+ *              VEX forms fall back to SSE.
+ *
+ * INPUTS: rs (rand_r state of the chunk), gidx (instruction index in the body),
+ *         in (filled in)
+ */
+#define BW_MAX_REP  4096            // longest REP MOVSB/STOSB run in bytes
+
+void gen_bw_pick(unsigned *rs, long gidx, gen_insn_t *in)
+{
+	// weights out of 20: mostly wide loads and stores, some NT and string moves
+	static const unsigned char mix[20] = {
+		INSTR_VLOAD, INSTR_VLOAD, INSTR_VLOAD, INSTR_VLOAD, INSTR_VLOAD, INSTR_VLOAD,
+		INSTR_VSTORE, INSTR_VSTORE, INSTR_VSTORE, INSTR_VSTORE,
+		INSTR_VNTSTORE, INSTR_VNTSTORE, INSTR_VNTSTORE,
+		INSTR_SSE_LOAD, INSTR_SSE_LOAD, INSTR_SSE_STORE,
+		INSTR_MOVNTI, INSTR_MOVNTI, INSTR_REP_MOVSB, INSTR_REP_STOSB,
+	};
+	int type = mix[rand_r(rs) % 20];
+
+	if (!have_avx && type == INSTR_VLOAD)
+		type = INSTR_SSE_LOAD;
+	else if (!have_avx && (type == INSTR_VSTORE || type == INSTR_VNTSTORE))
+		type = INSTR_SSE_STORE;
+
+	memset(in, 0, sizeof(*in));
+	in->type = type;
+	in->disp = (gidx * 32) % (data_bytes - BW_MAX_REP);
+	in->reg1 = rand_r(rs) % 16;   // xmm/ymm register
+	in->size = (type == INSTR_SSE_LOAD || type == INSTR_SSE_STORE) ? 16 : 32;
+
+	switch (type) {
+		case INSTR_MOVNTI:
+			in->reg1 = safe_registers[rand_r(rs) % num_safe_regs];
+			in->size = ISZ_8;
+			break;
+		case INSTR_REP_MOVSB:
+		case INSTR_REP_STOSB:
+			in->imm = 256 << (rand_r(rs) % 5);
+			in->size = ISZ_1;
+			break;
+	}
+}
+
+/*
+ * stack profile: the generator's view of what the body has on the stack.  Every
+ * open PUSH or ENTER frame is one item, closed by a POP or LEAVE in LIFO order.
+ *
+ * ENTER at level L copies L-1 frame pointers from below the current RBP, so its
+ * level is at most one more than the enclosing frame's: the copies then come from
+ * that frame's display, never from its locals or from below RSP.  The outermost
+ * frame is the header's ENTER 2048,0 (level 0), so body frames start at level 1.
+ */
+#define STACK_MAX_ITEMS  32
+#define STACK_MAX_LEVEL  8         // ENTER nesting levels 0..8
+#define STACK_MAX_BYTES  16384     // below the RSP the body starts with
+
+typedef struct {
+	unsigned short bytes[STACK_MAX_ITEMS];   // size of each open item, bottom first
+	unsigned char frame[STACK_MAX_ITEMS];    // 1 = ENTER frame, 0 = PUSH
+	unsigned char level[STACK_MAX_ITEMS];    // nesting level of an ENTER frame
+	int items, depth, max_depth;             // depth in bytes
+	int max_level;
+} gen_stackstate_t;
+
+static const unsigned short stack_frame_bytes[4] = { 0, 16, 64, 256 };
+
+/*
+ * bytes an ENTER record allocates: RBP, the level-1 copied frame pointers and
+ * the new frame pointer for a nonzero level, then the locals
+ */
+static int stack_enter_bytes(const gen_insn_t *in)
+{
+	int level = in->imm >> 16;
+
+	return 8 + (level ? 8 * level : 0) + (in->imm & 0xFFFF);
+}
+
+/*
+ * level of the innermost open ENTER frame, 0 for the header's
+ */
+static int stack_level(const gen_stackstate_t *st)
+{
+	int k;
+
+	for (k = st->items - 1; k >= 0; k--)
+		if (st->frame[k])
+			return st->level[k];
+	return 0;
+}
+
+/*
+ * apply one record to the stack view, -1 if it breaks the LIFO order or nests
+ * an ENTER deeper than one level below its enclosing frame
+ */
+static int stack_apply(gen_stackstate_t *st, const gen_insn_t *in)
+{
+	int top = st->items - 1;
+
+	switch (in->type) {
+		case INSTR_PUSH:
+		case INSTR_ENTER:
+			if (st->items == STACK_MAX_ITEMS)
+				return -1;
+			if (in->type == INSTR_ENTER && (in->imm >> 16) > stack_level(st) + 1)
+				return -1;
+			st->frame[st->items] = in->type == INSTR_ENTER;
+			st->level[st->items] = in->type == INSTR_ENTER ? in->imm >> 16 : 0;
+			st->bytes[st->items] = in->type == INSTR_ENTER ? stack_enter_bytes(in) : 8;
+			st->depth += st->bytes[st->items++];
+			if (st->depth > st->max_depth)
+				st->max_depth = st->depth;
+			if (in->type == INSTR_ENTER && (in->imm >> 16) > st->max_level)
+				st->max_level = in->imm >> 16;
+			return 0;
+		case INSTR_POP:
+		case INSTR_LEAVE:
+			if (top < 0 || st->frame[top] != (in->type == INSTR_LEAVE))
+				return -1;
+			st->depth -= st->bytes[top];
+			st->items--;
+			return 0;
+		case INSTR_STACK_LOAD:
+			// [RSP] must hold a value of ours, not locals of a frame
+			return top >= 0 && !st->frame[top] ? 0 : -1;
+	}
+	return 0;
+}
+
+/*
+ * Function: gen_stack_pick
+ *
+ * Description: maybe pick a stack instruction for the stack profile.  left is the
+ *              number of instructions the chunk still has including this one; once
+ *              it only covers the open items, their POPs and LEAVEs are forced so
+ *              the chunk ends at the depth it started.
+ *
+ * Returns: 1 if in was filled in, 0 to pick a random profile instruction instead
+ */
+int gen_stack_pick(unsigned *rs, gen_stackstate_t *st, int left, gen_insn_t *in)
+{
+	int top = st->items - 1, type = -1;
+	int room = st->items < STACK_MAX_ITEMS && left >= st->items + 2 &&
+	           st->depth + 16 + 8 * STACK_MAX_LEVEL + 256 <= STACK_MAX_BYTES;
+	int pushed = top >= 0 && !st->frame[top];
+
+	if (top >= 0 && left <= st->items) {
+		type = st->frame[top] ? INSTR_LEAVE : INSTR_POP;
+	} else {
+		// half stack instructions, half the random profile
+		switch (rand_r(rs) % 16) {
+			case 8:  case 9:  if (room) type = INSTR_PUSH; break;
+			case 10: case 11: if (pushed) type = INSTR_POP; break;
+			case 12:          if (room) type = INSTR_ENTER; break;
+			case 13:          if (top >= 0 && st->frame[top]) type = INSTR_LEAVE; break;
+			case 14:          type = INSTR_CALL_RET; break;
+			case 15:          if (pushed) type = INSTR_STACK_LOAD; break;
+		}
+		if (type < 0)
+			return 0;
+	}
+
+	memset(in, 0, sizeof(*in));
+	in->type = type;
+	in->size = ISZ_8;
+	in->disp = type == INSTR_STACK_LOAD ? 0 : -1;
+	in->reg1 = in->reg2 = safe_registers[rand_r(rs) % num_safe_regs];
+	if (type == INSTR_ENTER) {
+		int max = stack_level(st) + 1 < STACK_MAX_LEVEL ? stack_level(st) + 1 : STACK_MAX_LEVEL;
+
+		in->imm = stack_frame_bytes[rand_r(rs) % 4] | (rand_r(rs) % (max + 1)) << 16;
+	}
+	else if (type == INSTR_CALL_RET)
+		in->imm = 1 + rand_r(rs) % CALL_MAX_DEPTH;
+	stack_apply(st, in);
+	return 1;
+}
+
+/*
+ * Function: gen_encode
+ *
+ * Description: encode one generator record, fixed shapes go through the
+ *              pre-built templates in ia32_template.h (same bytes as build_*)
+ *
+ * Returns: address after the instruction
+ */
+volatile char *gen_encode(const gen_insn_t *in, volatile char *next_ptr)
+{
+		switch (in->type) {
+			case INSTR_REG_TO_REG:
+				return tmpl_mov_register_to_register(in->size, in->reg1, in->reg2, next_ptr);
+			case INSTR_IMM_TO_REG:
+				return tmpl_imm_to_register(in->size, in->imm, in->reg1, next_ptr);
+			case INSTR_REG_TO_MEM:
+				return tmpl_reg_to_memory(in->size, in->reg1, REG_RSI, in->disp, next_ptr);
+			case INSTR_MEM_TO_REG:
+				return tmpl_mov_memory_to_register(in->size, REG_RSI, in->reg1, in->disp, next_ptr);
+			case INSTR_XADD_REG:
+				// NO LOCK for register-to-register (already atomic within core)
+				return tmpl_xadd(in->size, in->reg1, in->reg2, -1, 0, next_ptr);
+			case INSTR_XADD_MEM:
+				return tmpl_xadd(in->size, REG_RSI, in->reg2, in->disp, in->lock, next_ptr);
+			case INSTR_XCHG_REG:
+				// NO LOCK for register-to-register
+				return tmpl_xchg(in->size, in->reg1, in->reg2, -1, 0, next_ptr);
+			case INSTR_XCHG_MEM:
+				// LOCK makes sense for memory operations
+				return tmpl_xchg(in->size, REG_RSI, in->reg2, in->disp, in->lock, next_ptr);
+			case INSTR_MFENCE:
+				return build_mfence(next_ptr);
+			case INSTR_SFENCE:
+				return build_sfence(next_ptr);
+			case INSTR_LFENCE:
+				return build_lfence(next_ptr);
+			case INSTR_VLOAD:
+			case INSTR_VSTORE:
+				return build_vmovdqu(in->type == INSTR_VSTORE, VEX_L256, in->reg1, REG_RSI, in->disp, next_ptr);
+			case INSTR_VNTSTORE:
+				return build_vmovntdq(VEX_L256, in->reg1, REG_RSI, in->disp, next_ptr);
+			case INSTR_SSE_LOAD:
+			case INSTR_SSE_STORE:
+				return build_movdqa(in->type == INSTR_SSE_STORE, in->reg1, REG_RSI, in->disp, next_ptr);
+			case INSTR_MOVNTI:
+				return build_movnti(ISZ_8, in->reg1, REG_RSI, in->disp, next_ptr);
+			case INSTR_REP_MOVSB:
+				// RSI is the DATA base for everything else, keep it across the copy
+				next_ptr = build_lea(REG_RDI, REG_RSI, in->disp, next_ptr);
+				next_ptr = tmpl_imm_to_register(ISZ_4, in->imm, REG_RCX, next_ptr);
+				next_ptr = build_push_reg(REG_RSI, 0, next_ptr);
+				next_ptr = build_rep_movsb(next_ptr);
+				return build_pop_reg(REG_RSI, 0, next_ptr);
+			case INSTR_REP_STOSB:
+				next_ptr = build_lea(REG_RDI, REG_RSI, in->disp, next_ptr);
+				next_ptr = tmpl_imm_to_register(ISZ_4, in->imm, REG_RCX, next_ptr);
+				return build_rep_stosb(next_ptr);
+			case INSTR_PUSH:
+				return build_push_reg(in->reg1, in->reg1 >= 8, next_ptr);
+			case INSTR_POP:
+				return build_pop_reg(in->reg1, in->reg1 >= 8, next_ptr);
+			case INSTR_ENTER:
+				return enter(in->imm & 0xFFFF, in->imm >> 16, next_ptr);
+			case INSTR_LEAVE:
+				return leave(next_ptr);
+			case INSTR_CALL_RET:
+				return call_nest(in->imm, next_ptr);
+			case INSTR_STACK_LOAD:
+				return load_rsp(in->reg1, next_ptr);
+		}
+		return next_ptr;
+}
+
+/*
+ * Function: gen_log
+ *
+ * Description: log one generated instruction the way the serial generator did
+ */
+void gen_log(int thread_id, FILE *logfile, const gen_insn_t *in)
+{
+		switch (in->type) {
+			case INSTR_REG_TO_REG:
+				LOG_DETAIL("Generating: MOV R%d->R%d (size=%d)\n", in->reg1, in->reg2, in->size);
+				break;
+			case INSTR_IMM_TO_REG:
+				LOG_DETAIL("Generating: MOV #%X->R%d (size=%d)\n", in->imm, in->reg1, in->size);
+				break;
+			case INSTR_REG_TO_MEM:
+				LOG_DETAIL("Generating: MOV R%d->[RSI+%d] (size=%d)\n", in->reg1, in->disp, in->size);
+				break;
+			case INSTR_MEM_TO_REG:
+				LOG_DETAIL("Generating: MOV [RSI+%d]->R%d (size=%d)\n", in->disp, in->reg1, in->size);
+				break;
+			case INSTR_XADD_REG:
+				LOG_DETAIL("Generating: XADD R%d,R%d (size=%d)\n", in->reg1, in->reg2, in->size);
+				break;
+			case INSTR_XADD_MEM:
+				LOG_DETAIL("Generating: %sXADD [RSI+%d],R%d (size=%d)\n", in->lock ? "LOCK " : "", in->disp, in->reg2, in->size);
+				break;
+			case INSTR_XCHG_REG:
+				LOG_DETAIL("Generating: XCHG R%d,R%d (size=%d)\n", in->reg1, in->reg2, in->size);
+				break;
+			case INSTR_XCHG_MEM:
+				LOG_DETAIL("Generating: %sXCHG [RSI+%d],R%d (size=%d)\n", in->lock ? "LOCK " : "", in->disp, in->reg2, in->size);
+				break;
+			case INSTR_MFENCE:
+				LOG_DETAIL("Generating: MFENCE (full memory barrier)\n");
+				break;
+			case INSTR_SFENCE:
+				LOG_DETAIL("Generating: SFENCE (store memory barrier)\n");
+				break;
+			case INSTR_LFENCE:
+				LOG_DETAIL("Generating: LFENCE (load memory barrier)\n");
+				break;
+			case INSTR_VLOAD:
+				LOG_DETAIL("Generating: VMOVDQU [RSI+%d]->YMM%d\n", in->disp, in->reg1);
+				break;
+			case INSTR_VSTORE:
+				LOG_DETAIL("Generating: VMOVDQU YMM%d->[RSI+%d]\n", in->reg1, in->disp);
+				break;
+			case INSTR_VNTSTORE:
+				LOG_DETAIL("Generating: VMOVNTDQ YMM%d->[RSI+%d]\n", in->reg1, in->disp);
+				break;
+			case INSTR_SSE_LOAD:
+				LOG_DETAIL("Generating: MOVDQA [RSI+%d]->XMM%d\n", in->disp, in->reg1);
+				break;
+			case INSTR_SSE_STORE:
+				LOG_DETAIL("Generating: MOVDQA XMM%d->[RSI+%d]\n", in->reg1, in->disp);
+				break;
+			case INSTR_MOVNTI:
+				LOG_DETAIL("Generating: MOVNTI R%d->[RSI+%d] (size=%d)\n", in->reg1, in->disp, in->size);
+				break;
+			case INSTR_REP_MOVSB:
+				LOG_DETAIL("Generating: REP MOVSB [RSI]->[RSI+%d] (%d bytes)\n", in->disp, in->imm);
+				break;
+			case INSTR_REP_STOSB:
+				LOG_DETAIL("Generating: REP STOSB AL->[RSI+%d] (%d bytes)\n", in->disp, in->imm);
+				break;
+			case INSTR_PUSH:
+				LOG_DETAIL("Generating: PUSH R%d\n", in->reg1);
+				break;
+			case INSTR_POP:
+				LOG_DETAIL("Generating: POP R%d\n", in->reg1);
+				break;
+			case INSTR_ENTER:
+				LOG_DETAIL("Generating: ENTER #%d,%d\n", in->imm & 0xFFFF, in->imm >> 16);
+				break;
+			case INSTR_LEAVE:
+				LOG_DETAIL("Generating: LEAVE\n");
+				break;
+			case INSTR_CALL_RET:
+				LOG_DETAIL("Generating: %d nested CALL/RET\n", in->imm);
+				break;
+			case INSTR_STACK_LOAD:
+				LOG_DETAIL("Generating: MOV [RSP]->R%d (size=%d)\n", in->reg1, in->size);
+				break;
+		}
+}
+
+//
+// chunked generation
+//
+// The random body is cut into GEN_CHUNK_INSTRS instruction chunks.  Each chunk is
+// picked from its own rand_r stream and encoded into a private buffer by one of
+// gen_threads generator threads, then a prefix sum over the chunk byte lengths
+// places every chunk in the code buffer.  Chunk boundaries do not depend on the
+// number of generator threads, so the program is byte-identical for any -j.
+//
+#define GEN_CHUNK_INSTRS 4096
+
+typedef struct {
+	int first, count;          // instruction index range of the chunk
+	char *buf;                 // private encode buffer
+	unsigned long bytes;       // encoded length
+	unsigned long off;         // placement from the start of the body
+	int max_depth;             // longest dependency chain in the chunk
+} gen_chunk_t;
+
+typedef struct {
+	int thread_id;             // program being built
+	int fill_size;             // operand size of a fill run
+	int nchunks;
+	gen_chunk_t *chunk;
+	gen_insn_t *insn;
+	volatile char *body;       // where the chunks are placed
+	int phase;                 // 0 = pick and encode, 1 = place
+	int next_chunk;            // work counter shared by the generator threads
+} gen_job_t;
+
+/*
+ * pick and encode one chunk into its private buffer
+ */
+void gen_chunk_build(gen_job_t *job, int c)
+{
+	gen_chunk_t *ch = &job->chunk[c];
+	gen_insn_t *in = &job->insn[ch->first];
+	unsigned rs = chunk_seed(seed, job->thread_id, c);
+	unsigned long *map = cov_maps + (unsigned long)job->thread_id * COV_WORDS;
+	gen_regstate_t st;
+	gen_stackstate_t stk;
+	volatile char *p;
+	int k;
+
+	// ENC_SLOT per instruction covers the longest encoding and the template store spill
+	ch->buf = malloc((unsigned long)(ch->count + 1) * ENC_SLOT(profile));
+	if (!ch->buf) {
+		fprintf(stderr, "T%d: no memory for generator chunk %d\n", job->thread_id, c);
+		exit(1);
+	}
+	p = ch->buf;
+
+	if (profile == PROF_RANDOM || profile == PROF_BANDWIDTH || profile == PROF_STACK) {
+		regstate_init(&st);
+		memset(&stk, 0, sizeof(stk));
+		for (k = 0; k < ch->count; k++) {
+			if (profile == PROF_BANDWIDTH) {
+				gen_bw_pick(&rs, ch->first + k, &in[k]);
+			} else if (profile == PROF_STACK && gen_stack_pick(&rs, &stk, ch->count - k, &in[k])) {
+				regstate_update(&st, &in[k]);
+			} else if (cov_directed) {
+				// a few candidates, the first one in a new bin wins
+				int t;
+
+				for (t = 0; t < COV_TRIES; t++) {
+					gen_regstate_t cand = st;
+
+					gen_pick(&rs, &cand, &in[k]);
+					if (t == COV_TRIES - 1 || !cov_test(map, cov_bin(&in[k]))) {
+						st = cand;
+						break;
+					}
+				}
+			} else {
+				gen_pick(&rs, &st, &in[k]);
+			}
+			cov_mark(map, &in[k]);
+			in[k].off = p - (volatile char *)ch->buf;
+			p = gen_encode(&in[k], p);
+			in[k].len = p - ((volatile char *)ch->buf + in[k].off);
+			in[k].pad = 0;
+		}
+		ch->max_depth = st.max_depth;
+	} else {
+		// fill profiles: one homogeneous run through the bulk encoders
+		unsigned char run_regs[GEN_CHUNK_INSTRS], run_lens[GEN_CHUNK_INSTRS];
+		int run_disps[GEN_CHUNK_INSTRS];
+		unsigned off = 0;
+
+		for (k = 0; k < ch->count; k++) {
+			run_regs[k] = safe_registers[rand_r(&rs) % num_safe_regs];
+			switch (rand_r(&rs) % num_disp_types) {
+				case DISP_0: run_disps[k] = 0; break;
+				case DISP_8: run_disps[k] = rand_r(&rs) % 128; break;
+				case DISP_32: run_disps[k] = rand_r(&rs) % 2000; break;
+			}
+		}
+
+		if (profile == PROF_FILL_MOV)
+			p = bulk_reg_to_memory(job->fill_size, run_regs, REG_RSI, run_disps, ch->count, run_lens, p);
+		else
+			p = bulk_xadd_memory(job->fill_size, REG_RSI, run_regs, run_disps, ch->count, 1, run_lens, p);
+
+		for (k = 0; k < ch->count; k++) {
+			in[k].type = (profile == PROF_FILL_MOV) ? INSTR_REG_TO_MEM : INSTR_XADD_MEM;
+			in[k].size = job->fill_size;
+			in[k].reg1 = in[k].reg2 = run_regs[k];
+			in[k].lock = (profile == PROF_FILL_XADD);
+			in[k].disp = run_disps[k];
+			in[k].imm = 0;
+			in[k].off = off;
+			in[k].len = run_lens[k];
+			in[k].pad = 0;
+			off += run_lens[k];
+			cov_mark(map, &in[k]);
+		}
+	}
+	ch->bytes = p - (volatile char *)ch->buf;
+	stats_heartbeat(job->thread_id);   // a long build is not a hang
+}
+
+/*
+ * copy one encoded chunk to its final place and rebase its records
+ */
+void gen_chunk_place(gen_job_t *job, int c)
+{
+	gen_chunk_t *ch = &job->chunk[c];
+	int k;
+
+	memcpy((char *)job->body + ch->off, ch->buf, ch->bytes);
+	for (k = 0; k < ch->count; k++)
+		job->insn[ch->first + k].off += ch->off;
+
+	free(ch->buf);
+	ch->buf = NULL;
+}
+
+void *gen_worker(void *arg)
+{
+	gen_job_t *job = arg;
+	int c;
+
+	while ((c = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED)) < job->nchunks) {
+		if (job->phase == 0)
+			gen_chunk_build(job, c);
+		else
+			gen_chunk_place(job, c);
+	}
+	return NULL;
+}
+
+/*
+ * run one phase over all chunks on gen_threads threads (the caller is one of them).
+ * Helpers may run on any CPU of the original affinity mask, even though the
+ * calling worker is already bound to its own CPU.
+ */
+void gen_run_phase(gen_job_t *job, int phase)
+{
+	pthread_t tid[MAX_GEN_THREADS];
+	pthread_attr_t attr;
+	int t, nhelpers = gen_threads - 1;
+
+	job->phase = phase;
+	job->next_chunk = 0;
+
+	if (nhelpers > job->nchunks - 1)
+		nhelpers = job->nchunks - 1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setaffinity_np(&attr, sizeof(gen_cpus), &gen_cpus);
+	for (t = 0; t < nhelpers; t++) {
+		if (pthread_create(&tid[t], &attr, gen_worker, job) != 0) {
+			nhelpers = t;   // carry on with fewer helpers
+			break;
+		}
+	}
+	pthread_attr_destroy(&attr);
+
+	gen_worker(job);
+
+	for (t = 0; t < nhelpers; t++)
+		pthread_join(tid[t], NULL);
+}
+
+/*
+ * FNV-1a over the generated program, logged so runs can be compared
+ */
+unsigned long prog_checksum(const volatile char *start, const volatile char *end)
+{
+	unsigned long h = 0xcbf29ce484222325UL;
+
+	while (start < end)
+		h = (h ^ (unsigned char)*start++) * 0x100000001b3UL;
+	return h;
+}
+
+/*
+ * (re)emit the trailer behind the body, returns the end of the program.
+ * With -L the trailer starts with the loop back edge to the body.
+ */
+volatile char *prog_trailer(gen_prog_t *prog)
+{
+	volatile char *p = prog->body_end;
+
+	if (loop_iters > 1) {
+		p = build_dec_reg(ISZ_8, REG_R12, p);
+		p = build_jnz(prog->body, p);
+	}
+	if (profile == PROF_BANDWIDTH && have_avx)
+		p = build_vzeroupper(p);
+	prog->end = add_endi(p);
+	return prog->end;
+}
+
+/*
+ * padding needed in front of an instruction of len bytes at addr
+ */
+static unsigned long layout_pad(unsigned long addr, int len)
+{
+	if (align_straddle) {
+		// split the instruction in the middle across the boundary
+		int split = len > 1 ? len / 2 : 1;
+		return (align_straddle - (addr + split) % align_straddle) % align_straddle;
+	}
+	return (align_to - addr % align_to) % align_to;
+}
+
+/*
+ * Function: prog_layout
+ *
+ * Description: apply -A every=/to=/straddle= to a freshly placed body.  Pads are
+ *              computed from the final addresses, then the instructions are moved
+ *              up last to first (they only ever move forward) and the gaps filled
+ *              with NOPs.  Padding in front of instruction k becomes the pad of
+ *              instruction k-1, padding in front of the first moves the body start.
+ *
+ * Returns: bytes of padding added, -1 if the code buffer has no room
+ */
+long prog_layout(gen_prog_t *prog)
+{
+	unsigned long *newoff, addr, lead;
+	unsigned long old_bytes = prog->body_end - prog->body;
+	volatile char *newbody;
+	int k;
+
+	if (!align_every || prog->ninsn == 0)
+		return 0;
+
+	newoff = malloc(prog->ninsn * sizeof(unsigned long));
+	if (!newoff)
+		return -1;
+
+	addr = (unsigned long)prog->body;
+	lead = layout_pad(addr, prog->insn[0].len);
+	newbody = prog->body + lead;
+	addr += lead;
+
+	for (k = 0; k < prog->ninsn; k++) {
+		if (k > 0 && k % align_every == 0)
+			addr += layout_pad(addr, prog->insn[k].len);
+		newoff[k] = addr - (unsigned long)newbody;
+		addr += prog->insn[k].len;
+	}
+
+	if ((volatile char *)addr > prog->limit) {
+		free(newoff);
+		return -1;
+	}
+
+	for (k = prog->ninsn - 1; k >= 0; k--)
+		memmove((char *)newbody + newoff[k], (char *)prog->body + prog->insn[k].off, prog->insn[k].len);
+
+	build_nop(lead, prog->body);
+	for (k = 0; k < prog->ninsn; k++) {
+		gen_insn_t *in = &prog->insn[k];
+
+		in->off = newoff[k];
+		in->pad = (k + 1 < prog->ninsn) ? newoff[k + 1] - newoff[k] - in->len : 0;
+		build_nop(in->pad, newbody + in->off + in->len);
+	}
+	free(newoff);
+
+	lead += addr - (unsigned long)newbody - old_bytes;
+	prog->body = newbody;
+	prog->body_end = (volatile char *)addr;
+	return lead;
+}
+
+//
+// Routine:  build_instructions
+//
+// Description:
+//
+// INPUTS: next_ptr, thread_id, logfile
+// 
+// OUTPUT: returns the number of instructions built, the program and its
+//         instruction index are left in prog_threads[thread_id]
+// 
+int build_instructions(volatile char *next_ptr, int thread_id, FILE *logfile) {
+
+	int instructions_built = 0;
+	gen_prog_t *prog = &prog_threads[thread_id];
+	gen_job_t job;
+	unsigned prs = chunk_seed(seed, thread_id, STREAM_PROGRAM);
+	unsigned long body_bytes = 0;
+	int c, k, max_depth = 0;
+
+	// example instruction generation..
+
+	LOG_DETAIL("building instructions\n");
+
+    prog->start = next_ptr;
+    prog->limit = next_ptr + instr_bytes - 2 * MAX_ENC_SLOT;
+    prog->dirty_lo = prog->dirty_hi = NULL;
+    prog->nreloc = 0;
+
+    // Calling the header
+    next_ptr = add_headeri(thread_id, next_ptr);
+    if (precond != PRE_NONE)
+        LOG_DETAIL("Setup: precondition DATA with %s, %lu lines from 0x%lx\n", precond_names[precond],
+                   data_bytes / 64, (long)mdptr_threads[thread_id]);
+    for (k = 0; k < num_safe_regs; k++)
+        LOG_DETAIL("Setup: MOV #%lX->R%d (size=%d)\n", reg_init_value(thread_id, safe_registers[k]), safe_registers[k], ISZ_8);
     
-    return tgt_addr;
+    // Set up RSI with mdptr for memory operations
+    next_ptr = add_data_base(thread_id, REG_RSI, next_ptr);
+    if (pic_mode)
+        LOG_DETAIL("MOVING MDPTR: MOV R%d->R%d (size=%d), DATA base argument\n", REG_RDI, REG_RSI, ISZ_8);
+    else
+        LOG_DETAIL("MOVING MDPTR: MOV #%lX->R%d (size=%d)\n", (long)mdptr_threads[thread_id], REG_RSI, ISZ_8);
+    instructions_built++;
+    LOG_DETAIL("Setup: loaded mdptr into RSI\n");
+
+    // R12 is saved by the header, use it as the loop counter
+    if (loop_iters > 1) {
+        next_ptr = build_imm_to_register(ISZ_4, loop_iters, REG_R12, next_ptr);
+        LOG_DETAIL("Setup: loop count MOV #%X->R%d (size=%d)\n", loop_iters, REG_R12, ISZ_4);
+        instructions_built++;
+    }
+
+    // NOP pad up to the requested body / loop head alignment
+    if (align_body) {
+        int pad = (align_body - (unsigned long)next_ptr % align_body) % align_body;
+        next_ptr = build_nop(pad, next_ptr);
+        LOG_AND_PRINT("Layout: %d NOP bytes to align the body to %d\n", pad, align_body);
+    }
+
+    // split the body into chunks
+    memset(&job, 0, sizeof(job));
+    job.thread_id = thread_id;
+    job.nchunks = (target_ninstrs + GEN_CHUNK_INSTRS - 1) / GEN_CHUNK_INSTRS;
+    job.chunk = calloc(job.nchunks + 1, sizeof(gen_chunk_t));
+    job.insn = malloc((target_ninstrs + 1) * sizeof(gen_insn_t));
+    job.body = next_ptr;
+    if (!job.chunk || !job.insn) {
+        LOG_AND_PRINT("ERROR: no memory for %d instruction program\n", target_ninstrs);
+        exit(1);
+    }
+    for (c = 0; c < job.nchunks; c++) {
+        job.chunk[c].first = c * GEN_CHUNK_INSTRS;
+        job.chunk[c].count = (c == job.nchunks - 1) ? target_ninstrs - job.chunk[c].first : GEN_CHUNK_INSTRS;
+    }
+
+    // one size for a whole fill run, legal with every safe register
+    if (profile == PROF_FILL_MOV) {
+        job.fill_size = valid_sizes[rand_r(&prs) % 3];
+    } else if (profile == PROF_FILL_XADD) {
+        int xadd_sizes[] = {ISZ_1, ISZ_4};
+        job.fill_size = xadd_sizes[rand_r(&prs) % 2];
+    }
+
+    gen_run_phase(&job, 0);
+
+    // prefix sum over the chunk lengths gives the placement
+    for (c = 0; c < job.nchunks; c++) {
+        job.chunk[c].off = body_bytes;
+        body_bytes += job.chunk[c].bytes;
+        if (job.chunk[c].max_depth > max_depth)
+            max_depth = job.chunk[c].max_depth;
+    }
+    if (profile == PROF_BANDWIDTH) {
+        bw_pass_bytes = 0;
+        for (k = 0; k < target_ninstrs; k++)
+            bw_pass_bytes += (job.insn[k].type >= INSTR_REP_MOVSB) ? job.insn[k].imm : job.insn[k].size;
+        LOG_AND_PRINT("Bandwidth: %lu bytes per pass over a %lu byte slice%s\n", bw_pass_bytes, data_bytes,
+                      have_avx ? "" : " (no AVX, SSE only)");
+    }
+    if (profile == PROF_RANDOM)
+        LOG_AND_PRINT("Dataflow: %d dependency chains, longest chain %d instructions\n", dep_streams, max_depth);
+    if (profile == PROF_STACK) {
+        // check the invariant over the whole body: LIFO order, back to the starting RSP
+        gen_stackstate_t stk;
+        int n[INSTR_STACK_LOAD + 1] = { 0 };
+
+        memset(&stk, 0, sizeof(stk));
+        for (k = 0; k < target_ninstrs; k++) {
+            n[job.insn[k].type]++;
+            if (stack_apply(&stk, &job.insn[k]) != 0)
+                break;
+        }
+        if (k < target_ninstrs || stk.items) {
+            LOG_AND_PRINT("ERROR: unbalanced stack at instruction %d, %d items open\n", k, stk.items);
+            exit(1);
+        }
+        LOG_AND_PRINT("Stack: %d PUSH/POP, %d ENTER/LEAVE up to level %d, %d CALL/RET nests, %d MOV [RSP], deepest %d bytes\n",
+                      n[INSTR_PUSH], n[INSTR_ENTER], stk.max_level, n[INSTR_CALL_RET], n[INSTR_STACK_LOAD], stk.max_depth);
+    }
+
+    gen_run_phase(&job, 1);
+    free(job.chunk);
+
+    prog->body = job.body;
+    prog->body_end = job.body + body_bytes;
+    free(prog->insn);   // index of the previous program built in this buffer
+    prog->insn = job.insn;
+    prog->ninsn = target_ninstrs;
+    prog->cap = target_ninstrs + 1;
+
+    if (align_every) {
+        long added = prog_layout(prog);
+        if (added < 0) {
+            LOG_AND_PRINT("ERROR: no room in the code buffer for the -A padding\n");
+            exit(1);
+        }
+        LOG_AND_PRINT("Layout: %ld NOP bytes to %s every %d instructions %s %d\n", added,
+                      align_straddle ? "split" : "align", align_every,
+                      align_straddle ? "across" : "to", align_straddle ? align_straddle : align_to);
+    }
+
+    if (profile == PROF_FILL_MOV) {
+        LOG_AND_PRINT("Generating: %d x MOV Rn->[RSI+disp] (size=%d)\n", target_ninstrs, job.fill_size);
+        instructions_built += target_ninstrs;
+    } else if (profile == PROF_FILL_XADD) {
+        LOG_AND_PRINT("Generating: %d x LOCK XADD [RSI+disp],Rn (size=%d)\n", target_ninstrs, job.fill_size);
+        instructions_built += target_ninstrs;
+    } else {
+        for (k = 0; k < target_ninstrs; k++) {
+            gen_log(thread_id, logfile, &job.insn[k]);
+            instructions_built++;
+            LOG_DETAIL("Instruction %d complete, next_ptr: 0x%lx\n", instructions_built,
+                       (long)(prog->body + job.insn[k].off + job.insn[k].len));
+        }
+    }
+
+    next_ptr = prog->body_end;
+
+	LOG_DETAIL("next ptr is now 0x%lx\n", (long) next_ptr);
+
+    next_ptr = prog_trailer(prog);
+    LOG_AND_PRINT("Generated %d total instructions\n", instructions_built);
+    LOG_AND_PRINT("Program %lu bytes, checksum 0x%016lx\n", (unsigned long)(prog->end - prog->start),
+                  prog_checksum(prog->start, prog->end));
+    return instructions_built;
+
+}
+
+//
+// program cache
+//
+// With -K every program build_instructions produces is also written to
+// <dir>/<key hash>.prog, and a later build with the same key maps that file and
+// copies it in instead of generating.  The key is GEN_VERSION plus every setting
+// the program bytes depend on; the DATA address is not part of it because the
+// MOV imm64s that load it are listed as relocations, stored as zero and patched
+// with the worker's DATA base on load.  The code buffers are page aligned, so the
+// -A layout is the same in every buffer.  The instruction index is stored too,
+// for mutation and coverage.  Files are written under a temporary name and renamed,
+// so concurrent workers and runs never see half a program.  -c programs depend on
+// the coverage so far and are not cached.
+//
+#define GEN_VERSION     1       // bump when the same parameters start giving other bytes
+#define PCACHE_MAGIC    0x4548434143474f52UL   // "ROGCACHE"
+#define PCACHE_KEY_MAX  256
+
+typedef struct {
+	unsigned long magic;
+	char key[PCACHE_KEY_MAX];            // the parameters, checked on load
+	unsigned long code_bytes;            // start..end
+	unsigned long body, body_end;        // offsets from start
+	unsigned long bw_pass_bytes;
+	int ninsn, ibuilt, nreloc;
+	unsigned reloc[PROG_MAX_RELOCS];
+} pcache_hdr_t;                          // followed by ninsn gen_insn_t and the code
+
+/*
+ * cache key of the program thread_id would build now, and its file name
+ */
+static void pcache_name(int thread_id, char *key, char *path, int path_len)
+{
+	unsigned long h = 0xcbf29ce484222325UL;
+	const char *c;
+
+	snprintf(key, PCACHE_KEY_MAX,
+		 "gen%d seed=%u profile=%s n=%d thread=%d chains=%d loop=%d align=%d/%d/%d/%d precond=%s data=%lu avx=%d pic=%d",
+		 GEN_VERSION, seed, profile_names[profile], target_ninstrs, thread_id, dep_streams, loop_iters,
+		 align_body, align_every, align_to, align_straddle, precond_names[precond], data_bytes, have_avx, pic_mode);
+	for (c = key; *c; c++)
+		h = (h ^ (unsigned char)*c) * 0x100000001b3UL;
+	snprintf(path, path_len, "%s/%016lx.prog", prog_cache_dir, h);
+}
+
+/*
+ * every offset of a cached program lies inside its code, 0 if one does not
+ */
+static int pcache_offsets_ok(const pcache_hdr_t *h)
+{
+	const gen_insn_t *in = (const gen_insn_t *)(h + 1);
+	unsigned long body_bytes;
+	int k;
+
+	if (h->body > h->body_end || h->body_end > h->code_bytes)
+		return 0;
+	for (k = 0; k < h->nreloc; k++)
+		if ((unsigned long)h->reloc[k] + 8 > h->code_bytes)
+			return 0;
+	body_bytes = h->body_end - h->body;
+	for (k = 0; k < h->ninsn; k++)
+		if (in[k].off > body_bytes || in[k].len > body_bytes - in[k].off)
+			return 0;
+	return 1;
+}
+
+/*
+ * Function: pcache_load
+ *
+ * Description: copy the cached program of key to next_ptr and relocate it to
+ *              thread_id's DATA region
+ *
+ * Returns: instructions built, -1 if there is no usable cached copy
+ */
+static int pcache_load(const char *path, const char *key, volatile char *next_ptr, int thread_id)
+{
+	gen_prog_t *prog = &prog_threads[thread_id];
+	const pcache_hdr_t *h;
+	const char *code;
+	struct stat st;
+	unsigned long insn_bytes;
+	void *map;
+	int fd, k;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) != 0 || st.st_size < (long)sizeof(*h)) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	h = map;
+	insn_bytes = (unsigned long)h->ninsn * sizeof(gen_insn_t);
+	if (h->magic != PCACHE_MAGIC || strncmp(h->key, key, PCACHE_KEY_MAX) != 0 || h->ninsn < 0 ||
+	    h->nreloc < 0 || h->nreloc > PROG_MAX_RELOCS ||
+	    sizeof(*h) + insn_bytes + h->code_bytes != (unsigned long)st.st_size ||
+	    h->code_bytes > instr_bytes - 2 * MAX_ENC_SLOT || !pcache_offsets_ok(h)) {
+		fprintf(stderr, "T%d: ignoring %s, not a usable cached program\n", thread_id, path);
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	free(prog->insn);
+	prog->insn = malloc((h->ninsn + 1) * sizeof(gen_insn_t));
+	if (!prog->insn) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+	memcpy(prog->insn, h + 1, insn_bytes);
+	code = (const char *)(h + 1) + insn_bytes;
+	memcpy((char *)next_ptr, code, h->code_bytes);
+	for (k = 0; k < h->nreloc; k++)
+		*(volatile long *)(next_ptr + h->reloc[k]) = (long)mdptr_threads[thread_id];
+
+	prog->start = next_ptr;
+	prog->body = next_ptr + h->body;
+	prog->body_end = next_ptr + h->body_end;
+	prog->end = next_ptr + h->code_bytes;
+	prog->limit = next_ptr + instr_bytes - 2 * MAX_ENC_SLOT;
+	prog->dirty_lo = prog->dirty_hi = NULL;
+	prog->ninsn = h->ninsn;
+	prog->cap = h->ninsn + 1;
+	prog->nreloc = h->nreloc;
+	memcpy(prog->reloc, h->reloc, sizeof(prog->reloc));
+	bw_pass_bytes = h->bw_pass_bytes;
+	k = h->ibuilt;
+	munmap(map, st.st_size);
+	return k;
+}
+
+/*
+ * write the program thread_id just built to the cache, relocations zeroed
+ */
+static void pcache_store(const char *path, const char *key, int thread_id, int ibuilt)
+{
+	gen_prog_t *prog = &prog_threads[thread_id];
+	pcache_hdr_t h;
+	char tmp[PATH_MAX + 32], *code;
+	unsigned long code_bytes = prog->end - prog->start;
+	FILE *f;
+	int k, ok;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = PCACHE_MAGIC;
+	snprintf(h.key, sizeof(h.key), "%s", key);
+	h.code_bytes = code_bytes;
+	h.body = prog->body - prog->start;
+	h.body_end = prog->body_end - prog->start;
+	h.bw_pass_bytes = bw_pass_bytes;
+	h.ninsn = prog->ninsn;
+	h.ibuilt = ibuilt;
+	h.nreloc = prog->nreloc;
+	memcpy(h.reloc, prog->reloc, sizeof(h.reloc));
+
+	code = malloc(code_bytes);
+	if (!code)
+		return;
+	memcpy(code, (const char *)prog->start, code_bytes);
+	for (k = 0; k < prog->nreloc; k++)
+		memset(code + prog->reloc[k], 0, 8);
+
+	snprintf(tmp, sizeof(tmp), "%s.%d.%ld", path, (int)getpid(), (long)syscall(SYS_gettid));
+	f = fopen(tmp, "w");
+	if (f) {
+		ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+		     fwrite(prog->insn, sizeof(gen_insn_t), prog->ninsn, f) == (size_t)prog->ninsn &&
+		     fwrite(code, 1, code_bytes, f) == code_bytes;
+		if (fclose(f) == 0 && ok)
+			rename(tmp, path);
+		else
+			unlink(tmp);
+	}
+	free(code);
+}
+
+/*
+ * Function: build_program
+ *
+ * Description: build_instructions through the -K program cache
+ *
+ * Returns: the number of instructions built
+ */
+int build_program(volatile char *next_ptr, int thread_id, FILE *logfile)
+{
+	char key[PCACHE_KEY_MAX], path[PATH_MAX];
+	gen_prog_t *prog = &prog_threads[thread_id];
+	int ibuilt, k;
+
+	if (!prog_cache_dir || cov_directed)
+		return build_instructions(next_ptr, thread_id, logfile);
+
+	pcache_name(thread_id, key, path, sizeof(path));
+	ibuilt = pcache_load(path, key, next_ptr, thread_id);
+	if (ibuilt >= 0) {
+		for (k = 0; k < prog->ninsn; k++)
+			cov_mark(cov_maps + (unsigned long)thread_id * COV_WORDS, &prog->insn[k]);
+		LOG_AND_PRINT("Program loaded from cache %s, %d instructions\n", path, ibuilt);
+		LOG_AND_PRINT("Program %lu bytes, checksum 0x%016lx\n", (unsigned long)(prog->end - prog->start),
+			      prog_checksum(prog->start, prog->end));
+		return ibuilt;
+	}
+
+	ibuilt = build_instructions(next_ptr, thread_id, logfile);
+	pcache_store(path, key, thread_id, ibuilt);
+	return ibuilt;
+}
+
+//
+// program mutation
+//
+// prog_replace/prog_insert/prog_delete patch a generated program in place through its
+// instruction index.  A shorter encoding leaves NOP padding in its slot and a deleted
+// instruction becomes padding of the one before it; a longer or inserted one first
+// tries that padding and otherwise relocates the rest of the body (the trailer is
+// re-emitted behind it).  The patched byte range is tracked so prog_flush only has to
+// sync the cache lines that actually changed.
+//
+
+static void prog_dirty(gen_prog_t *prog, volatile char *lo, volatile char *hi)
+{
+	if (!prog->dirty_lo || lo < prog->dirty_lo)
+		prog->dirty_lo = lo;
+	if (hi > prog->dirty_hi)
+		prog->dirty_hi = hi;
+}
+
+/*
+ * move the body from byte offset 'from' (the start of insn[idx]) by delta bytes,
+ * returns -1 if the code buffer has no room
+ */
+static int prog_relocate(gen_prog_t *prog, int idx, unsigned from, long delta)
+{
+	volatile char *src = prog->body + from;
+	int k;
+
+	if (prog->body_end + delta > prog->limit)
+		return -1;
+
+	memmove((char *)src + delta, (char *)src, prog->body_end - src);
+	for (k = idx; k < prog->ninsn; k++)
+		prog->insn[k].off += delta;
+	prog->body_end += delta;
+
+	prog_trailer(prog);
+	prog_dirty(prog, delta < 0 ? src + delta : src, prog->end);
+	return 0;
+}
+
+/*
+ * copy an encoding into its slot and pad the rest of the slot
+ */
+static void prog_write_slot(gen_prog_t *prog, const gen_insn_t *in, const char *bytes)
+{
+	volatile char *p = prog->body + in->off;
+
+	memcpy((char *)p, bytes, in->len);
+	build_nop(in->pad, p + in->len);
+	prog_dirty(prog, p, p + in->len + in->pad);
+}
+
+/*
+ * Function: prog_replace
+ *
+ * Description: replace insn[idx] with a new instruction
+ *
+ * Returns: 0, or -1 if the code buffer has no room to grow
+ */
+int prog_replace(gen_prog_t *prog, int idx, const gen_insn_t *in)
+{
+	char tmp[2 * MAX_ENC_SLOT];   // the template stores spill past the instruction
+	gen_insn_t *old = &prog->insn[idx];
+	int slot = old->len + old->pad;
+	int len = gen_encode(in, tmp) - (volatile char *)tmp;
+	unsigned off = old->off;
+
+	if (len > slot && prog_relocate(prog, idx + 1, off + slot, len - slot) < 0)
+		return -1;
+
+	*old = *in;
+	old->off = off;
+	old->len = len;
+	old->pad = (len > slot) ? 0 : slot - len;
+	prog_write_slot(prog, old, tmp);
+	return 0;
+}
+
+/*
+ * Function: prog_insert
+ *
+ * Description: insert a new instruction in front of insn[idx] (idx == ninsn appends)
+ *
+ * Returns: 0, or -1 if the code buffer or the index has no room to grow
+ */
+int prog_insert(gen_prog_t *prog, int idx, const gen_insn_t *in)
+{
+	char tmp[2 * MAX_ENC_SLOT];
+	int len = gen_encode(in, tmp) - (volatile char *)tmp;
+	gen_insn_t *prev = idx > 0 ? &prog->insn[idx - 1] : NULL;
+	unsigned off;
+	int pad = 0;
+
+	if (prog->ninsn == prog->cap) {
+		gen_insn_t *grown = realloc(prog->insn, 2 * prog->cap * sizeof(gen_insn_t));
+		if (!grown)
+			return -1;
+		prog->insn = grown;
+		prog->cap *= 2;
+		prev = idx > 0 ? &prog->insn[idx - 1] : NULL;
+	}
+
+	if (prev && prev->pad >= len) {
+		// fits in the padding behind the previous instruction
+		off = prev->off + prev->len;
+		pad = prev->pad - len;
+		prev->pad = 0;
+	} else {
+		off = (idx < prog->ninsn) ? prog->insn[idx].off : (unsigned)(prog->body_end - prog->body);
+		if (prog_relocate(prog, idx, off, len) < 0)
+			return -1;
+	}
+
+	memmove(&prog->insn[idx + 1], &prog->insn[idx], (prog->ninsn - idx) * sizeof(gen_insn_t));
+	prog->ninsn++;
+
+	prog->insn[idx] = *in;
+	prog->insn[idx].off = off;
+	prog->insn[idx].len = len;
+	prog->insn[idx].pad = pad;
+	prog_write_slot(prog, &prog->insn[idx], tmp);
+	return 0;
+}
+
+/*
+ * Function: prog_delete
+ *
+ * Description: remove insn[idx], its slot becomes NOP padding of the previous
+ *              instruction while that stays under MAX_ENC_SLOT bytes, otherwise
+ *              the rest of the body is relocated over it
+ *
+ * Returns: 0, or -1 if idx is out of range
+ */
+int prog_delete(gen_prog_t *prog, int idx)
+{
+	gen_insn_t *old;
+	int slot;
+
+	if (idx < 0 || idx >= prog->ninsn)
+		return -1;
+
+	old = &prog->insn[idx];
+	slot = old->len + old->pad;
+
+	// keep padding short so mutated programs don't fill up with NOPs
+	if (idx > 0 && prog->insn[idx - 1].pad + slot <= MAX_ENC_SLOT) {
+		volatile char *p = prog->body + old->off;
+
+		prog->insn[idx - 1].pad += slot;
+		build_nop(slot, p);
+		prog_dirty(prog, p, p + slot);
+	} else {
+		prog_relocate(prog, idx + 1, old->off + slot, -slot);
+	}
+
+	prog->ninsn--;
+	memmove(&prog->insn[idx], &prog->insn[idx + 1], (prog->ninsn - idx) * sizeof(gen_insn_t));
+	return 0;
+}
+
+/*
+ * Function: prog_flush
+ *
+ * Description: make the patched bytes visible to instruction fetch.  x86 keeps the
+ *              instruction cache coherent so this is only a compiler barrier there,
+ *              but the range stays limited to the lines that changed.
+ *
+ * Returns: number of cache lines synced
+ */
+unsigned long prog_flush(gen_prog_t *prog)
+{
+	unsigned long lo, hi;
+
+	if (!prog->dirty_lo)
+		return 0;
+
+	lo = (unsigned long)prog->dirty_lo & ~63UL;
+	hi = ((unsigned long)prog->dirty_hi + 63) & ~63UL;
+	__builtin___clear_cache((char *)lo, (char *)hi);
+
+	prog->dirty_lo = prog->dirty_hi = NULL;
+	return (hi - lo) / 64;
+}
+
+/*
+ * Function: mutate_campaign
+ *
+ * Description: rerun the program of thread_id mut_iters times, each time replacing,
+ *              inserting or deleting mut_window instructions at a random spot.  The
+ *              mutations come from their own seed-derived stream so a campaign can
+ *              be replayed.
+ */
+void mutate_campaign(int thread_id, FILE *logfile)
+{
+	gen_prog_t *prog = &prog_threads[thread_id];
+	unsigned rs = chunk_seed(seed, thread_id, STREAM_MUTATE);
+	unsigned long lines = 0, passes = loop_iters > 1 ? loop_iters : 1;
+	long changes = 0, full = 0, faults = 0;
+	struct timespec t0, t1;
+	double secs;
+	int it, k;
+
+	if (profile == PROF_STACK) {
+		// a replaced PUSH or LEAVE would leave the stack unbalanced
+		LOG_AND_PRINT("Mutation: not supported for the stack profile\n");
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	for (it = 0; it < mut_iters; it++) {
+		int at = (prog->ninsn > mut_window) ? rand_r(&rs) % (prog->ninsn - mut_window + 1) : 0;
+
+		for (k = 0; k < mut_window; k++) {
+			int idx = at + k;
+			int op = rand_r(&rs) % 3;
+			gen_insn_t in;
+			int rc;
+
+			gen_pick(&rs, NULL, &in);
+
+			if (idx >= prog->ninsn)
+				op = 1;   // past the end, can only append
+			if (op == 2 && prog->ninsn <= 1)
+				op = 0;
+
+			if (op == 0)
+				rc = prog_replace(prog, idx, &in);
+			else if (op == 1)
+				rc = prog_insert(prog, idx > prog->ninsn ? prog->ninsn : idx, &in);
+			else
+				rc = prog_delete(prog, idx);
+
+			if (rc == 0)
+				changes++;
+			else
+				full++;
+			if (rc == 0 && op != 2)
+				cov_mark(cov_maps + (unsigned long)thread_id * COV_WORDS, &in);
+		}
+
+		lines += prog_flush(prog);
+		if (executeit((funct_t)prog->start, (volatile char *)mdptr_threads[thread_id]) != 0)
+			faults++;
+		stats_update(thread_id, 1, 1, (unsigned long)prog->ninsn * passes, exec_cycles, exec_signal != 0, 0);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	LOG_AND_PRINT("Mutation: %d iterations, %ld changes (%ld skipped, buffer full), %lu lines flushed, %ld faults, %.3f s, %.0f iterations/s\n",
+		      mut_iters, changes, full, lines, faults, secs, secs > 0 ? mut_iters / secs : 0.0);
+	LOG_AND_PRINT("Mutated program %d instructions, %lu bytes, checksum 0x%016lx\n", prog->ninsn,
+		      (unsigned long)(prog->end - prog->start), prog_checksum(prog->start, prog->end));
+}
+
+//
+// coverage
+//
+// Every generated instruction falls in one bin of (type, size, reg1, reg2, mod,
+// lock): 5 + 3 + 4 + 4 + 2 + 1 = COV_BIN_BITS bits.  Fields a type does not
+// encode are masked off, so e.g. all MFENCEs share one bin.  The index is computed
+// without branches and marks one bit of the worker's bitmap in the shared stats
+// block; the generator helper threads of a worker share the bitmap, hence the
+// atomic OR.  The parent merges the workers' bitmaps at the end, counts them
+// against the bins the random profile can reach and with -C writes one line per
+// hit bin.  With -c the random profile draws up to COV_TRIES candidates per
+// instruction and keeps the first one in a bin the worker has not hit yet.
+//
+#define COV_F_SIZE  (7 << 11)
+#define COV_F_REG1  (15 << 7)
+#define COV_F_REG2  (15 << 3)
+#define COV_F_MOD   (3 << 1)
+#define COV_F_LOCK  1
+
+// fields each instruction type encodes
+static const unsigned short cov_fields[] = {
+	[INSTR_REG_TO_REG]  = COV_F_SIZE | COV_F_REG1 | COV_F_REG2,
+	[INSTR_IMM_TO_REG]  = COV_F_SIZE | COV_F_REG1,
+	[INSTR_REG_TO_MEM]  = COV_F_SIZE | COV_F_REG1 | COV_F_MOD,
+	[INSTR_MEM_TO_REG]  = COV_F_SIZE | COV_F_REG1 | COV_F_MOD,
+	[INSTR_XADD_REG]    = COV_F_SIZE | COV_F_REG1 | COV_F_REG2,
+	[INSTR_XADD_MEM]    = COV_F_SIZE | COV_F_REG2 | COV_F_MOD | COV_F_LOCK,
+	[INSTR_XCHG_REG]    = COV_F_SIZE | COV_F_REG1 | COV_F_REG2,
+	[INSTR_XCHG_MEM]    = COV_F_SIZE | COV_F_REG2 | COV_F_MOD | COV_F_LOCK,
+	[INSTR_MFENCE]      = 0,
+	[INSTR_SFENCE]      = 0,
+	[INSTR_LFENCE]      = 0,
+	[INSTR_VLOAD]       = COV_F_REG1 | COV_F_MOD,
+	[INSTR_VSTORE]      = COV_F_REG1 | COV_F_MOD,
+	[INSTR_VNTSTORE]    = COV_F_REG1 | COV_F_MOD,
+	[INSTR_SSE_LOAD]    = COV_F_REG1 | COV_F_MOD,
+	[INSTR_SSE_STORE]   = COV_F_REG1 | COV_F_MOD,
+	[INSTR_MOVNTI]      = COV_F_REG1 | COV_F_MOD,
+	[INSTR_REP_MOVSB]   = COV_F_MOD,
+	[INSTR_REP_STOSB]   = COV_F_MOD,
+	[INSTR_PUSH]        = COV_F_REG1,
+	[INSTR_POP]         = COV_F_REG1,
+	[INSTR_ENTER]       = 0,
+	[INSTR_LEAVE]       = 0,
+	[INSTR_CALL_RET]    = 0,
+	[INSTR_STACK_LOAD]  = COV_F_REG1,
+};
+#define COV_NUM_TYPES (int)(sizeof(cov_fields) / sizeof(cov_fields[0]))
+
+static const char *cov_type_names[COV_NUM_TYPES] = {
+	"mov-rr", "mov-ir", "mov-rm", "mov-mr", "xadd-rr", "xadd-m", "xchg-rr", "xchg-m",
+	"mfence", "sfence", "lfence", "vmovdqu-ld", "vmovdqu-st", "vmovntdq",
+	"movdqa-ld", "movdqa-st", "movnti", "rep-movsb", "rep-stosb",
+	"push", "pop", "enter", "leave", "call-ret", "mov-rsp",
+};
+
+static const char *cov_mod_names[4] = { "disp0", "disp8", "disp32", "reg" };
+
+/*
+ * bin of one instruction: size 1..128 -> 0..7, MOD from the width of the displacement
+ * (3 for register forms, disp -1), then the fields the type does not encode masked off
+ */
+static inline unsigned cov_bin(const gen_insn_t *in)
+{
+	unsigned size = __builtin_ctz(in->size | 0x80);
+	unsigned mod = in->disp == -1 ? 3 : (in->disp != 0) + (in->disp > 127 || in->disp < -128);
+	unsigned bin;
+
+	bin = size << 11 | (in->reg1 & 15) << 7 | (in->reg2 & 15) << 3 | mod << 1 | (in->lock & 1);
+	return (unsigned)in->type << 14 | (bin & cov_fields[in->type]);
+}
+
+static inline void cov_mark(unsigned long *map, const gen_insn_t *in)
+{
+	unsigned b = cov_bin(in);
+
+	__atomic_fetch_or(&map[b >> 6], 1UL << (b & 63), __ATOMIC_RELAXED);
+}
+
+static inline int cov_test(const unsigned long *map, unsigned b)
+{
+	return (map[b >> 6] >> (b & 63)) & 1;
+}
+
+/*
+ * 1 if the random profile can produce bin b (mirrors the choices in gen_pick)
+ */
+static int cov_reachable(unsigned b)
+{
+	int type = b >> 14, size = 1 << ((b >> 11) & 7);
+	int r1 = (b >> 7) & 15, r2 = (b >> 3) & 15, mod = (b >> 1) & 3;
+	unsigned f;
+	int k, safe1 = 0, safe2 = 0, hi;
+
+	if (type >= NUM_INSTR_TYPES)
+		return 0;
+	f = cov_fields[type];
+	if (b & ~((unsigned)type << 14 | f))
+		return 0;   // not a canonical bin
+	if (!f)
+		return 1;   // fences
+	for (k = 0; k < num_safe_regs; k++) {
+		safe1 |= safe_registers[k] == r1;
+		safe2 |= safe_registers[k] == r2;
+	}
+	if (((f & COV_F_REG1) && !safe1) || ((f & COV_F_REG2) && !safe2) || mod == 3)
+		return 0;
+	if ((f & COV_F_REG1) && (f & COV_F_REG2) && r1 == r2)
+		return 0;
+	if ((f & COV_F_LOCK) == 0 && (b & 1))
+		return 0;
+
+	// a 16-bit form needs both registers below R8, a masked one can always be
+	hi = ((f & COV_F_REG1) && r1 >= 8) || ((f & COV_F_REG2) && r2 >= 8);
+	if (type >= INSTR_XADD_REG && type <= INSTR_XCHG_MEM)
+		return size == ISZ_1 || size == ISZ_4 || (size == ISZ_2 && !hi);
+	return size == ISZ_1 || size == ISZ_4 || size == ISZ_8 || (size == ISZ_2 && !hi);
+}
+
+/*
+ * Function: cov_report
+ *
+ * Description: parent side, merge the workers' bitmaps, log the hit bins per type
+ *              and against what the random profile can reach, and with -C write the
+ *              hit bins to cov_file
+ */
+void cov_report(FILE *logfile)
+{
+	unsigned long *merged = calloc(COV_WORDS, sizeof(unsigned long));
+	unsigned long hit[COV_NUM_TYPES] = { 0 }, reach[COV_NUM_TYPES] = { 0 }, rhit = 0, rall = 0, total = 0;
+	FILE *out = NULL;
+	unsigned b;
+	int t, w, thread_id = 0;   // for LOG_AND_PRINT
+
+	if (!merged)
+		return;
+	for (w = 0; w < nthreads; w++)
+		for (b = 0; b < COV_WORDS; b++)
+			merged[b] |= cov_maps[(unsigned long)w * COV_WORDS + b];
+
+	if (cov_file) {
+		out = fopen(cov_file, "w");
+		if (!out)
+			perror(cov_file);
+		else
+			fprintf(out, "# encodeit coverage, seed %u, %d workers\n# type size reg1 reg2 mod lock\n", seed, nthreads);
+	}
+
+	for (b = 0; b < (unsigned)COV_NUM_TYPES << 14; b++) {
+		int type = b >> 14, r = cov_reachable(b), h = cov_test(merged, b);
+		unsigned f = cov_fields[type];
+
+		reach[type] += r;
+		rall += r;
+		rhit += r & h;
+		if (!h)
+			continue;
+		hit[type]++;
+		total++;
+		if (out) {
+			fprintf(out, "%s", cov_type_names[type]);
+			if (f & COV_F_SIZE)
+				fprintf(out, " %d", 1 << ((b >> 11) & 7));
+			else
+				fprintf(out, " -");
+			if (f & COV_F_REG1)
+				fprintf(out, " R%u", (b >> 7) & 15);
+			else
+				fprintf(out, " -");
+			if (f & COV_F_REG2)
+				fprintf(out, " R%u", (b >> 3) & 15);
+			else
+				fprintf(out, " -");
+			fprintf(out, " %s", (f & COV_F_MOD) ? cov_mod_names[(b >> 1) & 3] : "-");
+			fprintf(out, " %s\n", (f & COV_F_LOCK) ? ((b & 1) ? "lock" : "nolock") : "-");
+		}
+	}
+	if (out)
+		fclose(out);
+	free(merged);
+
+	for (t = 0; t < COV_NUM_TYPES && logfile; t++) {
+		if (reach[t])
+			fprintf(logfile, "Coverage: %-10s %5lu of %5lu bins\n", cov_type_names[t], hit[t], reach[t]);
+		else if (hit[t])
+			fprintf(logfile, "Coverage: %-10s %5lu bins\n", cov_type_names[t], hit[t]);
+	}
+	LOG_AND_PRINT("Coverage: %lu bins hit, %lu of %lu random profile bins (%.1f%%)%s%s\n", total, rhit, rall,
+		      rall ? 100.0 * rhit / rall : 0.0, cov_file ? ", written to " : "", cov_file ? cov_file : "");
+}
+
+//
+// worker synchronisation
+//
+// Spin barrier in the shared COMM area for the modes that run the forked workers
+// in lockstep.  Workers yield while spinning so it still works when they share CPUs.
+//
+typedef struct {
+	volatile int count, sense;
+} spin_barrier_t;
+
+static void spin_barrier(spin_barrier_t *bar, int n, int *sense)
+{
+	int spins = 0;
+
+	*sense = !*sense;
+	if (__atomic_add_fetch(&bar->count, 1, __ATOMIC_ACQ_REL) == n) {
+		bar->count = 0;
+		__atomic_store_n(&bar->sense, *sense, __ATOMIC_RELEASE);
+		return;
+	}
+	while (__atomic_load_n(&bar->sense, __ATOMIC_ACQUIRE) != *sense) {
+		if (++spins > 4096)
+			sched_yield();
+		_mm_pause();
+	}
+}
+
+//
+// litmus mode
+//
+// Each worker builds the program for its role of the selected test.  The program is a
+// leaf function called with RDI = the x/y locations of one instance and RSI = the
+// result slots of this role; it does the role's stores and loads (MOV, or XCHG and
+// LOCK XADD of 0 for fence=lock, MFENCE in between for fence=mfence) and saves each
+// loaded value.  A batch of instances lives in DATA, one spin barrier in COMM starts
+// every instance on all roles at once, and after each batch role 0 histograms the
+// outcomes into COMM and clears the batch.
+//
+#define LITMUS_BATCH    256           // instances per batch
+#define LITMUS_STRIDE   128           // bytes per instance, x and y on their own line
+#define LITMUS_LOC_OFF  64            // byte offset between the locations of an instance
+
+typedef struct {
+	spin_barrier_t bar;
+	char pad[56];
+	volatile unsigned long hist[1 << (2 * LITMUS_MAX_OBS)];  // 2 bits per observable
+} litmus_comm_t;
+
+typedef void (*litmus_funct_t)(volatile char *vars, volatile unsigned long *res);
+
+static const char *litmus_regname(int reg)
+{
+	return reg == REG_RAX ? "EAX" : "ECX";
+}
+
+/*
+ * Function: litmus_build
+ *
+ * Description: encode the program of one litmus role
+ *
+ * Returns: address after the program
+ */
+volatile char *litmus_build(int thread_id, FILE *logfile, volatile char *next_ptr)
+{
+	const litmus_op_t *op = litmus->ops[thread_id];
+	int lock = (litmus_fence == LFENCE_LOCK);
+	int j;
+
+	for (j = 0; j < LITMUS_MAX_OPS && op[j].kind; j++) {
+		int disp = op[j].loc * LITMUS_LOC_OFF;
+		char loc = "xy"[(int)op[j].loc];
+
+		if (j > 0 && litmus_fence == LFENCE_MFENCE) {
+			next_ptr = build_mfence(next_ptr);
+			LOG_DETAIL("Litmus: MFENCE\n");
+		}
+
+		if (op[j].kind == 'S') {
+			next_ptr = build_imm_to_register(ISZ_4, op[j].arg, REG_RCX, next_ptr);
+			if (lock)
+				next_ptr = build_xchg(ISZ_4, REG_RDI, REG_RCX, disp, 1, next_ptr);
+			else
+				next_ptr = build_reg_to_memory(ISZ_4, REG_RCX, REG_RDI, disp, next_ptr);
+			LOG_DETAIL("Litmus: %s [RDI+%d],%s    ; %c = %d\n", lock ? "LOCK XCHG" : "MOV",
+				   disp, litmus_regname(REG_RCX), loc, op[j].arg);
+		} else {
+			if (lock) {
+				next_ptr = build_imm_to_register(ISZ_4, 0, REG_RAX, next_ptr);
+				next_ptr = build_xadd(ISZ_4, REG_RDI, REG_RAX, disp, 1, next_ptr);
+			} else {
+				next_ptr = build_mov_memory_to_register(ISZ_4, REG_RDI, REG_RAX, disp, next_ptr);
+			}
+			next_ptr = build_reg_to_memory(ISZ_8, REG_RAX, REG_RSI, op[j].arg * 8, next_ptr);
+			LOG_DETAIL("Litmus: %s [RDI+%d],%s    ; r%d = %c\n", lock ? "LOCK XADD" : "MOV",
+				   disp, litmus_regname(REG_RAX), op[j].arg, loc);
+		}
+	}
+	return ret(next_ptr);
+}
+
+/*
+ * outcome histogram index of instance k
+ */
+static int litmus_outcome(volatile char *vars, volatile unsigned long *res, int k)
+{
+	int idx = 0, o;
+
+	for (o = 0; o < litmus->nobs; o++) {
+		int role = litmus->obs[o].role, slot = litmus->obs[o].slot;
+		unsigned long v;
+
+		if (role < 0)
+			v = *(volatile int *)(vars + k * LITMUS_STRIDE + slot * LITMUS_LOC_OFF);
+		else
+			v = res[(role * LITMUS_BATCH + k) * LITMUS_MAX_OPS + slot];
+		idx |= (v > 3 ? 3 : v) << (2 * o);
+	}
+	return idx;
+}
+
+/*
+ * Function: litmus_run
+ *
+ * Description: build this worker's role and run litmus_iters instances of the test in
+ *              lockstep with the other roles, role 0 reports the histogram
+ */
+void litmus_run(int thread_id, FILE *logfile)
+{
+	litmus_comm_t *comm = (litmus_comm_t *)comm_ptr;
+	volatile char *vars = mdptr;
+	volatile unsigned long *res = (volatile unsigned long *)(mdptr + LITMUS_BATCH * LITMUS_STRIDE);
+	volatile unsigned long *my_res = res + thread_id * LITMUS_BATCH * LITMUS_MAX_OPS;
+	litmus_funct_t prog = (litmus_funct_t)mptr_threads[thread_id];
+	long nbatches = (litmus_iters + LITMUS_BATCH - 1) / LITMUS_BATCH;
+	int forbidden = -1, sense = 0, n = litmus->nroles;
+	unsigned long seen = 0, total;
+	struct timespec t0, t1;
+	double secs;
+	long b;
+	int k, o;
+
+	litmus_build(thread_id, logfile, (volatile char *)prog);
+	stats_update(thread_id, 1, 0, 0, 0, 0, 0);
+
+	if (!litmus->needs_fence || litmus_fence != LFENCE_NONE) {
+		forbidden = 0;
+		for (o = 0; o < litmus->nobs; o++)
+			forbidden |= litmus->forbidden[o] << (2 * o);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (b = 0; b < nbatches; b++) {
+		unsigned long bad = 0;
+
+		for (k = 0; k < LITMUS_BATCH; k++) {
+			spin_barrier(&comm->bar, n, &sense);
+			prog(vars + k * LITMUS_STRIDE, my_res + k * LITMUS_MAX_OPS);
+		}
+		spin_barrier(&comm->bar, n, &sense);
+		if (thread_id == 0) {
+			for (k = 0; k < LITMUS_BATCH; k++) {
+				int out = litmus_outcome(vars, res, k);
+
+				comm->hist[out]++;
+				bad += out == forbidden;
+			}
+			memset((char *)vars, 0, LITMUS_BATCH * LITMUS_STRIDE);
+			memset((char *)res, 0, n * LITMUS_BATCH * LITMUS_MAX_OPS * sizeof(*res));
+		}
+		spin_barrier(&comm->bar, n, &sense);
+		stats_update(thread_id, 0, LITMUS_BATCH, 0, 0, 0, bad);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	// the histogram is complete after the last barrier, every role sees a forbidden outcome
+	log_ring_end(thread_id, logfile, forbidden >= 0 && comm->hist[forbidden], seed + thread_id);
+
+	if (thread_id != 0)
+		return;
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	total = nbatches * LITMUS_BATCH;
+
+	LOG_AND_PRINT("Litmus %s fence=%s: %lu instances, %.3f s, %.0f instances/s\n", litmus->name,
+		      litmus_fence_names[litmus_fence], total, secs, secs > 0 ? total / secs : 0.0);
+	for (k = 0; k < (1 << (2 * litmus->nobs)); k++) {
+		char outcome[128];
+		int len = 0;
+
+		if (!comm->hist[k])
+			continue;
+		for (o = 0; o < litmus->nobs; o++) {
+			int v = (k >> (2 * o)) & 3;
+
+			if (litmus->obs[o].role < 0)
+				len += snprintf(outcome + len, sizeof(outcome) - len, " %c=%d", "xy"[(int)litmus->obs[o].slot], v);
+			else
+				len += snprintf(outcome + len, sizeof(outcome) - len, " P%d:r%d=%d",
+						litmus->obs[o].role, litmus->obs[o].slot, v);
+		}
+		LOG_AND_PRINT("Litmus outcome%s : %lu%s\n", outcome, comm->hist[k], k == forbidden ? "  FORBIDDEN" : "");
+		if (k == forbidden)
+			seen = comm->hist[k];
+	}
+
+	if (forbidden < 0)
+		LOG_AND_PRINT("Litmus %s: no forbidden outcome without a fence\n", litmus->name);
+	else if (seen)
+		LOG_AND_PRINT("Litmus %s: FAIL, forbidden outcome observed %lu times\n", litmus->name, seen);
+	else
+		LOG_AND_PRINT("Litmus %s: PASS\n", litmus->name);
+}
+
+//
+// atomicity check
+//
+// Every worker runs atom_iters calls of a program that does ATOM_UNROLL rounds of
+// LOCK XADD [RDI+line*64],ECX over atom_lines shared lines of DATA, adding
+// thread_id+1 each time.  With -X scale the run is repeated with 1, 2, .. nthreads
+// workers (the others wait at the barrier).  After each phase worker 0 saves the
+// line totals and the per-worker times in COMM and clears the lines, and the parent
+// checks the totals against the expected sums once every worker has exited.
+// The counters are 32 bits wide (build_xadd has no 64-bit form), so the sums are
+// compared modulo 2^32.
+//
+typedef struct {
+	spin_barrier_t bar;
+	char pad[56];
+	unsigned long rate_sum[MAX_THREADS];               // per phase: sum of the workers' ops/s
+	unsigned long max_ns[MAX_THREADS];                 // per phase: slowest worker
+	unsigned int total[MAX_THREADS][ATOM_MAX_LINES];   // line totals after each phase
+} atom_comm_t;
+
+typedef void (*atom_funct_t)(volatile char *lines);
+
+/*
+ * Function: atom_build
+ *
+ * Description: encode the increment program of one worker
+ *
+ * Returns: address after the program
+ */
+volatile char *atom_build(int thread_id, FILE *logfile, volatile char *next_ptr)
+{
+	int r, l;
+
+	for (r = 0; r < ATOM_UNROLL; r++) {
+		for (l = 0; l < atom_lines; l++) {
+			// XADD returns the old value in ECX, so reload the increment every time
+			next_ptr = build_imm_to_register(ISZ_4, thread_id + 1, REG_RCX, next_ptr);
+			next_ptr = build_xadd(ISZ_4, REG_RDI, REG_RCX, l * 64, 1, next_ptr);
+		}
+	}
+	LOG_DETAIL("Atomic: %d x LOCK XADD [RDI+64*line],ECX (ECX=%d) over %d lines\n",
+		   ATOM_UNROLL, thread_id + 1, atom_lines);
+	return ret(next_ptr);
+}
+
+/*
+ * phases of the run, the number of workers in the last one is nthreads
+ */
+static int atom_first_phase(void)
+{
+	return atom_scale ? 1 : nthreads;
+}
+
+/*
+ * lines whose total after the phase of workers workers is wrong, *expect is the right one
+ */
+static int atom_bad_lines(const atom_comm_t *comm, int workers, unsigned int *expect)
+{
+	unsigned int e = 0;
+	int t, l, bad = 0;
+
+	for (t = 0; t < workers; t++)
+		e += (unsigned int)((unsigned long)(t + 1) * atom_iters * ATOM_UNROLL);
+	for (l = 0; l < atom_lines; l++)
+		if (comm->total[workers - 1][l] != e)
+			bad++;
+	*expect = e;
+	return bad;
+}
+
+/*
+ * Function: atom_run
+ *
+ * Description: build this worker's program and run every phase it takes part in
+ */
+void atom_run(int thread_id, FILE *logfile)
+{
+	atom_comm_t *comm = (atom_comm_t *)comm_ptr;
+	volatile char *lines = mdptr;
+	atom_funct_t prog = (atom_funct_t)mptr_threads[thread_id];
+	unsigned long ops = (unsigned long)atom_iters * ATOM_UNROLL * atom_lines, ns, old;
+	struct timespec t0, t1;
+	unsigned int expect;
+	int workers, sense = 0, l, bad = 0;
+	long it;
+
+	atom_build(thread_id, logfile, (volatile char *)prog);
+	stats_update(thread_id, 1, 0, 0, 0, 0, 0);
+
+	for (workers = atom_first_phase(); workers <= nthreads; workers++) {
+		spin_barrier(&comm->bar, nthreads, &sense);
+		if (thread_id < workers) {
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			for (it = 0; it < atom_iters; it++)
+				prog(lines);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			ns = (t1.tv_sec - t0.tv_sec) * 1000000000UL + (t1.tv_nsec - t0.tv_nsec);
+			__atomic_add_fetch(&comm->rate_sum[workers - 1], ops * 1000000000UL / (ns ? ns : 1), __ATOMIC_RELAXED);
+			for (old = comm->max_ns[workers - 1]; old < ns; )
+				if (__atomic_compare_exchange_n(&comm->max_ns[workers - 1], &old, ns, 0,
+								__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					break;
+			// each op is a MOV ECX,imm and a LOCK XADD
+			stats_update(thread_id, 0, atom_iters, ops * 2, 0, 0, 0);
+		}
+		spin_barrier(&comm->bar, nthreads, &sense);
+		if (thread_id == 0) {
+			for (l = 0; l < atom_lines; l++) {
+				comm->total[workers - 1][l] = *(volatile unsigned int *)(lines + l * 64);
+				*(volatile unsigned int *)(lines + l * 64) = 0;
+			}
+		}
+	}
+
+	// once every total is in, a worker whose phases miscompared logs its program
+	spin_barrier(&comm->bar, nthreads, &sense);
+	for (workers = atom_first_phase(); workers <= nthreads; workers++)
+		if (thread_id < workers)
+			bad += atom_bad_lines(comm, workers, &expect);
+	log_ring_end(thread_id, logfile, bad != 0, seed + thread_id);
+}
+
+/*
+ * Function: atom_report
+ *
+ * Description: parent side, check every phase's line totals and log the ops/s curve
+ *
+ * Returns: 0 if all totals matched, 1 otherwise
+ */
+int atom_report(FILE *logfile)
+{
+	atom_comm_t *comm = (atom_comm_t *)comm_ptr;
+	unsigned long ops_per_worker = (unsigned long)atom_iters * ATOM_UNROLL * atom_lines;
+	int workers, l, rc = 0;
+
+	for (workers = atom_first_phase(); workers <= nthreads; workers++) {
+		unsigned int expect;
+		double agg = comm->rate_sum[workers - 1], slowest = comm->max_ns[workers - 1] / 1e9;
+		int bad = atom_bad_lines(comm, workers, &expect);
+		char line[256];
+
+		snprintf(line, sizeof(line), "Atomic: %d workers, %lu ops each, %.3f s, %.0f ops/s total, %.0f ops/s per core: %s\n",
+			 workers, ops_per_worker, slowest, agg, agg / workers, bad ? "FAIL" : "PASS");
+		printf("%s", line);
+		if (logfile)
+			fprintf(logfile, "%s", line);
+
+		for (l = 0; l < atom_lines && bad; l++) {
+			if (comm->total[workers - 1][l] == expect)
+				continue;
+			snprintf(line, sizeof(line), "Atomic:   line %d total 0x%08x, expected 0x%08x\n",
+				 l, comm->total[workers - 1][l], expect);
+			printf("%s", line);
+			if (logfile)
+				fprintf(logfile, "%s", line);
+		}
+		if (bad) {
+			stats_update(0, 0, 0, 0, 0, 0, bad);   // the workers are gone, the parent writes
+			rc = 1;
+		}
+	}
+	if (logfile)
+		fflush(logfile);
+	return rc;
+}
+
+//
+// cross-modifying code
+//
+// Worker 0 (the target) builds a program of xmc_sites patch sites, each on its own
+// cache line: a MOV EAX,imm32 (field=imm) or MOV EAX,[RDI+disp32] (field=disp)
+// followed by a store of EAX to the site's result slot in DATA.  The 4 byte field
+// is aligned so the patcher can rewrite it with one plain store.  Worker 1 (the
+// patcher) flips the fields between an old and a new value in the target's CODE
+// buffer, which is MAP_SHARED, so this is the cross-modifying case of SDM 8.1.3.
+// Old and new differ in every byte that can change, a torn fetch reads neither:
+// the immediates are 0x11223344/0xEEDDCCBB, the displacements point at two tag
+// slots and every mix of their bytes at a poisoned one.
+//
+// Three phases, separated by barriers:
+//  baseline    the target runs xmc_iters executions, the patcher waits
+//  race        the patcher flips the fields as fast as it can while the target runs
+//              xmc_iters executions; every site must read old or new, never a mix
+//  handshake   xmc_rounds rounds of the SDM protocol: the patcher writes all fields
+//              and publishes the round, the target sees it, runs CPUID (serializing)
+//              and executes; every site must read the new value exactly
+// The executions of the race that saw a change against the ones that did not, and
+// the executions after a handshake against the baseline, estimate what the machine
+// clear and refetch of modified code cost.
+//
+#define XMC_OLD         0x11223344U
+#define XMC_NEW         0xEEDDCCBBU
+#define XMC_POISON      0xDEADDEADU
+#define XMC_RESULT      0x400       // DATA offset of the result slots, 4 bytes per site
+#define XMC_DISP_OLD    0x1000      // + 8 * site, low two bytes differ from ..
+#define XMC_DISP_NEW    0x2004      // + 8 * site, .. so a torn displacement hits poison
+#define XMC_DATA_BYTES  0x3000      // poisoned DATA the displacements can reach
+
+typedef struct {
+	spin_barrier_t bar;
+	char pad[56];
+	volatile unsigned long stop;                        // race is over
+	volatile unsigned long round __attribute__((aligned(64)));   // handshake the patcher published
+	volatile unsigned long ack __attribute__((aligned(64)));     // handshake the target finished
+	unsigned int field_off[XMC_MAX_SITES] __attribute__((aligned(64)));   // in the target's CODE
+	unsigned long base_cycles, race_cycles, race_changes, race_change_cycles, race_torn, flips;
+	unsigned long sync_cycles, cpuid_cycles, sync_bad;
+	unsigned int torn_value, stale_value;               // first bad result of each kind
+} xmc_comm_t;
+
+typedef void (*xmc_funct_t)(volatile char *data);
+
+/*
+ * value of site's field in state v (0 = old, 1 = new), and what the site then stores
+ */
+static unsigned int xmc_field_value(int site, int v)
+{
+	if (xmc_field == XMC_DISP)
+		return (v ? XMC_DISP_NEW : XMC_DISP_OLD) + 8 * site;
+	return v ? XMC_NEW : XMC_OLD;
+}
+
+static unsigned int xmc_result_value(int v)
+{
+	return v ? XMC_NEW : XMC_OLD;
+}
+
+/*
+ * the patched instruction of site in state v, the field is its last 4 bytes
+ */
+static volatile char *xmc_site_insn(int site, int v, volatile char *next_ptr)
+{
+	if (xmc_field == XMC_DISP)
+		return build_mov_memory_to_register(ISZ_4, REG_RDI, REG_RAX, xmc_field_value(site, v), next_ptr);
+	return build_imm_to_register(ISZ_4, xmc_field_value(site, v), REG_RAX, next_ptr);
+}
+
+/*
+ * Function: xmc_build
+ *
+ * Description: poison the target's DATA, encode the sites and note where their fields are
+ *
+ * Returns: address after the program
+ */
+volatile char *xmc_build(int thread_id, xmc_comm_t *comm, volatile char *data, FILE *logfile, volatile char *next_ptr)
+{
+	volatile char *start = next_ptr, *line, *p;
+	int s, pad;
+
+	for (s = 0; s < XMC_DATA_BYTES; s += 4)
+		*(volatile unsigned int *)(data + s) = XMC_POISON;
+	for (s = 0; s < xmc_sites && xmc_field == XMC_DISP; s++) {
+		*(volatile unsigned int *)(data + xmc_field_value(s, 0)) = XMC_OLD;
+		*(volatile unsigned int *)(data + xmc_field_value(s, 1)) = XMC_NEW;
+	}
+
+	for (s = 0; s < xmc_sites; s++) {
+		line = build_nop((int)(-(long)next_ptr & 63), next_ptr);
+		// encode once to learn where the field lands, then pad it to 4 bytes
+		p = xmc_site_insn(s, 0, line);
+		pad = (int)(-(long)(p - 4) & 3);
+		p = xmc_site_insn(s, 0, build_nop(pad, line));
+		comm->field_off[s] = (unsigned int)((p - 4) - start);
+		next_ptr = build_reg_to_memory(ISZ_4, REG_RAX, REG_RDI, XMC_RESULT + 4 * s, p);
+	}
+	LOG_DETAIL("XMC: %d sites of %s EAX,%s, field at +%u.., %ld bytes\n", xmc_sites, "MOV",
+		   xmc_field == XMC_DISP ? "[RDI+disp32]" : "imm32", comm->field_off[0], (long)(next_ptr - start) + 1);
+	return ret(next_ptr);
+}
+
+/*
+ * patcher side: write every site's field for state v
+ */
+static void xmc_patch(xmc_comm_t *comm, volatile char *code, int v)
+{
+	int s;
+
+	for (s = 0; s < xmc_sites; s++)
+		__atomic_store_n((unsigned int *)(code + comm->field_off[s]), xmc_field_value(s, v), __ATOMIC_RELAXED);
+}
+
+/*
+ * spin until *p reaches v, yielding so a shared CPU gets to the other side
+ */
+static void xmc_wait(volatile unsigned long *p, unsigned long v)
+{
+	int spins = 0;
+
+	while (__atomic_load_n(p, __ATOMIC_ACQUIRE) != v) {
+		if (++spins > 64)
+			sched_yield();
+		_mm_pause();
+	}
+}
+
+/*
+ * one timed execution of the target program
+ */
+static unsigned long xmc_exec(xmc_funct_t prog, volatile char *data)
+{
+	unsigned long t0;
+
+	_mm_lfence();
+	t0 = __rdtsc();
+	_mm_lfence();
+	prog(data);
+	_mm_lfence();
+	return __rdtsc() - t0;
+}
+
+/*
+ * Function: xmc_run
+ *
+ * Description: worker 0 builds and executes the target program, worker 1 patches it
+ */
+void xmc_run(int thread_id, FILE *logfile)
+{
+	xmc_comm_t *comm = (xmc_comm_t *)comm_ptr;
+	volatile char *code = (volatile char *)mptr_threads[0], *data = (volatile char *)mdptr_threads[0];
+	xmc_funct_t prog = (xmc_funct_t)code;
+	volatile unsigned int *res = (volatile unsigned int *)(data + XMC_RESULT);
+	unsigned int a, b, c, d, r, last = 0;
+	unsigned long cycles = 0, bad = 0, t0, t;
+	int sense = 0, s, v = 0;
+	long it;
+
+	if (thread_id == 0) {
+		xmc_build(thread_id, comm, data, logfile, code);
+		stats_update(thread_id, 1, 0, 0, 0, 0, 0);
+	}
+	spin_barrier(&comm->bar, nthreads, &sense);
+
+	// baseline: nobody touches the code
+	if (thread_id == 0) {
+		for (it = 0; it < xmc_iters; it++)
+			cycles += xmc_exec(prog, data);
+		comm->base_cycles = cycles;
+		stats_update(thread_id, 0, xmc_iters, xmc_iters * 2 * xmc_sites, cycles, 0, 0);
+	}
+	spin_barrier(&comm->bar, nthreads, &sense);
+
+	// race: old or new, never a mix
+	if (thread_id == 0) {
+		cycles = 0;
+		for (it = 0; it < xmc_iters; it++) {
+			for (s = 0; s < xmc_sites; s++)
+				res[s] = XMC_POISON;
+			t = xmc_exec(prog, data);
+			cycles += t;
+			for (s = 0; s < xmc_sites; s++) {
+				r = res[s];
+				if (r != XMC_OLD && r != XMC_NEW) {
+					if (!comm->race_torn++)
+						comm->torn_value = r;
+				}
+			}
+			if (it && res[0] != last) {
+				comm->race_changes++;
+				comm->race_change_cycles += t;
+			}
+			last = res[0];
+		}
+		comm->race_cycles = cycles;
+		__atomic_store_n(&comm->stop, 1, __ATOMIC_RELEASE);
+		stats_update(thread_id, 0, xmc_iters, xmc_iters * 2 * xmc_sites, cycles, 0, comm->race_torn);
+	} else {
+		while (!__atomic_load_n(&comm->stop, __ATOMIC_ACQUIRE)) {
+			v = !v;
+			xmc_patch(comm, code, v);
+			comm->flips++;
+		}
+	}
+	spin_barrier(&comm->bar, nthreads, &sense);
+
+	// handshake: patch, publish, serialize, execute
+	cycles = 0;
+	for (it = 1; it <= xmc_rounds; it++) {
+		if (thread_id == 1) {
+			xmc_patch(comm, code, it & 1);
+			__atomic_store_n(&comm->round, it, __ATOMIC_RELEASE);
+			xmc_wait(&comm->ack, it);
+			continue;
+		}
+		xmc_wait(&comm->round, it);
+		if (xmc_cpuid) {
+			t0 = __rdtsc();
+			__cpuid(0, a, b, c, d);
+			comm->cpuid_cycles += __rdtsc() - t0;
+		}
+		for (s = 0; s < xmc_sites; s++)
+			res[s] = XMC_POISON;
+		cycles += xmc_exec(prog, data);
+		for (s = 0; s < xmc_sites; s++) {
+			if (res[s] != xmc_result_value(it & 1) && !bad++)
+				comm->stale_value = res[s];
+		}
+		__atomic_store_n(&comm->ack, it, __ATOMIC_RELEASE);
+	}
+	if (thread_id == 0) {
+		comm->sync_cycles = cycles;
+		comm->sync_bad = bad;
+		stats_update(thread_id, 0, xmc_rounds, xmc_rounds * 2 * xmc_sites, cycles, 0, bad);
+		log_ring_end(thread_id, logfile, comm->race_torn || bad, seed);   // the target built the program
+	} else {
+		stats_update(thread_id, 0, 0, 0, 0, 0, 0);
+	}
+}
+
+/*
+ * Function: xmc_report
+ *
+ * Description: parent side, log the phases and the machine clear estimate
+ *
+ * Returns: 0 if every execution saw old or new (and new after a handshake), 1 otherwise
+ */
+int xmc_report(FILE *logfile)
+{
+	xmc_comm_t *comm = (xmc_comm_t *)comm_ptr;
+	double base = (double)comm->base_cycles / xmc_iters, same = 0, changed = 0;
+	char line[256];
+	int rc = 0;
+
+	snprintf(line, sizeof(line), "XMC: baseline %.1f cycles/execution\n", base);
+	printf("%s", line);
+	if (logfile)
+		fprintf(logfile, "%s", line);
+
+	// either average is 0 when no execution fell on that side, and so is the difference
+	if (comm->race_changes < (unsigned long)xmc_iters)
+		same = (double)(comm->race_cycles - comm->race_change_cycles) / (xmc_iters - comm->race_changes);
+	if (comm->race_changes)
+		changed = (double)comm->race_change_cycles / comm->race_changes;
+	snprintf(line, sizeof(line), "XMC: race %lu flips, %lu changes seen, %.1f cycles/execution, %.1f on a change (%+.0f), %lu torn: %s\n",
+		 comm->flips, comm->race_changes, same, changed, same && changed ? changed - same : 0.0,
+		 comm->race_torn, comm->race_torn ? "FAIL" : "PASS");
+	printf("%s", line);
+	if (logfile)
+		fprintf(logfile, "%s", line);
+	if (comm->race_torn) {
+		snprintf(line, sizeof(line), "XMC:   first torn result 0x%08x\n", comm->torn_value);
+		printf("%s", line);
+		if (logfile)
+			fprintf(logfile, "%s", line);
+		rc = 1;
+	}
+
+	if (xmc_rounds) {
+		snprintf(line, sizeof(line), "XMC: handshake %ld rounds, %s %.0f cycles, %.1f cycles/execution of patched code (%+.0f), %lu stale: %s\n",
+			 xmc_rounds, xmc_cpuid ? "CPUID" : "no CPUID", (double)comm->cpuid_cycles / xmc_rounds,
+			 (double)comm->sync_cycles / xmc_rounds, (double)comm->sync_cycles / xmc_rounds - base, comm->sync_bad, comm->sync_bad ? "FAIL" : "PASS");
+		printf("%s", line);
+		if (logfile)
+			fprintf(logfile, "%s", line);
+		if (comm->sync_bad) {
+			snprintf(line, sizeof(line), "XMC:   first stale result 0x%08x\n", comm->stale_value);
+			printf("%s", line);
+			if (logfile)
+				fprintf(logfile, "%s", line);
+			rc = 1;
+		}
+	}
+	if (logfile)
+		fflush(logfile);
+	return rc;
+}
+
+//
+// NUMA placement
+//
+// With -N the parent gives every worker its own DATA slice and binds the worker's
+// CODE and DATA slices to a node with mbind() before anything touches them: CODE
+// always to the node of the worker's CPU, DATA to the same node (local) or the next
+// one (remote, for cross-socket coherence and bandwidth).  The topology comes from
+// sysfs and the system calls are made directly so libnuma is not needed.  Each
+// worker records where its DATA really landed and its cycle counts, and the parent
+// reports them per (CPU node, memory node) pair.
+//
+#ifndef MPOL_BIND
+#define MPOL_BIND       2
+#define MPOL_F_NODE     (1 << 0)
+#define MPOL_F_ADDR     (1 << 1)
+#define MPOL_MF_MOVE    (1 << 1)
+#endif
+#define NUMA_MAX_NODES  64
+
+/*
+ * number of NUMA nodes, 1 when sysfs does not say
+ */
+static int numa_nodes(void)
+{
+	DIR *dir = opendir("/sys/devices/system/node");
+	struct dirent *de;
+	int n = 0;
+
+	if (!dir)
+		return 1;
+	while ((de = readdir(dir)) != NULL)
+		if (strncmp(de->d_name, "node", 4) == 0 && de->d_name[4] >= '0' && de->d_name[4] <= '9')
+			n++;
+	closedir(dir);
+	return n ? n : 1;
+}
+
+/*
+ * node a CPU belongs to (the nodeN link in its sysfs directory), 0 if unknown
+ */
+int numa_node_of_cpu(int cpu)
+{
+	char path[64];
+	DIR *dir;
+	struct dirent *de;
+	int node = 0;
+
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	if (!(dir = opendir(path)))
+		return 0;
+	while ((de = readdir(dir)) != NULL)
+		if (strncmp(de->d_name, "node", 4) == 0 && de->d_name[4] >= '0' && de->d_name[4] <= '9') {
+			node = atoi(de->d_name + 4);
+			break;
+		}
+	closedir(dir);
+	return node;
+}
+
+/*
+ * node the page at addr is on, -1 if the kernel does not tell
+ */
+int numa_mem_node(volatile void *addr)
+{
+	int node = -1;
+
+	if (syscall(SYS_get_mempolicy, &node, NULL, 0, (void *)addr, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+		return -1;
+	return node;
+}
+
+static int numa_bind_range(volatile char *start, unsigned long len, int node)
+{
+	unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+
+	mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+	return syscall(SYS_mbind, (void *)start, len, MPOL_BIND, mask, NUMA_MAX_NODES + 1, MPOL_MF_MOVE);
+}
+
+/*
+ * Function: numa_place
+ *
+ * Description: bind the CODE and DATA slices of worker thread_id, called by the
+ *              parent before the worker is forked
+ *
+ * Returns: 0, or -1 if mbind failed
+ */
+int numa_place(int thread_id, FILE *logfile)
+{
+	int nodes = numa_nodes();
+	int cpu_node = numa_node_of_cpu(worker_cpu(thread_id));
+	int mem_node = cpu_node;
+
+	if (numa_mode == NUMA_REMOTE) {
+		mem_node = (cpu_node + 1) % nodes;
+		if (nodes == 1 && thread_id == 0)
+			printf("Only one NUMA node, remote placement is local\n");
+	}
+	if (mem_node >= NUMA_MAX_NODES) {
+		fprintf(stderr, "T%d: node %d beyond %d\n", thread_id, mem_node, NUMA_MAX_NODES);
+		return -1;
+	}
+
+	// a -s program is shared by all nodes, only DATA is placed
+	if ((!pic_mode && numa_bind_range(mptr + thread_id * instr_bytes, instr_bytes, cpu_node) != 0) ||
+	    numa_bind_range((volatile char *)mdptr_threads[thread_id], data_bytes, mem_node) != 0) {
+		if (errno == ENOSYS) {
+			// kernel without NUMA support, everything is local anyway
+			if (thread_id == 0)
+				printf("No NUMA support in the kernel, placement left to first touch\n");
+			return 0;
+		}
+		perror("mbind");
+		return -1;
+	}
+	if (logfile) {
+		fprintf(logfile, "T%d NUMA: CPU %d on node %d, CODE on node %d, DATA on node %d\n", thread_id,
+			worker_cpu(thread_id), cpu_node, cpu_node, mem_node);
+		fflush(logfile);
+	}
+	return 0;
+}
+
+/*
+ * Function: numa_report
+ *
+ * Description: parent side, cycles and bandwidth of the workers per node pair
+ */
+void numa_report(FILE *logfile)
+{
+	int t, u;
+
+	for (t = 0; t < nthreads; t++) {
+		worker_result_t *w = &worker_results[t];
+		unsigned long cycles = 0, instrs = 0, bytes = 0;
+		int n = 0;
+		char line[256];
+
+		// first worker of each pair prints it
+		for (u = 0; u < t; u++)
+			if (worker_results[u].cpu_node == w->cpu_node && worker_results[u].mem_node == w->mem_node)
+				break;
+		if (u < t)
+			continue;
+
+		for (u = t; u < nthreads; u++) {
+			if (worker_results[u].cpu_node != w->cpu_node || worker_results[u].mem_node != w->mem_node)
+				continue;
+			cycles += worker_results[u].cycles;
+			instrs += worker_results[u].instrs;
+			bytes += worker_results[u].bytes;
+			n++;
+		}
+		if (!cycles)
+			continue;   // workers did not run
+
+		snprintf(line, sizeof(line), "NUMA: CPU node %d -> memory node %d: %d workers, %lu cycles avg, %.2f cycles/instr, %.2f bytes/cycle\n",
+			 w->cpu_node, w->mem_node, n, cycles / n, (double)cycles / (instrs ? instrs : 1), (double)bytes / cycles);
+		printf("%s", line);
+		if (logfile)
+			fprintf(logfile, "%s", line);
+	}
+	if (logfile)
+		fflush(logfile);
+}
+
+//
+// job mode
+//
+// Instead of one program per worker, the parent hands out jobs (seed, profile,
+// size) through a bounded ring in COMM and every worker takes the next one as soon
+// as it is idle, so a mix of short and long jobs keeps all CPUs busy.  The parent
+// is the only producer; the workers pop with a CAS on head.  Every slot carries a
+// sequence number telling whether it is free for the producer or ready for a
+// consumer (the bounded MPMC queue of D. Vyukov), so neither side ever takes a
+// lock or waits for the other.  Job k uses seed+k, so a failing job can be rerun on
+// its own with that seed, profile and size.  The parent stops refilling at the -t
+// deadline; workers then finish the job they are on and exit.
+//
+// The runs of a campaign go through the same ring one after the other: the parent
+// waits until every job of a run has finished, reports it, and sets the number of
+// workers that take jobs for the next one (the rest sleep), so the buffers and
+// pinned workers are reused for the whole campaign.
+//
+#define SCHED_RING  256         // slots, power of 2
+
+typedef struct {
+	long id;
+	unsigned seed;
+	int profile;
+	int ninstrs;
+	int shared;              // DATA region of all workers instead of the worker's slice
+	long log_every;          // -g policy of the job's run
+} sched_job_t;
+
+typedef struct {
+	volatile unsigned long seq;
+	sched_job_t job;
+} __attribute__((aligned(64))) sched_slot_t;
+
+typedef struct {
+	volatile unsigned long head __attribute__((aligned(64)));   // next slot to pop, workers
+	volatile unsigned long tail __attribute__((aligned(64)));   // next slot to fill, parent
+	volatile int closed;                                         // no more jobs will be pushed
+	volatile int stop;                                           // deadline, drop what is queued
+	volatile int active;                                         // workers 0..active-1 take jobs
+	unsigned long start_ns;
+	sched_slot_t slot[SCHED_RING];
+	unsigned long jobs[MAX_THREADS];                             // jobs finished per worker
+	unsigned long hung[MAX_THREADS];                             // jobs the watchdog killed, per worker
+	sched_job_t cur[MAX_THREADS];                                // job each worker is on
+} sched_comm_t;
+
+/*
+ * parent side, queue job if there is a free slot, 0 if the ring is full
+ */
+static int sched_push(sched_comm_t *q, const sched_job_t *job)
+{
+	unsigned long pos = q->tail;
+	sched_slot_t *s = &q->slot[pos & (SCHED_RING - 1)];
+
+	if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != pos)
+		return 0;
+	s->job = *job;
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+	q->tail = pos + 1;
+	return 1;
+}
+
+/*
+ * worker side, take the oldest job, 0 if the ring is empty
+ */
+static int sched_pop(sched_comm_t *q, sched_job_t *job)
+{
+	unsigned long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+	for (;;) {
+		sched_slot_t *s = &q->slot[pos & (SCHED_RING - 1)];
+		long dif = (long)(__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+
+		if (dif < 0)
+			return 0;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				*job = s->job;
+				__atomic_store_n(&s->seq, pos + SCHED_RING, __ATOMIC_RELEASE);
+				return 1;
+			}
+			// lost the race, pos now holds the current head
+		} else {
+			pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*
+ * Function: sched_worker
+ *
+ * Description: worker side of job mode, build and run jobs until the queue is
+ *              closed and empty or the deadline stops the run
+ */
+void sched_worker(int thread_id, FILE *logfile)
+{
+	sched_comm_t *q = (sched_comm_t *)comm_ptr;
+	unsigned long passes = loop_iters > 1 ? loop_iters : 1;
+	sched_job_t job;
+	int ibuilt;
+
+	struct timespec nap = { 0, 100000 };
+
+	while (!q->stop) {
+		if (thread_id >= q->active) {
+			// not part of this run
+			if (q->closed)
+				break;
+			nanosleep(&nap, NULL);
+			stats_update(thread_id, 0, 0, 0, 0, 0, 0);   // idle is not hung
+			continue;
+		}
+		if (!sched_pop(q, &job)) {
+			if (q->closed)
+				break;
+			sched_yield();
+			stats_update(thread_id, 0, 0, 0, 0, 0, 0);
+			continue;
+		}
+		q->cur[thread_id] = job;
+		stats_update(thread_id, 0, 0, 0, 0, 0, 0);
+
+		// a forked worker owns its copy of the generator settings
+		seed = job.seed;
+		profile = job.profile;
+		target_ninstrs = job.ninstrs;
+		mdptr_threads[thread_id] = (tptrs)(job.shared ? mdptr : mdptr + thread_id * data_bytes);
+		log_rings[thread_id].every = job.log_every;
+
+		ibuilt = build_program((volatile char *)mptr_threads[thread_id], thread_id, logfile);
+		if (executeit((funct_t)mptr_threads[thread_id], (volatile char *)mdptr_threads[thread_id]) != 0)
+			LOG_AND_PRINT("fault: signal %d\n", exec_signal);
+		stats_update(thread_id, 1, 1, (unsigned long)ibuilt * passes, exec_cycles, exec_signal != 0, 0);
+		log_ring_end(thread_id, logfile, exec_signal != 0, job.seed);
+		LOG_AND_PRINT("Job %ld: seed %u, %s, %d instructions, %lu cycles%s\n", job.id, job.seed,
+			      profile_names[job.profile], job.ninstrs, exec_cycles, exec_signal ? ", FAULT" : "");
+
+		if (mut_iters > 0)
+			mutate_campaign(thread_id, logfile);
+		q->jobs[thread_id]++;
+	}
+}
+
+/*
+ * empty ring, before the workers start
+ */
+void sched_init(void)
+{
+	sched_comm_t *q = (sched_comm_t *)comm_ptr;
+	struct timespec now;
+	int k;
+
+	for (k = 0; k < SCHED_RING; k++)
+		q->slot[k].seq = k;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	q->start_ns = now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+/*
+ * jobs finished by all workers so far
+ */
+static unsigned long sched_finished(sched_comm_t *q)
+{
+	unsigned long n = 0;
+	int t;
+
+	for (t = 0; t < nthreads; t++)
+		n += q->jobs[t] + q->hung[t];
+	return n;
+}
+
+/*
+ * faults and miscompares of all workers so far
+ */
+static unsigned long sched_errors(void)
+{
+	unsigned long n = 0;
+	int t;
+
+	for (t = 0; t < nthreads; t++)
+		n += stats->worker[t].faults + stats->worker[t].miscompares;
+	return n;
+}
+
+/*
+ * Function: sched_run
+ *
+ * Description: parent side of job mode, for every run keep the ring topped up until
+ *              all its jobs are handed out and finished, or the deadline passes
+ */
+void sched_run(int started, FILE *logfile)
+{
+	sched_comm_t *q = (sched_comm_t *)comm_ptr;
+	struct timespec now, nap = { 0, 1000000 };
+	sched_job_t job;
+	int r, thread_id = 0;   // for LOG_AND_PRINT
+
+	for (r = 0; r < sched_nruns && started && !q->stop; r++) {
+		sched_run_t *run = &sched_runs[r];
+		unsigned long first = q->tail, errors = sched_errors(), t0;
+		long k = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		t0 = now.tv_sec * 1000000000UL + now.tv_nsec;
+		q->active = run->workers;
+		for (;;) {
+			while (!run->njobs || k < run->njobs) {
+				unsigned rs;
+
+				job.id = q->tail;
+				job.seed = run->first_seed + k;
+				job.profile = run->profiles[k % run->nprofiles];
+				rs = chunk_seed(job.seed, 0, STREAM_JOB);
+				job.ninstrs = run->min + rand_r(&rs) % (run->max - run->min + 1);
+				job.shared = run->shared;
+				job.log_every = run->log_every;
+				if (!sched_push(q, &job))
+					break;
+				k++;
+			}
+			if (k == run->njobs && sched_finished(q) == q->tail)
+				break;   // run complete
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (run_deadline && now.tv_sec * 1000000000UL + now.tv_nsec - q->start_ns >= run_deadline * 1e9) {
+				q->stop = 1;
+				break;
+			}
+			if (watchdog_secs > 0)
+				watchdog_check(started, logfile);
+			nanosleep(&nap, NULL);
+		}
+
+		if (sched_nruns > 1) {
+			double secs;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			secs = (now.tv_sec * 1000000000UL + now.tv_nsec - t0) / 1e9;
+			LOG_AND_PRINT("Run %d: %lu jobs, %d workers, %s DATA, %.3f s, %.1f jobs/s, %lu faults/miscompares%s\n",
+				      r, q->tail - first, run->workers, run->shared ? "shared" : "private", secs,
+				      secs > 0 ? (q->tail - first) / secs : 0.0, sched_errors() - errors,
+				      q->stop ? " (deadline)" : "");
+		}
+	}
+	q->closed = 1;
+}
+
+/*
+ * jobs finished per worker and in total, once the workers have exited
+ */
+void sched_report(int started, FILE *logfile)
+{
+	sched_comm_t *q = (sched_comm_t *)comm_ptr;
+	struct timespec now;
+	unsigned long done = 0;
+	double secs;
+	int t, thread_id = 0;   // for LOG_AND_PRINT
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec * 1000000000UL + now.tv_nsec - q->start_ns) / 1e9;
+	for (t = 0; t < started; t++) {
+		if (q->hung[t])
+			LOG_AND_PRINT("Jobs: worker %d finished %lu, %lu killed by the watchdog\n", t, q->jobs[t], q->hung[t]);
+		else
+			LOG_AND_PRINT("Jobs: worker %d finished %lu\n", t, q->jobs[t]);
+		done += q->jobs[t];
+	}
+	LOG_AND_PRINT("Jobs: %lu of %lu handed out finished in %.3f s, %.1f jobs/s%s\n", done, q->tail, secs,
+		      secs > 0 ? done / secs : 0.0, q->stop ? " (deadline)" : "");
+}
+
+/*
+ * COMM bytes the litmus, atomicity, cross-modifying code and job mode layouts need
+ */
+unsigned long comm_layout_bytes(void)
+{
+	unsigned long n = sizeof(litmus_comm_t) > sizeof(atom_comm_t) ? sizeof(litmus_comm_t) : sizeof(atom_comm_t);
+
+	if (n < sizeof(xmc_comm_t))
+		n = sizeof(xmc_comm_t);
+	return n > sizeof(sched_comm_t) ? n : sizeof(sched_comm_t);
+}
+
+//
+// watchdog
+//
+// With -w the parent does not block in waitpid.  It polls the workers' heartbeats
+// in the stats block (every stats_update stamps one, and the job mode workers
+// stamp one when they pick up a job and while they are idle) and SIGKILLs a
+// worker whose heartbeat is older than watchdog_secs.  The worker's CODE slice is
+// MAP_SHARED, so the parent saves the program it was stuck in to
+// hang-<pid>-T<worker>-<n>.code and logs the seed, profile and size that rebuild
+// it.  In job mode the job counts as finished and a fresh worker is forked in the
+// same slot, so the CPU keeps taking jobs; in the other modes rerunning would only
+// hang again, so the slot stays empty.
+//
+
+/*
+ * save the CODE slice of a killed worker and log how to rebuild its program
+ */
+static void watchdog_record(int i, double secs, FILE *logfile)
+{
+	sched_comm_t *q = (sched_comm_t *)comm_ptr;
+	char path[64];
+	FILE *f;
+	int thread_id = i;   // for LOG_AND_PRINT
+
+	snprintf(path, sizeof(path), "hang-%d-T%d-%lu.code", getpid(), i, stats->worker[i].hangs);
+	f = fopen(path, "w");
+	if (!f || fwrite((const void *)mptr_threads[i], 1, instr_bytes, f) != instr_bytes)
+		perror(path);
+	if (f)
+		fclose(f);
+
+	if (sched_mode)
+		LOG_AND_PRINT("Watchdog: no heartbeat for %.1f s, killed in job %ld: seed %u, %s, %d instructions, code in %s\n",
+			      secs, q->cur[i].id, q->cur[i].seed, profile_names[q->cur[i].profile], q->cur[i].ninstrs, path);
+	else
+		LOG_AND_PRINT("Watchdog: no heartbeat for %.1f s, killed: seed %u, %s, %d instructions, worker %d, code in %s\n",
+			      secs, seed, stats->profile, target_ninstrs, i, path);
+}
+
+/*
+ * Function: watchdog_check
+ *
+ * Description: kill the workers whose heartbeat is too old, in job mode start
+ *              replacements while jobs are still handed out
+ *
+ * Returns: workers killed
+ */
+int watchdog_check(int started, FILE *logfile)
+{
+	sched_comm_t *q = (sched_comm_t *)comm_ptr;
+	struct timespec now;
+	unsigned long t, hb;
+	int i, killed = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	t = now.tv_sec * 1000000000UL + now.tv_nsec;
+	for (i = 0; i < started; i++) {
+		// a worker may stamp a heartbeat after t was read
+		hb = stats->worker[i].heartbeat_ns;
+		if (!workers[i].pid || !hb || hb >= t || t - hb < watchdog_secs * 1e9)
+			continue;
+
+		guard_kill(workers[i].pid);
+		workers[i].pid = 0;
+		watchdog_record(i, (t - hb) / 1e9, logfile);
+		stats_add(&stats->worker[i].hangs, 1);
+		killed++;
+
+		if (sched_mode) {
+			q->hung[i]++;
+			if (!q->closed && worker_start(i) != 0)
+				workers[i].pid = 0;
+		}
+	}
+	return killed;
+}
+
+/*
+ * Function: watchdog_wait
+ *
+ * Description: wait for the workers to exit, killing the ones that hang
+ */
+void watchdog_wait(int started, FILE *logfile)
+{
+	struct timespec nap = { 0, 10000000 };
+	int i, left;
+
+	do {
+		watchdog_check(started, logfile);
+		for (left = 0, i = 0; i < started; i++) {
+			if (!workers[i].pid)
+				continue;
+			if (guard_exited(workers[i].pid))
+				workers[i].pid = 0;
+			else
+				left++;
+		}
+		if (left)
+			nanosleep(&nap, NULL);
+	} while (left);
+}
+
+//
+// live statistics
+//
+// The COMM area lives in a named POSIX shared memory object (-M, default
+// /encodeit.<pid>) behind a fixed layout stats block, see testrig_stats.h.  Every
+// worker updates only its own cache line of counters, with plain stores, after
+// each program it builds or runs; monitor maps the object read only and samples
+// it, so watching a run costs the workers nothing.  The parent sets done once the
+// workers are finished and unlinks the name on the way out, a monitor that is
+// still attached keeps its mapping.
+//
+
+/*
+ * Function: stats_open
+ *
+ * Description: create the shared memory object and fill in the stats header.
+ *              Falls back to an anonymous mapping (no monitoring) if the object
+ *              cannot be created.
+ *
+ * Returns: the COMM area behind the stats block, MAP_FAILED on error
+ */
+void *stats_open(unsigned long comm_bytes)
+{
+	struct timespec now;
+	char *base = MAP_FAILED;
+	int fd;
+
+	stats_size = stats_bytes(nthreads, PAGESIZE);
+	if (!stats_name[0])
+		snprintf(stats_name, sizeof(stats_name), "/encodeit.%d", (int)getpid());
+
+	fd = shm_open(stats_name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd >= 0) {
+		if (ftruncate(fd, stats_size + comm_bytes) == 0)
+			base = mmap(NULL, stats_size + comm_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (base == MAP_FAILED)
+			shm_unlink(stats_name);
+	}
+	if (base == MAP_FAILED) {
+		fprintf(stderr, "%s: %s, stats not shared\n", stats_name, strerror(errno));
+		stats_name[0] = 0;
+		base = mmap(NULL, stats_size + comm_bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0);
+		if (base == MAP_FAILED)
+			return MAP_FAILED;
+	}
+
+	stats = (testrig_stats_t *)base;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	stats->version = STATS_VERSION;
+	stats->nworkers = nthreads;
+	stats->stats_bytes = stats_size;
+	stats->cov_offset = stats_cov_offset(nthreads, PAGESIZE);
+	cov_maps = (unsigned long *)(base + stats->cov_offset);
+	stats->start_ns = now.tv_sec * 1000000000UL + now.tv_nsec;
+	stats->pid = getpid();
+	stats->seed = seed;
+	snprintf(stats->profile, sizeof(stats->profile), "%s",
+		 litmus ? "litmus" : atom_iters ? "atomic" : xmc_iters ? "xmc" : profile_names[profile]);
+	// a monitor only trusts the rest once the magic is there
+	__atomic_store_n(&stats->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+
+	if (stats_name[0])
+		printf("Stats = %s\n", stats_name);
+	return base + stats_size;
+}
+
+/*
+ * unmap the stats block and COMM, and remove the name
+ */
+void stats_close(unsigned long comm_bytes)
+{
+	if (stats_name[0])
+		shm_unlink(stats_name);
+	munmap(stats, stats_size + comm_bytes);
+	stats = NULL;
+}
+
+/*
+ * refresh the heartbeat of thread_id, safe from any thread (the -j generator helpers)
+ */
+void stats_heartbeat(int thread_id)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	__atomic_store_n(&stats->worker[thread_id].heartbeat_ns, now.tv_sec * 1000000000UL + now.tv_nsec,
+			 __ATOMIC_RELAXED);
+}
+
+/*
+ * Function: stats_update
+ *
+ * Description: add to the counters of thread_id and refresh its heartbeat.  The
+ *              counters have a single writer: the owning worker while it runs, or
+ *              the parent before it starts (the -s build) or after it is gone
+ *              (atomicity miscompares).  Other threads use stats_heartbeat.
+ */
+void stats_update(int thread_id, unsigned long generated, unsigned long executed, unsigned long instrs,
+		  unsigned long cycles, unsigned long faults, unsigned long miscompares)
+{
+	testrig_worker_stats_t *w = &stats->worker[thread_id];
+
+	stats_add(&w->programs_generated, generated);
+	stats_add(&w->programs_executed, executed);
+	stats_add(&w->instructions, instrs);
+	stats_add(&w->cycles, cycles);
+	stats_add(&w->faults, faults);
+	stats_add(&w->miscompares, miscompares);
+	stats_heartbeat(thread_id);
+}
+
+//
+// benchmark
+//
+// -B times the rig's own subsystems in the parent and writes one CSV row per result
+// (subsystem,name,param,value,unit) so runs of different versions can be diffed:
+// encoder ns/instruction for the build_*, tmpl_* and bulk_* routines, generation
+// instructions/s and execution time over a range of program sizes, worker startup
+// per backend, and the cost of logging.  The debug output the encoders and the
+// generator write to stderr goes to /dev/null while timing, its cost is included.
+//
+#define BENCH_ENC_ITERS  200000
+
+static unsigned long bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void bench_emit(FILE *csv, const char *subsystem, const char *name, long param, double value, const char *unit)
+{
+	fprintf(csv, "%s,%s,%ld,%.3f,%s\n", subsystem, name, param, value, unit);
+	printf("bench %-10s %-28s %8ld %14.3f %s\n", subsystem, name, param, value, unit);
+}
+
+// time BENCH_ENC_ITERS encodings of one routine, restarting the buffer every 256
+#define BENCH_ENC(csv, buf, name, expr) do { \
+	volatile char *next_ptr = (buf); \
+	unsigned long t0 = bench_ns(); \
+	int k; \
+	for (k = 0; k < BENCH_ENC_ITERS; k++) { \
+		if ((k & 255) == 0) \
+			next_ptr = (buf); \
+		next_ptr = (expr); \
+	} \
+	bench_emit(csv, "encoder", name, BENCH_ENC_ITERS, (double)(bench_ns() - t0) / BENCH_ENC_ITERS, "ns/instr"); \
+} while (0)
+
+static void bench_encoders(FILE *csv)
+{
+	volatile char *buf = mptr;
+	unsigned char regs[256];
+	int disps[256], k;
+
+	BENCH_ENC(csv, buf, "build_mov_register_to_register", build_mov_register_to_register(ISZ_8, REG_RAX, REG_R9, next_ptr));
+	BENCH_ENC(csv, buf, "build_imm_to_register", build_imm_to_register(ISZ_4, 0x1234, REG_RCX, next_ptr));
+	BENCH_ENC(csv, buf, "build_reg_to_memory", build_reg_to_memory(ISZ_4, REG_RDX, REG_RSI, 64, next_ptr));
+	BENCH_ENC(csv, buf, "build_mov_memory_to_register", build_mov_memory_to_register(ISZ_4, REG_RSI, REG_RDX, 64, next_ptr));
+	BENCH_ENC(csv, buf, "build_xadd", build_xadd(ISZ_4, REG_RSI, REG_RBX, 8, 1, next_ptr));
+	BENCH_ENC(csv, buf, "build_xchg", build_xchg(ISZ_4, REG_RSI, REG_RBX, 8, 1, next_ptr));
+	BENCH_ENC(csv, buf, "build_mfence", build_mfence(next_ptr));
+	BENCH_ENC(csv, buf, "build_nop", build_nop(5, next_ptr));
+	BENCH_ENC(csv, buf, "build_movnti", build_movnti(ISZ_8, REG_R10, REG_RSI, 64, next_ptr));
+	BENCH_ENC(csv, buf, "build_vmovdqu", build_vmovdqu(1, VEX_L256, 9, REG_RSI, 96, next_ptr));
+	BENCH_ENC(csv, buf, "build_cache_line_op", build_cache_line_op(CACHE_CLFLUSH, REG_RDI, 0, next_ptr));
+	BENCH_ENC(csv, buf, "tmpl_mov_register_to_register", tmpl_mov_register_to_register(ISZ_8, REG_RAX, REG_R9, next_ptr));
+	BENCH_ENC(csv, buf, "tmpl_imm_to_register", tmpl_imm_to_register(ISZ_4, 0x1234, REG_RCX, next_ptr));
+	BENCH_ENC(csv, buf, "tmpl_reg_to_memory", tmpl_reg_to_memory(ISZ_4, REG_RDX, REG_RSI, 64, next_ptr));
+	BENCH_ENC(csv, buf, "tmpl_xadd", tmpl_xadd(ISZ_4, REG_RSI, REG_RBX, 8, 1, next_ptr));
+
+	// bulk encoders per instruction, runs of 256
+	for (k = 0; k < 256; k++) {
+		regs[k] = safe_registers[k % num_safe_regs];
+		disps[k] = (k * 37) % 2000;
+	}
+	{
+		unsigned long t0 = bench_ns();
+
+		for (k = 0; k < BENCH_ENC_ITERS / 256; k++)
+			bulk_reg_to_memory(ISZ_4, regs, REG_RSI, disps, 256, NULL, buf);
+		bench_emit(csv, "encoder", "bulk_reg_to_memory", BENCH_ENC_ITERS / 256 * 256,
+			   (double)(bench_ns() - t0) / (BENCH_ENC_ITERS / 256 * 256), "ns/instr");
+	}
 }
 
-static inline volatile char *add_endi(volatile char *tgt_addr)
-{    
-    // Restore callee-saved registers in REVERSE order (LIFO stack)
-    // Order: R15, R14, R13, R12, RBX
-    
-    // Pop R15 (needs REX.B)
-    tgt_addr = build_pop_reg(REG_R15, 1, tgt_addr);
-    
-    // Pop R14 (needs REX.B)
-    tgt_addr = build_pop_reg(REG_R14, 1, tgt_addr);
-    
-    // Pop R13 (needs REX.B)
-    tgt_addr = build_pop_reg(REG_R13, 1, tgt_addr);
-    
-    // Pop R12 (needs REX.B)
-    tgt_addr = build_pop_reg(REG_R12, 1, tgt_addr);
-    
-    // Pop RBX (no REX needed)
-    tgt_addr = build_pop_reg(REG_RBX, 0, tgt_addr);
-	
-	// Release stack frame
-    tgt_addr = leave(tgt_addr);
-    
-    // Return to caller
-    tgt_addr = ret(tgt_addr);
-    
-    return tgt_addr;
+/*
+ * build one program of n instructions in worker 0's buffer, returns the ns it took
+ */
+static unsigned long bench_build(int n, FILE *log)
+{
+	unsigned long t0;
+
+	free(prog_threads[0].insn);
+	prog_threads[0].insn = NULL;
+	target_ninstrs = n;
+
+	t0 = bench_ns();
+	build_instructions((volatile char *)mptr_threads[0], 0, log);
+	return bench_ns() - t0;
+}
+
+static void bench_generate(FILE *csv)
+{
+	static const int sizes[] = { 1000, 10000, BENCH_MAX_INSTRS };
+	unsigned s;
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		unsigned long ns = bench_build(sizes[s], NULL), t0;
+
+		bench_emit(csv, "generate", profile_names[profile], sizes[s], sizes[s] * 1e9 / ns, "instr/s");
+
+		// first run takes the page faults, time the second
+		executeit((funct_t)mptr_threads[0], (volatile char *)mdptr_threads[0]);
+		t0 = bench_ns();
+		executeit((funct_t)mptr_threads[0], (volatile char *)mdptr_threads[0]);
+		bench_emit(csv, "execute", profile_names[profile], sizes[s], (bench_ns() - t0) / 1e3, "us");
+		bench_emit(csv, "execute", "cycles_per_instr", sizes[s], (double)exec_cycles / sizes[s], "cycles");
+	}
+}
+
+static void *bench_thread(void *arg)
+{
+	return arg;
+}
+
+static void bench_startup(FILE *csv)
+{
+	static const int counts[] = { 1, 16, 64 };
+	pthread_t tid[64];
+	unsigned c;
+	int k;
+
+	for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		int n = counts[c];
+		unsigned long t0 = bench_ns();
+		pid_t pids[64];
+
+		for (k = 0; k < n; k++)
+			if ((pids[k] = fork()) == 0)
+				_exit(0);
+		for (k = 0; k < n; k++)
+			if (pids[k] > 0)
+				waitpid(pids[k], NULL, 0);
+		bench_emit(csv, "startup", "fork", n, (bench_ns() - t0) / 1e3 / n, "us/worker");
+
+		t0 = bench_ns();
+		for (k = 0; k < n; k++) {
+			pthread_attr_t attr;
+			cpu_set_t mask;
+
+			CPU_ZERO(&mask);
+			CPU_SET(worker_cpu(k), &mask);
+			pthread_attr_init(&attr);
+			pthread_attr_setaffinity_np(&attr, sizeof(mask), &mask);
+			pthread_create(&tid[k], &attr, bench_thread, NULL);
+			pthread_attr_destroy(&attr);
+		}
+		for (k = 0; k < n; k++)
+			pthread_join(tid[k], NULL);
+		bench_emit(csv, "startup", "pthread", n, (bench_ns() - t0) / 1e3 / n, "us/worker");
+	}
+}
+
+/*
+ * -K program cache: a BENCH_MAX_INSTRS program built and stored, then loaded
+ */
+static void bench_cache(FILE *csv)
+{
+	char dir[] = "/tmp/encodeit-bench-XXXXXX", key[PCACHE_KEY_MAX], path[PATH_MAX];
+	const char *saved = prog_cache_dir;
+	unsigned long t0;
+
+	if (!mkdtemp(dir))
+		return;
+	prog_cache_dir = dir;
+	target_ninstrs = BENCH_MAX_INSTRS;
+
+	t0 = bench_ns();
+	build_program((volatile char *)mptr_threads[0], 0, NULL);
+	bench_emit(csv, "cache", "miss", BENCH_MAX_INSTRS, (bench_ns() - t0) / 1e3, "us");
+	t0 = bench_ns();
+	build_program((volatile char *)mptr_threads[0], 0, NULL);
+	bench_emit(csv, "cache", "hit", BENCH_MAX_INSTRS, (bench_ns() - t0) / 1e3, "us");
+
+	pcache_name(0, key, path, sizeof(path));
+	unlink(path);
+	rmdir(dir);
+	prog_cache_dir = saved;
+}
+
+static void bench_logging(FILE *csv)
+{
+	FILE *log = tmpfile();
+	unsigned long quiet, logged;
+	int n = 10000, thread_id = 0, k;
+	FILE *logfile = log;
+	unsigned long t0;
+
+	if (!log)
+		return;
+
+	quiet = bench_build(n, NULL);
+	logged = bench_build(n, log);
+	bench_emit(csv, "logging", "generate_overhead", n, 100.0 * ((double)logged - quiet) / quiet, "percent");
+
+	t0 = bench_ns();
+	for (k = 0; k < BENCH_ENC_ITERS; k++)
+		LOG_AND_PRINT("Generating: MOV R%d->[RSI+%d] (size=%d)\n", k & 15, k & 2047, ISZ_4);
+	bench_emit(csv, "logging", "log_and_print", BENCH_ENC_ITERS, (double)(bench_ns() - t0) / BENCH_ENC_ITERS, "ns/line");
+
+	// -g failed: the detail goes to the ring and is dropped
+	log_rings[0].every = LOG_FAILED;
+	logged = bench_build(n, log);
+	log_ring_end(0, log, 0, 0);
+	bench_emit(csv, "logging", "ring_overhead", n, 100.0 * ((double)logged - quiet) / quiet, "percent");
+	t0 = bench_ns();
+	for (k = 0; k < BENCH_ENC_ITERS; k++)
+		LOG_DETAIL("Generating: MOV R%d->[RSI+%d] (size=%d)\n", k & 15, k & 2047, ISZ_4);
+	bench_emit(csv, "logging", "log_ring", BENCH_ENC_ITERS, (double)(bench_ns() - t0) / BENCH_ENC_ITERS, "ns/line");
+	log_ring_end(0, log, 0, 0);
+	log_rings[0].every = log_every;
+	fclose(log);
+}
+
+/*
+ * Function: bench_run
+ *
+ * Description: run every benchmark and write the CSV
+ *
+ * Returns: 0, or 1 if the CSV could not be written
+ */
+int bench_run(const char *path)
+{
+	FILE *csv = fopen(path, "w");
+	int saved_stderr, devnull;
+
+	if (!csv) {
+		perror(path);
+		return 1;
+	}
+	fprintf(csv, "subsystem,name,param,value,unit\n");
+
+	mptr_threads[0] = (tptrs)mptr;
+	mdptr_threads[0] = (tptrs)mdptr;
+	comm_ptr_threads[0] = (tptrs)comm_ptr;
+
+	// the encoders' and generator's debug output is part of the cost, not of the report
+	fflush(stderr);
+	saved_stderr = dup(2);
+	devnull = open("/dev/null", O_WRONLY);
+	if (devnull >= 0) {
+		dup2(devnull, 2);
+		close(devnull);
+	}
+
+	bench_encoders(csv);
+	bench_generate(csv);
+	bench_cache(csv);
+	bench_startup(csv);
+	bench_logging(csv);
+
+	fflush(stderr);
+	if (saved_stderr >= 0) {
+		dup2(saved_stderr, 2);
+		close(saved_stderr);
+	}
+	fclose(csv);
+	printf("Benchmark results in %s\n", path);
+	return 0;
 }
 
 //
-// Routine:  build_instructions
+// instruction timing
 //
-// Description:
+// -I builds calibrated microbenchmarks for every instruction shape the generator
+// emits (type, operand size, LOCK) and writes one CSV row per shape.  Each shape
+// gets two bodies of TIMING_UNROLL instances between the usual header and trailer:
+// a dependent one, where every instance uses the same two registers (swapped each
+// time) and the same DATA address so it waits on the one before, and an
+// independent one, where the registers rotate over the safe set and the addresses
+// over 16 lines.  Plain loads and stores to one address do not chain, for them the
+// dependent body measures same-address traffic rather than a true latency.  Every
+// body runs TIMING_SAMPLES times behind LFENCE serialized RDTSCs; the median of an
+// empty body with the same header and trailer is subtracted and the rest divided
+// by TIMING_UNROLL.  Times are TSC cycles per instruction, which is the reference
+// clock, not core cycles, when the core runs above or below it.
 //
-// INPUTS: next_ptr, thread_id, logfile
-// 
-// OUTPUT: returns the number of instructions built
-// 
-int build_instructions(volatile char *next_ptr, int thread_id, FILE *logfile) {
+typedef void (*timing_funct_t)(void);
 
-	// Helper macro for logging to both stderr and logfile
-	#define LOG_AND_PRINT(format, ...) do { \
-		fprintf(stderr, "T%d: " format, thread_id, ##__VA_ARGS__); \
-		fflush(stderr); \
-		if (logfile) { \
-			fprintf(logfile, "T%d: " format, thread_id, ##__VA_ARGS__); \
-			fflush(logfile); \
-		} \
-	} while(0)
+/*
+ * every shape worth a row: sizes and LOCK where the type encodes them, the
+ * multi-instruction REP sequences and (without AVX) the VEX forms left out
+ */
+static int timing_shapes(gen_insn_t *shapes)
+{
+	int type, z, lock, n = 0;
 
-	int instructions_built = 0;
+	for (type = 0; type < COV_NUM_TYPES; type++) {
+		if (type == INSTR_REP_MOVSB || type == INSTR_REP_STOSB || type == INSTR_POP || type == INSTR_LEAVE)
+			continue;   // POP and LEAVE are timed with their PUSH and ENTER
+		if (type >= INSTR_VLOAD && type <= INSTR_VNTSTORE && !have_avx)
+			continue;
+		for (z = 0; z < 4; z++) {
+			int size = valid_sizes_all[z];
 
-	// example instruction generation..
+			if (!(cov_fields[type] & COV_F_SIZE)) {
+				// one row, the size is fixed by the opcode
+				if (z)
+					break;
+				size = type == INSTR_MOVNTI ? ISZ_8 : 0;
+			} else if (size == ISZ_8 && type >= INSTR_XADD_REG && type <= INSTR_XCHG_MEM) {
+				continue;   // no 64-bit XADD/XCHG encoders
+			}
+			for (lock = 0; lock <= !!(cov_fields[type] & COV_F_LOCK); lock++) {
+				gen_insn_t *in = &shapes[n++];
 
-	LOG_AND_PRINT("building instructions\n");
+				memset(in, 0, sizeof(*in));
+				in->type = type;
+				in->size = size;
+				in->lock = lock;
+				in->imm = 0x5A;
+				// one displacement width for both bodies, 16-byte aligned for MOVDQA
+				in->disp = (cov_fields[type] & COV_F_MOD) ? 128 : -1;
+				if (type == INSTR_ENTER)
+					in->imm = 16 | 1 << 16;
+				else if (type == INSTR_CALL_RET)
+					in->imm = 1;
+			}
+		}
+	}
+	return n;
+}
 
-	srand(seed + thread_id);  // Different seed per thread
-    
-    // Available registers (excluding RBP=5, RSP=4, RSI=6, R12=12, R13=13)
-    int safe_registers[] = {0, 1, 2, 3, 7, 8, 9, 10, 11, 14, 15};
-    int num_safe_regs = 11;
-    
-    // Instruction types to randomize among
-    enum instr_type {
-        INSTR_REG_TO_REG = 0,
-        INSTR_IMM_TO_REG = 1, 
-        INSTR_REG_TO_MEM = 2,
-        INSTR_MEM_TO_REG = 3,
-        INSTR_XADD_REG = 4,      // XADD reg-to-reg
-        INSTR_XADD_MEM = 5,      // XADD reg-to-memory  
-        INSTR_XCHG_REG = 6,      // XCHG reg-to-reg
-        INSTR_XCHG_MEM = 7,      // XCHG reg-to-memory
-        INSTR_MFENCE = 8,        // MFENCE - full memory barrier
-        INSTR_SFENCE = 9,        // SFENCE - store memory barrier  
-        INSTR_LFENCE = 10        // LFENCE - load memory barrier
-    };
-    int num_instr_types = 11;
-    
-    // Displacement types for memory operations
-    enum disp_type {
-        DISP_0 = 0,
-        DISP_8 = 1,     
-        DISP_32 = 2
-    };
-    int num_disp_types = 3;
-    
-    // Valid instruction sizes
-    int valid_sizes[] = {ISZ_1, ISZ_4, ISZ_8};
-    int valid_sizes_all[] = {ISZ_1, ISZ_2, ISZ_4, ISZ_8};
-    
-    // Calling the header
-    next_ptr = add_headeri(next_ptr);
-    
-    // Set up RSI with mdptr for memory operations
-    next_ptr = build_imm_to_register(ISZ_8, (long)mdptr_threads[thread_id], REG_RSI, next_ptr);
-    LOG_AND_PRINT("MOVING MDPTR: MOV #%lX->R%d (size=%d)\n", (long)mdptr_threads[thread_id], REG_RSI, ISZ_8);
-    instructions_built++;
-    LOG_AND_PRINT("Setup: loaded mdptr into RSI\n");
-    
-    int i;
-    // Generate random instructions
-    for (i = 0; i < target_ninstrs; i++) {
-        // Pick random instruction type
-        int instr_type = rand() % num_instr_types;
-        
-        // Pick random registers
-        int reg1 = safe_registers[rand() % num_safe_regs];
-        int reg2 = safe_registers[rand() % num_safe_regs];
-        
-        // Ensure reg1 != reg2 for reg-to-reg operations
-        while (reg1 == reg2 && (instr_type == INSTR_REG_TO_REG || 
-                               instr_type == INSTR_XADD_REG || 
-                               instr_type == INSTR_XCHG_REG)) {
-            reg2 = safe_registers[rand() % num_safe_regs];
-        }
-        
-		// Pick random size - FIXED VERSION
-		int size;
+/*
+ * n instances of shape, dependent or independent
+ */
+static volatile char *timing_body(const gen_insn_t *shape, int dependent, int n, volatile char *next_ptr)
+{
+	static const int low_regs[] = {0, 1, 2, 3, 7};   // 16-bit forms stay below R8
+	const int *regs = shape->size == ISZ_2 ? low_regs : safe_registers;
+	int nregs = shape->size == ISZ_2 ? 5 : num_safe_regs;
+	gen_insn_t in = *shape;
+	int k;
 
-		// Fence instructions don't need size, but we'll set a default
-		if (instr_type >= INSTR_MFENCE && instr_type <= INSTR_LFENCE) {
-			size = ISZ_4;  // Default size for fence instructions (not actually used)
+	for (k = 0; k < n; k++) {
+		if (dependent) {
+			in.reg1 = regs[k & 1];
+			in.reg2 = regs[!(k & 1)];
+		} else {
+			// nregs is odd, so the two never collide
+			in.reg1 = regs[(2 * k) % nregs];
+			in.reg2 = regs[(2 * k + 1) % nregs];
+			if (shape->disp >= 0)
+				in.disp = shape->disp + 64 * (k % 16);
 		}
-		// Special handling for XADD/XCHG (no ISZ_8 support)
-		else if (instr_type >= INSTR_XADD_REG && instr_type <= INSTR_XCHG_MEM) {
-			if (reg1 >= 8 || reg2 >= 8) {
-				int xadd_sizes[] = {ISZ_1, ISZ_4};  // No ISZ_2, ISZ_8
-				size = xadd_sizes[rand() % 2];
-			} else {
-				int xadd_sizes_all[] = {ISZ_1, ISZ_2, ISZ_4};  // No ISZ_8
-				size = xadd_sizes_all[rand() % 3];
-			}
+		if (in.type == INSTR_PUSH) {
+			// PUSH reg1, POP reg2
+			next_ptr = build_push_reg(in.reg1, in.reg1 >= 8, next_ptr);
+			next_ptr = build_pop_reg(in.reg2, in.reg2 >= 8, next_ptr);
+		} else if (in.type == INSTR_STACK_LOAD) {
+			// PUSH reg1, MOV reg2,[RSP], POP reg1: the PUSH row plus the sync and the load
+			gen_insn_t load = in;
+
+			load.reg1 = in.reg2;
+			next_ptr = build_push_reg(in.reg1, in.reg1 >= 8, next_ptr);
+			next_ptr = gen_encode(&load, next_ptr);
+			next_ptr = build_pop_reg(in.reg1, in.reg1 >= 8, next_ptr);
 		} else {
-			// Original logic for MOV instructions (includes ISZ_8)
-			if (reg1 >= 8 || reg2 >= 8) {
-				size = valid_sizes[rand() % 3];
-			} else {
-				size = valid_sizes_all[rand() % 4];
-			}
+			next_ptr = gen_encode(&in, next_ptr);
+			if (in.type == INSTR_ENTER)
+				next_ptr = leave(next_ptr);
 		}
-        
-        // Generate random immediate value
-        int imm_val = rand() % 65536;
-        
-        // Generate random displacement for memory operations
-        long displacement = 0;
-        if (instr_type == INSTR_REG_TO_MEM || instr_type == INSTR_MEM_TO_REG || 
-            instr_type == INSTR_XADD_MEM || instr_type == INSTR_XCHG_MEM) {
-            int disp_type = rand() % num_disp_types;
-            switch (disp_type) {
-                case DISP_0: displacement = 0; break;
-                case DISP_8: displacement = rand() % 128; break;
-                case DISP_32: displacement = rand() % 2000; break;
-            }
-        }
-        
-        // Random LOCK prefix for XADD/XCHG (50% chance)
-        int use_lock = (rand() % 2);
-        
-        // Generate the instruction based on type
-		switch (instr_type) {
-			case INSTR_REG_TO_REG:
-				LOG_AND_PRINT("Generating: MOV R%d->R%d (size=%d)\n", reg1, reg2, size);
-				next_ptr = build_mov_register_to_register(size, reg1, reg2, next_ptr);
-				break;
-				
-			case INSTR_IMM_TO_REG:
-				LOG_AND_PRINT("Generating: MOV #%X->R%d (size=%d)\n", imm_val, reg1, size);
-				next_ptr = build_imm_to_register(size, imm_val, reg1, next_ptr);
-				break;
-				
-			case INSTR_REG_TO_MEM:
-				LOG_AND_PRINT("Generating: MOV R%d->[RSI+%ld] (size=%d)\n", reg1, displacement, size);
-				next_ptr = build_reg_to_memory(size, reg1, REG_RSI, displacement, next_ptr);
-				break;
-				
-			case INSTR_MEM_TO_REG:
-				LOG_AND_PRINT("Generating: MOV [RSI+%ld]->R%d (size=%d)\n", displacement, reg1, size);
-				next_ptr = build_mov_memory_to_register(size, REG_RSI, reg1, displacement, next_ptr);
-				break;
-				
-			case INSTR_XADD_REG:
-				// NO LOCK for register-to-register (already atomic within core)
-				LOG_AND_PRINT("Generating: XADD R%d,R%d (size=%d)\n", reg1, reg2, size);
-				next_ptr = build_xadd(size, reg1, reg2, -1, 0, next_ptr);  // use_lock = 0
-				break;
-				
-			case INSTR_XADD_MEM:
-				LOG_AND_PRINT("Generating: %sXADD [RSI+%ld],R%d (size=%d)\n", use_lock ? "LOCK " : "", displacement, reg2, size);
-				next_ptr = build_xadd(size, REG_RSI, reg2, displacement, use_lock, next_ptr);
-				break;
-				
-			case INSTR_XCHG_REG:
-				// NO LOCK for register-to-register
-				LOG_AND_PRINT("Generating: XCHG R%d,R%d (size=%d)\n", reg1, reg2, size);
-				next_ptr = build_xchg(size, reg1, reg2, -1, 0, next_ptr);  // use_lock = 0
-				break;
-				
-			case INSTR_XCHG_MEM:
-				// LOCK makes sense for memory operations
-				LOG_AND_PRINT("Generating: %sXCHG [RSI+%ld],R%d (size=%d)\n", use_lock ? "LOCK " : "", displacement, reg2, size);
-				next_ptr = build_xchg(size, REG_RSI, reg2, displacement, use_lock, next_ptr);
-				break;
-				
-			case INSTR_MFENCE:
-				LOG_AND_PRINT("Generating: MFENCE (full memory barrier)\n");
-				next_ptr = build_mfence(next_ptr);
-				break;
-				
-			case INSTR_SFENCE:
-				LOG_AND_PRINT("Generating: SFENCE (store memory barrier)\n");
-				next_ptr = build_sfence(next_ptr);
-				break;
-				
-			case INSTR_LFENCE:
-				LOG_AND_PRINT("Generating: LFENCE (load memory barrier)\n");
-				next_ptr = build_lfence(next_ptr);
-				break;
+	}
+	return next_ptr;
+}
+
+/*
+ * encode header, body and trailer in worker 0's CODE, no body for a NULL shape
+ */
+static timing_funct_t timing_build(const gen_insn_t *shape, int dependent, int n)
+{
+	gen_prog_t *prog = &prog_threads[0];
+	volatile char *next_ptr;
+
+	prog->start = mptr;
+	prog->nreloc = 0;
+	next_ptr = add_headeri(0, mptr);
+	next_ptr = add_data_base(0, REG_RSI, next_ptr);
+	if (shape)
+		next_ptr = timing_body(shape, dependent, n, next_ptr);
+	add_endi(next_ptr);
+	return (timing_funct_t)mptr;
+}
+
+static int timing_cmp(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * time prog TIMING_SAMPLES times, samples come back sorted
+ */
+static void timing_sample(timing_funct_t prog, unsigned long *samples)
+{
+	unsigned long t0;
+	int k;
+
+	for (k = 0; k < TIMING_WARMUP; k++)
+		prog();
+	for (k = 0; k < TIMING_SAMPLES; k++) {
+		_mm_lfence();
+		t0 = __rdtsc();
+		_mm_lfence();
+		prog();
+		_mm_lfence();
+		samples[k] = __rdtsc() - t0;
+	}
+	qsort(samples, TIMING_SAMPLES, sizeof(*samples), timing_cmp);
+}
+
+/*
+ * cycles per instruction at percentile pct of the sorted samples, less the overhead
+ */
+static double timing_pct(const unsigned long *samples, int pct, unsigned long overhead)
+{
+	unsigned long s = samples[(TIMING_SAMPLES - 1) * pct / 100];
+
+	return s > overhead ? (double)(s - overhead) / TIMING_UNROLL : 0.0;
+}
+
+/*
+ * Function: timing_run
+ *
+ * Description: time every shape and write the table
+ *
+ * Returns: 0, or 1 if the CSV could not be written
+ */
+int timing_run(const char *path)
+{
+	static const int pcts[3] = { 50, 90, 99 };
+	gen_insn_t shapes[COV_NUM_TYPES * 8];
+	unsigned long *samples, overhead;
+	FILE *csv = fopen(path, "w");
+	cpu_set_t cpu;
+	int nshapes, s, dep, p, len;
+
+	if (!csv) {
+		perror(path);
+		return 1;
+	}
+	samples = malloc(TIMING_SAMPLES * sizeof(*samples));
+	if (!samples) {
+		fprintf(stderr, "Timing: no memory for %d samples\n", TIMING_SAMPLES);
+		fclose(csv);
+		return 1;
+	}
+	fprintf(csv, "shape,size,lock,bytes,lat_p50,lat_p90,lat_p99,tput_p50,tput_p90,tput_p99\n");
+
+	mptr_threads[0] = (tptrs)mptr;
+	mdptr_threads[0] = (tptrs)mdptr;
+
+	// stay on one CPU, like a worker (no log file needed here)
+	CPU_ZERO(&cpu);
+	CPU_SET(worker_cpu(0), &cpu);
+	sched_setaffinity(0, sizeof(cpu), &cpu);
+
+	// header, register seeding and trailer of an empty body
+	timing_sample(timing_build(NULL, 0, 0), samples);
+	overhead = samples[TIMING_SAMPLES / 2];
+	printf("Timing: %d instances per body, %d samples, overhead %lu cycles\n", TIMING_UNROLL, TIMING_SAMPLES, overhead);
+	printf("%-12s %4s %4s %5s   %8s %8s %8s   %8s %8s %8s\n", "shape", "size", "lock", "bytes",
+	       "lat p50", "p90", "p99", "tput p50", "p90", "p99");
+
+	nshapes = timing_shapes(shapes);
+	for (s = 0; s < nshapes; s++) {
+		const gen_insn_t *in = &shapes[s];
+		double c[2][3];
+
+		len = (int)(timing_body(in, 0, 1, mptr) - mptr);
+		for (dep = 1; dep >= 0; dep--) {
+			timing_sample(timing_build(in, dep, TIMING_UNROLL), samples);
+			for (p = 0; p < 3; p++)
+				c[!dep][p] = timing_pct(samples, pcts[p], overhead);
 		}
-        
-        instructions_built++;
-        LOG_AND_PRINT("Instruction %d complete, next_ptr: 0x%lx\n", instructions_built, (long)next_ptr);
-    }
+		fprintf(csv, "%s,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n", cov_type_names[in->type], in->size, in->lock, len,
+			c[0][0], c[0][1], c[0][2], c[1][0], c[1][1], c[1][2]);
+		printf("%-12s %4d %4s %5d   %8.2f %8.2f %8.2f   %8.2f %8.2f %8.2f\n", cov_type_names[in->type], in->size,
+		       in->lock ? "lock" : "", len, c[0][0], c[0][1], c[0][2], c[1][0], c[1][1], c[1][2]);
+	}
+	fclose(csv);
+	free(samples);
+	printf("Timing table (%d shapes) in %s\n", nshapes, path);
+	return 0;
+}
 
-	LOG_AND_PRINT("next ptr is now 0x%lx\n", (long) next_ptr);
+//
+// sampled log
+//
+// With -g the per instruction detail of a program (LOG_DETAIL) is formatted into the
+// worker's ring instead of the log.  When the program has run, log_ring_end writes
+// the ring out if the program faulted or its seed is sampled, otherwise drops it.
+// The ring keeps the last LOG_RING_BYTES of a program, a longer one loses its head.
+// Sampling hashes the seed, so the same seeds are logged in every run.
+//
 
-    next_ptr = add_endi(next_ptr);
-    LOG_AND_PRINT("Generated %d total instructions\n", instructions_built);
-    return instructions_built;
+/*
+ * append one line of detail to the ring of thread_id
+ */
+void log_ring_printf(int thread_id, const char *format, ...)
+{
+	log_ring_t *r = &log_rings[thread_id];
+	unsigned long at, first;
+	char line[512];
+	va_list ap;
+	int n;
+
+	if (!r->buf && !(r->buf = malloc(LOG_RING_BYTES)))
+		return;
+	va_start(ap, format);
+	n = vsnprintf(line, sizeof(line), format, ap);
+	va_end(ap);
+	if (n >= (int)sizeof(line))
+		n = sizeof(line) - 1;
+
+	at = r->head & (LOG_RING_BYTES - 1);
+	first = LOG_RING_BYTES - at < (unsigned long)n ? LOG_RING_BYTES - at : (unsigned long)n;
+	memcpy(r->buf + at, line, first);
+	memcpy(r->buf, line + first, n - first);
+	r->head += n;
+}
+
+/*
+ * write bytes [from, to) of the ring to stderr and the logfile
+ */
+static void log_ring_write(log_ring_t *r, unsigned long from, unsigned long to, FILE *logfile)
+{
+	while (from < to) {
+		unsigned long at = from & (LOG_RING_BYTES - 1);
+		unsigned long n = LOG_RING_BYTES - at < to - from ? LOG_RING_BYTES - at : to - from;
+
+		fwrite(r->buf + at, 1, n, stderr);
+		if (logfile)
+			fwrite(r->buf + at, 1, n, logfile);
+		from += n;
+	}
+	fflush(stderr);
+	if (logfile)
+		fflush(logfile);
+}
+
+/*
+ * Function: log_ring_end
+ *
+ * Description: end of a program, log its detail if it failed or key (its seed)
+ *              is one of the 1 in every sampled, and empty the ring
+ *
+ * Returns: 1 if the detail was logged
+ */
+int log_ring_end(int thread_id, FILE *logfile, int failed, unsigned key)
+{
+	log_ring_t *r = &log_rings[thread_id];
+	unsigned long from = 0, to = r->head;
+	int sampled = r->every > 0 && (key * 2654435761U) % r->every == 0;
+
+	r->head = 0;
+	if (r->every == LOG_ALL || !to || !(failed || sampled))
+		return 0;
 
-}
\ No newline at end of file
+	if (to > LOG_RING_BYTES) {
+		// the head of the program is gone, start at the first whole line
+		from = to - LOG_RING_BYTES;
+		while (from < to && r->buf[from++ & (LOG_RING_BYTES - 1)] != '\n')
+			;
+		LOG_AND_PRINT("log ring: first %lu bytes of detail dropped\n", from);
+	}
+	LOG_AND_PRINT("log ring: detail of a %s program follows\n", failed ? "failing" : "sampled");
+	log_ring_write(r, from, to, logfile);
+	return 1;
+}
@@ -0,0 +1,60 @@
+//
+// fault guard for executing generated code, see include/fault_guard.h
+//
+#include <signal.h>
+#include <setjmp.h>
+#include <string.h>
+#include <sys/wait.h>
+#include "fault_guard.h"
+
+static __thread sigjmp_buf guard_env;
+static __thread volatile sig_atomic_t guard_active;
+
+static void guard_handler(int sig)
+{
+	if (!guard_active) {
+		// not ours, let the fault take its default action when it repeats
+		signal(sig, SIG_DFL);
+		return;
+	}
+	guard_active = 0;
+	siglongjmp(guard_env, sig);
+}
+
+void guard_install(void)
+{
+	static const int sigs[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE };
+	struct sigaction sa;
+	unsigned k;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = guard_handler;
+	sigemptyset(&sa.sa_mask);
+	for (k = 0; k < sizeof(sigs) / sizeof(sigs[0]); k++)
+		sigaction(sigs[k], &sa, NULL);
+}
+
+int guard_call(int (*fn)(), void *arg, int *sig)
+{
+	int rc;
+
+	// the signal mask is saved too, the handler runs with its signal blocked
+	if ((*sig = sigsetjmp(guard_env, 1)) != 0)
+		return -1;
+
+	guard_active = 1;
+	rc = fn(arg);
+	guard_active = 0;
+	return rc;
+}
+
+void guard_kill(int pid)
+{
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+int guard_exited(int pid)
+{
+	return waitpid(pid, NULL, WNOHANG) == pid;
+}
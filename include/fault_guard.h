@@ -0,0 +1,29 @@
+/*
+ * Description:
+ *
+ * Run generated code so that a fault ends the run instead of the worker
+ *
+ * SIGSEGV, SIGBUS, SIGILL and SIGFPE raised inside guard_call() jump back to it
+ * with sigsetjmp/siglongjmp.  The jump buffer is per thread, so this works for
+ * forked and pthread workers alike.  Faults outside guard_call() keep their
+ * default action.  Lives in its own translation unit because <signal.h> brings
+ * the ucontext REG_* names that clash with ia32_encode.h, which is also why the
+ * watchdog's process helpers are here.
+ */
+
+#ifndef FAULT_GUARD_H
+#define FAULT_GUARD_H
+
+// install the handlers, once per process before the workers start
+void guard_install(void);
+
+// call fn(arg), returns its result, or -1 with *sig set if a signal ended it (*sig = 0 otherwise)
+int guard_call(int (*fn)(), void *arg, int *sig);
+
+// SIGKILL a worker process and reap it
+void guard_kill(int pid);
+
+// 1 if the worker process has exited (and is reaped now), 0 if it still runs
+int guard_exited(int pid);
+
+#endif /* FAULT_GUARD_H */
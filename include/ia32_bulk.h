@@ -0,0 +1,221 @@
+/*
+ * Description:
+ *
+ * Bulk encoders for homogeneous runs of [base+disp] instructions
+ *
+ * Fill-style tests emit thousands of instructions of one shape (same opcode,
+ * size and base register) that only differ in the register operand and the
+ * displacement.  The bulk_* routines take arrays of those two fields and
+ * encode the whole run in one call, producing the same bytes as calling the
+ * matching tmpl_* (and build_*) routine once per element.
+ *
+ * For a run the base register is fixed, so the complete prefix/opcode/ModR/M
+ * image for each of the 16 possible register operands is computed once up
+ * front.  The AVX2 kernel then handles four instructions per iteration:
+ * gathers the per-register images, derives MOD and displacement width from
+ * the displacements with vector compares, ORs MOD into the ModR/M byte with
+ * a variable shift and prefix-sums the lengths.  The variable length results
+ * are packed with back to back overlapping unaligned stores, each one laid
+ * over the unused tail of the previous instruction.
+ *
+ * The AVX2 path is picked at run time, older parts use the scalar loop.
+ */
+
+#ifndef IA32_BULK_H
+#define IA32_BULK_H
+
+#include <immintrin.h>
+#include "ia32_template.h"
+
+// per-register image of one run shape with MOD=00
+typedef struct {
+    long long word[16];         // template with REX and ModR/M register bits patched in
+    long long mod_shift[16];    // bit position of the MOD field inside word
+    int len[16];                // bytes before the displacement
+} ia32_bulk_shape_t;
+
+/*
+ * Function: bulk_shape
+ *
+ * Description: precompute the per-register images for a run
+ *
+ * Inputs:
+ *
+ *  const ia32_tmpl_t *tab       :  template row for the size (without, with REX)
+ *  int   byte_form              :  1 if SPL/BPL/SIL/DIL operands need a bare REX
+ *  int   mem_base_reg           :  base register shared by the whole run
+ *  ia32_bulk_shape_t *shape     :  filled in
+ */
+static inline void bulk_shape(const ia32_tmpl_t tab[2], int byte_form, int mem_base_reg, ia32_bulk_shape_t *shape)
+{
+    int r;
+
+    for (r = 0; r < 16; r++) {
+        unsigned rex = (TMPL_EXT(r) ? REX_R : 0) | (TMPL_EXT(mem_base_reg) ? REX_B : 0);
+        int need = rex || (byte_form && (TMPL_HI8(r) | TMPL_HI8(mem_base_reg)));
+        const ia32_tmpl_t *t = &tab[need];
+
+        shape->word[r] = t->bytes
+                       | ((unsigned long)rex << t->rex_shift)
+                       | ((unsigned long)(((r & REG_MASK) << REG_SHIFT) | (mem_base_reg & RM_MASK)) << t->modrm_shift);
+        shape->mod_shift[r] = t->modrm_shift + MODRM_SHIFT;
+        shape->len[r] = t->len;
+    }
+}
+
+/*
+ * Function: bulk_run_scalar
+ *
+ * Description: one instruction per iteration, same stores as tmpl_emit
+ */
+static inline volatile char *bulk_run_scalar(const ia32_bulk_shape_t *shape, const unsigned char *regs,
+                                             const int *displacements, int n, unsigned char *lens,
+                                             volatile char *tgt_addr)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        int r = regs[i] & 0xF;
+        int mod = tmpl_disp_mod(displacements[i]);
+
+        *(volatile unsigned long *)tgt_addr = shape->word[r] | ((unsigned long)mod << shape->mod_shift[r]);
+        tgt_addr += shape->len[r];
+        *(volatile int *)tgt_addr = displacements[i];
+        tgt_addr += tmpl_disp_bytes[mod];
+        if (lens)
+            lens[i] = shape->len[r] + tmpl_disp_bytes[mod];
+    }
+    return tgt_addr;
+}
+
+/*
+ * Function: bulk_run_avx2
+ *
+ * Description: four instructions per iteration, remainder through bulk_run_scalar
+ */
+__attribute__((target("avx2")))
+static volatile char *bulk_run_avx2(const ia32_bulk_shape_t *shape, const unsigned char *regs,
+                                    const int *displacements, int n, unsigned char *lens,
+                                    volatile char *tgt_addr)
+{
+    const __m128i reg_mask = _mm_set1_epi32(0xF);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i d8_hi = _mm_set1_epi32(127);
+    const __m128i d8_lo = _mm_set1_epi32(-128);
+    long long words[4];
+    int off[4], dlen[4], ilen[4];
+    int i, k;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128i r = _mm_and_si128(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(*(const int *)&regs[i])), reg_mask);
+        __m128i d = _mm_loadu_si128((const __m128i *)&displacements[i]);
+
+        // MOD: 1 if disp != 0, 2 if it does not fit in 8 bits (masks are -1/0)
+        __m128i nz = _mm_xor_si128(_mm_cmpeq_epi32(d, zero), _mm_set1_epi32(-1));
+        __m128i big = _mm_or_si128(_mm_cmpgt_epi32(d, d8_hi), _mm_cmpgt_epi32(d8_lo, d));
+        __m128i mod = _mm_sub_epi32(zero, _mm_add_epi32(nz, big));
+        // displacement bytes 0/1/4
+        __m128i db = _mm_sub_epi32(mod, _mm_add_epi32(big, big));
+
+        __m256i w = _mm256_i32gather_epi64(shape->word, r, 8);
+        __m256i sh = _mm256_i32gather_epi64(shape->mod_shift, r, 8);
+        w = _mm256_or_si256(w, _mm256_sllv_epi64(_mm256_cvtepi32_epi64(mod), sh));
+
+        // instruction lengths and their exclusive prefix sum
+        __m128i len = _mm_i32gather_epi32(shape->len, r, 4);
+        __m128i tot = _mm_add_epi32(len, db);
+        __m128i pre = _mm_add_epi32(tot, _mm_slli_si128(tot, 4));
+        pre = _mm_add_epi32(pre, _mm_slli_si128(pre, 8));
+        pre = _mm_sub_epi32(pre, tot);
+
+        _mm256_storeu_si256((__m256i *)words, w);
+        _mm_storeu_si128((__m128i *)off, pre);
+        _mm_storeu_si128((__m128i *)dlen, _mm_add_epi32(pre, len));
+        _mm_storeu_si128((__m128i *)ilen, tot);
+
+        // in order, so every store overwrites the spill of the one before
+        for (k = 0; k < 4; k++) {
+            *(volatile long long *)(tgt_addr + off[k]) = words[k];
+            *(volatile int *)(tgt_addr + dlen[k]) = displacements[i + k];
+            if (lens)
+                lens[i + k] = ilen[k];
+        }
+        tgt_addr += off[3] + ilen[3];
+    }
+    return bulk_run_scalar(shape, regs + i, displacements + i, n - i, lens ? lens + i : NULL, tgt_addr);
+}
+
+/*
+ * Function: bulk_run
+ *
+ * Description: dispatch a run to the AVX2 or scalar kernel
+ */
+static inline volatile char *bulk_run(const ia32_tmpl_t tab[2], int byte_form, int mem_base_reg,
+                                      const unsigned char *regs, const int *displacements, int n,
+                                      unsigned char *lens, volatile char *tgt_addr)
+{
+    ia32_bulk_shape_t shape;
+
+    bulk_shape(tab, byte_form, mem_base_reg, &shape);
+
+    if (__builtin_cpu_supports("avx2"))
+        return bulk_run_avx2(&shape, regs, displacements, n, lens, tgt_addr);
+    return bulk_run_scalar(&shape, regs, displacements, n, lens, tgt_addr);
+}
+
+/*
+ * Function: bulk_reg_to_memory
+ *
+ * Description: n x MOV [base+displacements[i]], src_regs[i]  (see build_reg_to_memory)
+ *
+ * Inputs:
+ *
+ *  short mov_size               :  size of every move in the run (1, 2, 4 or 8 bytes)
+ *  const unsigned char *src_regs:  source register of each move
+ *  int   mem_base_reg           :  base register encoding
+ *  const int *displacements     :  displacement of each move
+ *  int   n                      :  number of instructions
+ *  unsigned char *lens          :  if not NULL, receives the encoded length of each instruction
+ *  volatile char *tgt_addr      :  starting memory address of where to store instructions
+ *
+ * Output:
+ *
+ *  returns adjusted address after encoding the run
+ */
+static inline volatile char *bulk_reg_to_memory(short mov_size, const unsigned char *src_regs, int mem_base_reg,
+                                                const int *displacements, int n, unsigned char *lens,
+                                                volatile char *tgt_addr)
+{
+    return bulk_run(tmpl_mov_st_tab[TMPL_SZI(mov_size)], mov_size == ISZ_1, mem_base_reg,
+                    src_regs, displacements, n, lens, tgt_addr);
+}
+
+/*
+ * Function: bulk_xadd_memory
+ *
+ * Description: n x [LOCK] XADD [base+displacements[i]], regs[i]  (see build_xadd, sizes 1, 2 and 4)
+ *
+ * Inputs:
+ *
+ *  short xadd_size              :  size of every XADD in the run
+ *  int   mem_base_reg           :  base register encoding
+ *  const unsigned char *regs    :  register operand of each XADD
+ *  const int *displacements     :  displacement of each XADD (never -1, memory forms only)
+ *  int   n                      :  number of instructions
+ *  int   use_lock               :  1 = LOCK prefix on every instruction
+ *  unsigned char *lens          :  if not NULL, receives the encoded length of each instruction
+ *  volatile char *tgt_addr      :  starting memory address of where to store instructions
+ *
+ * Output:
+ *
+ *  returns adjusted address after encoding the run
+ */
+static inline volatile char *bulk_xadd_memory(short xadd_size, int mem_base_reg, const unsigned char *regs,
+                                              const int *displacements, int n, int use_lock,
+                                              unsigned char *lens, volatile char *tgt_addr)
+{
+    return bulk_run(tmpl_xadd_tab[use_lock != 0][TMPL_SZI(xadd_size)], 0, mem_base_reg,
+                    regs, displacements, n, lens, tgt_addr);
+}
+
+#endif /* IA32_BULK_H */
@@ -17,6 +17,9 @@
  * --------------------
  */ 
 
+#ifndef IA32_ENCODE_H
+#define IA32_ENCODE_H
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
@@ -94,11 +97,12 @@
 
 // code generation defines
 
-#define MAX_THREADS     4
+#define MAX_THREADS     256
 #define MAX_DEF_INSTRS  10
 #define MAX_INSTR_BYTES (3*PAGESIZE)   // allocate 3  PAGES for instruction
 #define MAX_DATA_BYTES  (10*PAGESIZE)  // allocate 10 PAGES for data
 #define MAX_COMM_BYTES  (PAGESIZE)     // allocate 1  PAGE for communications
+#define MAX_ENC_SLOT    16             // worst case bytes per generated instruction, incl. template store spill
 
 // information sharing between tasks
 #define NUM_PTRS 3
@@ -827,6 +831,523 @@ static inline volatile char *build_lfence(volatile char *tgt_addr)
     return(tgt_addr);
 }
 
+/*
+ * Function: build_dec_reg
+ *
+ * Description: Build DEC r/m (FE /1 for bytes, FF /1 otherwise), register form
+ *
+ * Inputs: 
+ *
+ *  short dec_size               :  size of the operand (1, 2, 4 or 8 bytes)
+ *  int   reg                    :  register to decrement
+ *  volatile char *tgt_addr      :  starting memory address of where to store instruction
+ *
+ * Output: 
+ *
+ *  returns adjusted address after encoding instruction
+ *
+ */
+static inline volatile char *build_dec_reg(short dec_size, int reg, volatile char *tgt_addr)
+{
+    unsigned char rex_prefix = 0;
+
+    // for 16 bit mode we need the operand size prefix, ahead of REX
+    if (dec_size == 2) {
+        (*tgt_addr++) = PREFIX_16BIT;
+    }
+
+    if (dec_size == 8) {
+        rex_prefix |= REX_W;
+    }
+    if (reg >= 8) {
+        rex_prefix |= REX_B;
+    }
+    if (rex_prefix || (dec_size == 1 && reg >= REG_RSP && reg <= REG_RDI)) {
+        (*tgt_addr++) = REX_BASE | rex_prefix;
+    }
+
+    (*tgt_addr++) = (dec_size == 1) ? 0xFE : 0xFF;
+    (*tgt_addr++) = BASE_MODRM | (1 << REG_SHIFT) | (reg & RM_MASK);
+
+    return(tgt_addr);
+}
+
+/*
+ * Function: build_jnz
+ *
+ * Description: Build JNZ rel32 (0F 85 cd) to an absolute target
+ *
+ * Inputs: 
+ *
+ *  volatile char *target        :  branch target
+ *  volatile char *tgt_addr      :  starting memory address of where to store instruction
+ *
+ * Output: 
+ *
+ *  returns adjusted address after encoding instruction
+ *
+ */
+static inline volatile char *build_jnz(volatile char *target, volatile char *tgt_addr)
+{
+    (*tgt_addr++) = 0x0F;
+    (*tgt_addr++) = 0x85;
+    // rel32 is relative to the end of the instruction
+    *(volatile int *)tgt_addr = (int)(target - (tgt_addr + BYTE4_OFF));
+    tgt_addr += BYTE4_OFF;
+
+    return(tgt_addr);
+}
+
+/*
+ * Function: build_nop
+ *
+ * Description: Build nop_len bytes of padding out of the recommended multi-byte
+ *              NOP forms (0F 1F /0 with 0x66 prefix, see SDM NOP instruction).
+ *              Padding longer than 9 bytes is made of several NOPs.
+ *
+ * Inputs: 
+ *
+ *  int nop_len                  :  number of padding bytes (may be 0)
+ *  volatile char *tgt_addr      :  starting memory address of where to store instruction
+ *
+ * Output: 
+ *
+ *  returns adjusted address after encoding instruction(s)
+ *
+ */
+static inline volatile char *build_nop(int nop_len, volatile char *tgt_addr)
+{
+    static const unsigned char nops[9][9] = {
+        { 0x90 },
+        { 0x66, 0x90 },
+        { 0x0F, 0x1F, 0x00 },
+        { 0x0F, 0x1F, 0x40, 0x00 },
+        { 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+        { 0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00 },
+        { 0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00 },
+        { 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+        { 0x66, 0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    };
+    int n, k;
+
+    while (nop_len > 0) {
+        n = (nop_len > 9) ? 9 : nop_len;
+        for (k = 0; k < n; k++)
+            (*tgt_addr++) = nops[n - 1][k];
+        nop_len -= n;
+    }
+
+    return(tgt_addr);
+}
+
+/*
+ * Function: build_modrm_mem
+ *
+ * Description: Build the ModR/M byte (plus SIB and displacement) of a [base+disp]
+ *              operand.  Bases RSP/R12 need a SIB byte, RBP/R13 always carry a
+ *              displacement (MOD=00 with R/M=101 is RIP-relative).  Prefixes and
+ *              opcode are emitted by the caller.
+ *
+ * Inputs: 
+ *
+ *  int   reg                    :  ModR/M reg field (register operand or opcode extension)
+ *  int   mem_base_reg           :  base register encoding
+ *  long  displacement           :  displacement value to add to base register
+ *  volatile char *tgt_addr      :  where the ModR/M byte goes
+ *
+ * Output: 
+ *
+ *  returns adjusted address after the operand bytes
+ *
+ */
+static inline volatile char *build_modrm_mem(int reg, int mem_base_reg, long displacement, volatile char *tgt_addr)
+{
+    int mod_value;
+
+    if (displacement == 0 && (mem_base_reg & RM_MASK) != REG_RBP) {
+        mod_value = 0x00;  // MOD=00, no displacement
+    } else if (displacement >= -128 && displacement <= 127) {
+        mod_value = 0x40;  // MOD=01, 8-bit displacement
+    } else {
+        mod_value = 0x80;  // MOD=10, 32-bit displacement
+    }
+
+    (*tgt_addr++) = mod_value | ((reg & REG_MASK) << REG_SHIFT) | (mem_base_reg & RM_MASK);
+    if ((mem_base_reg & RM_MASK) == REG_RSP) {
+        (*tgt_addr++) = 0x24;  // SIB: no index, base=RSP/R12
+    }
+
+    if (mod_value == 0x40) {
+        (*tgt_addr++) = (char)displacement;
+    } else if (mod_value == 0x80) {
+        *(volatile int *)tgt_addr = (int)displacement;
+        tgt_addr += BYTE4_OFF;
+    }
+
+    return(tgt_addr);
+}
+
+/*
+ * Function: build_lea
+ *
+ * Description: Build LEA dest_reg, [mem_base_reg+displacement] (64 bit, REX.W 8D /r)
+ *
+ * Inputs: 
+ *
+ *  int   dest_reg               :  destination register encoding
+ *  int   mem_base_reg           :  base register encoding
+ *  long  displacement           :  displacement value to add to base register
+ *  volatile char *tgt_addr      :  starting memory address of where to store instruction
+ *
+ * Output: 
+ *
+ *  returns adjusted address after encoding instruction
+ *
+ */
+static inline volatile char *build_lea(int dest_reg, int mem_base_reg, long displacement, volatile char *tgt_addr)
+{
+    (*tgt_addr++) = REX_BASE | REX_W | (dest_reg >= 8 ? REX_R : 0) | (mem_base_reg >= 8 ? REX_B : 0);
+    (*tgt_addr++) = 0x8D;
+
+    return(build_modrm_mem(dest_reg, mem_base_reg, displacement, tgt_addr));
+}
+
+/*
+ * Function: build_add_imm
+ *
+ * Description: Build ADD reg, imm (83 /0 ib for imm8, 81 /0 id otherwise)
+ *
+ * Inputs: 
+ *
+ *  short add_size               :  size of the operand (4 or 8 bytes)
+ *  int   reg                    :  destination register encoding
+ *  int   immediate_val          :  value to add (sign extended to 64 bits for size 8)
+ *  volatile char *tgt_addr      :  starting memory address of where to store instruction
+ *
+ * Output: 
+ *
+ *  returns adjusted address after encoding instruction
+ *
+ */
+static inline volatile char *build_add_imm(short add_size, int reg, int immediate_val, volatile char *tgt_addr)
+{
+    unsigned char rex_prefix = (add_size == ISZ_8 ? REX_W : 0) | (reg >= 8 ? REX_B : 0);
+
+    if (rex_prefix) {
+        (*tgt_addr++) = REX_BASE | rex_prefix;
+    }
+
+    if (immediate_val >= -128 && immediate_val <= 127) {
+        (*tgt_addr++) = 0x83;
+        (*tgt_addr++) = BASE_MODRM | (reg & RM_MASK);
+        (*tgt_addr++) = (char)immediate_val;
+    } else {
+        (*tgt_addr++) = 0x81;
+        (*tgt_addr++) = BASE_MODRM | (reg & RM_MASK);
+        *(volatile int *)tgt_addr = immediate_val;
+        tgt_addr += BYTE4_OFF;
+    }
+
+    return(tgt_addr);
+}
+
+/*
+ * Function: build_cache_line_op
+ *
+ * Description: Build one of the cache line maintenance / prefetch instructions
+ *              on [mem_base_reg+displacement]:
+ *
+ *   CACHE_CLFLUSH     0F AE /7     flush and invalidate, ordered with stores
+ *   CACHE_CLFLUSHOPT  66 0F AE /7  flush and invalidate, weakly ordered (SFENCE)
+ *   CACHE_CLWB        66 0F AE /6  write back, the line may stay cached
+ *   CACHE_PREFETCHT0  0F 18 /1     prefetch into all cache levels
+ *   CACHE_PREFETCHNTA 0F 18 /0     prefetch close to the core, minimal pollution
+ *
+ *              CLFLUSHOPT and CLWB need CPUID.(EAX=7,ECX=0):EBX bits 23 and 24,
+ *              the caller checks for them.
+ *
+ * Inputs: 
+ *
+ *  int   op                     :  CACHE_*
+ *  int   mem_base_reg           :  base register encoding
+ *  long  displacement           :  displacement value to add to base register
+ *  volatile char *tgt_addr      :  starting memory address of where to store instruction
+ *
+ * Output: 
+ *
+ *  returns adjusted address after encoding instruction
+ *
+ */
+#define CACHE_CLFLUSH      0
+#define CACHE_CLFLUSHOPT   1
+#define CACHE_CLWB         2
+#define CACHE_PREFETCHT0   3
+#define CACHE_PREFETCHNTA  4
+
+static inline volatile char *build_cache_line_op(int op, int mem_base_reg, long displacement, volatile char *tgt_addr)
+{
+    // opcode extension in the ModR/M reg field
+    static const unsigned char ext[] = { 7, 7, 6, 1, 0 };
+
+    if (op == CACHE_CLFLUSHOPT || op == CACHE_CLWB) {
+        (*tgt_addr++) = PREFIX_16BIT;
+    }
+    if (mem_base_reg >= 8) {
+        (*tgt_addr++) = REX_BASE | REX_B;
+    }
+    (*tgt_addr++) = 0x0F;
+    (*tgt_addr++) = (op >= CACHE_PREFETCHT0) ? 0x18 : 0xAE;
+
+    return(build_modrm_mem(ext[op], mem_base_reg, displacement, tgt_addr));
+}
+
+/*
+ * Function: build_movnti
+ *
+ * Description: Build MOVNTI [mem_base_reg+displacement], src_reg (0F C3 /r), a
+ *              non-temporal store that bypasses the caches through the write
+ *              combining buffers
+ *
+ * Inputs: 
+ *
+ *  short mov_size               :  size of the store (4 or 8 bytes)
+ *  int   src_reg                :  register source encoding
+ *  int   mem_base_reg           :  base register encoding
+ *  long  displacement           :  displacement value to add to base register
+ *  volatile char *tgt_addr      :  starting memory address of where to store instruction
+ *
+ * Output: 
+ *
+ *  returns adjusted address after encoding instruction, NULL for a bad size
+ *
+ */
+static inline volatile char *build_movnti(short mov_size, int src_reg, int mem_base_reg, long displacement, volatile char *tgt_addr)
+{
+    unsigned char rex_prefix = 0;
+
+    if (mov_size != ISZ_4 && mov_size != ISZ_8) {
+        fprintf(stderr,"ERROR: Incorrect size (%d) passed to MOVNTI\n", mov_size);
+        return (NULL);
+    }
+
+    if (mov_size == ISZ_8) {
+        rex_prefix |= REX_W;
+    }
+    if (src_reg >= 8) {
+        rex_prefix |= REX_R;
+    }
+    if (mem_base_reg >= 8) {
+        rex_prefix |= REX_B;
+    }
+    if (rex_prefix) {
+        (*tgt_addr++) = REX_BASE | rex_prefix;
+    }
+
+    (*tgt_addr++) = 0x0F;
+    (*tgt_addr++) = 0xC3;
+
+    return(build_modrm_mem(src_reg, mem_base_reg, displacement, tgt_addr));
+}
+
+/*
+ * Function: build_rep_movsb / build_rep_stosb
+ *
+ * Description: Build REP MOVSB (F3 A4, copy RCX bytes from [RSI] to [RDI]) and
+ *              REP STOSB (F3 AA, store AL to RCX bytes at [RDI]).  RSI, RDI and
+ *              RCX are advanced/consumed by the instruction.
+ *
+ * Inputs: 
+ *
+ *  volatile char *tgt_addr      :  starting memory address of where to store instruction
+ *
+ * Output: 
+ *
+ *  returns adjusted address after encoding instruction
+ *
+ */
+static inline volatile char *build_rep_movsb(volatile char *tgt_addr)
+{
+    (*tgt_addr++) = 0xF3;  // REP
+    (*tgt_addr++) = 0xA4;  // MOVSB
+
+    return(tgt_addr);
+}
+
+static inline volatile char *build_rep_stosb(volatile char *tgt_addr)
+{
+    (*tgt_addr++) = 0xF3;  // REP
+    (*tgt_addr++) = 0xAA;  // STOSB
+
+    return(tgt_addr);
+}
+
+/*
+ * Function: build_movdqa
+ *
+ * Description: Build the SSE2 aligned 128 bit move MOVDQA xmm, [mem] (66 0F 6F /r)
+ *              or MOVDQA [mem], xmm (66 0F 7F /r).  The address must be 16 byte
+ *              aligned.
+ *
+ * Inputs: 
+ *
+ *  int   is_store               :  1 = store xmm to memory, 0 = load
+ *  int   xmm_reg                :  XMM register number (0-15)
+ *  int   mem_base_reg           :  base register encoding
+ *  long  displacement           :  displacement value to add to base register
+ *  volatile char *tgt_addr      :  starting memory address of where to store instruction
+ *
+ * Output: 
+ *
+ *  returns adjusted address after encoding instruction
+ *
+ */
+static inline volatile char *build_movdqa(int is_store, int xmm_reg, int mem_base_reg, long displacement, volatile char *tgt_addr)
+{
+    unsigned char rex_prefix = (xmm_reg >= 8 ? REX_R : 0) | (mem_base_reg >= 8 ? REX_B : 0);
+
+    // the mandatory 66 prefix goes ahead of REX
+    (*tgt_addr++) = PREFIX_16BIT;
+    if (rex_prefix) {
+        (*tgt_addr++) = REX_BASE | rex_prefix;
+    }
+    (*tgt_addr++) = 0x0F;
+    (*tgt_addr++) = is_store ? 0x7F : 0x6F;
+
+    return(build_modrm_mem(xmm_reg, mem_base_reg, displacement, tgt_addr));
+}
+
+// VEX fields, see SDM 2.3 (VEX prefix encoding)
+#define VEX_PP_NONE    0x0     // implied mandatory prefix
+#define VEX_PP_66      0x1
+#define VEX_PP_F3      0x2
+#define VEX_PP_F2      0x3
+#define VEX_MAP_0F     0x1     // implied opcode escape
+#define VEX_MAP_0F38   0x2
+#define VEX_MAP_0F3A   0x3
+#define VEX_L128       0
+#define VEX_L256       1
+
+/*
+ * Function: build_vex
+ *
+ * Description: Build a VEX prefix.  The 2 byte form (C5) is used when it can
+ *              express the fields (no REX.X/B, W0, 0F map), otherwise the 3 byte
+ *              form (C4).  R, X, B and vvvv are stored inverted as the SDM requires.
+ *
+ * Inputs: 
+ *
+ *  int   reg                    :  ModR/M reg operand (bit 3 becomes VEX.R)
+ *  int   index_reg              :  SIB index (bit 3 becomes VEX.X), 0 if none
+ *  int   rm_reg                 :  ModR/M r/m or base (bit 3 becomes VEX.B)
+ *  int   map                    :  VEX_MAP_*
+ *  int   w                      :  VEX.W
+ *  int   vvvv                   :  extra source register, 0 if unused
+ *  int   l                      :  VEX_L128 / VEX_L256
+ *  int   pp                     :  VEX_PP_*
+ *  volatile char *tgt_addr      :  starting memory address of where to store the prefix
+ *
+ * Output: 
+ *
+ *  returns adjusted address after the prefix, the opcode follows
+ *
+ */
+static inline volatile char *build_vex(int reg, int index_reg, int rm_reg, int map, int w, int vvvv, int l, int pp, volatile char *tgt_addr)
+{
+    unsigned char r = (reg & 8) ? 0 : 0x80;
+    unsigned char x = (index_reg & 8) ? 0 : 0x40;
+    unsigned char b = (rm_reg & 8) ? 0 : 0x20;
+    unsigned char tail = ((~vvvv & 0xF) << 3) | ((l & 1) << 2) | (pp & 3);
+
+    if (x && b && !w && map == VEX_MAP_0F) {
+        (*tgt_addr++) = 0xC5;
+        (*tgt_addr++) = r | tail;
+    } else {
+        (*tgt_addr++) = 0xC4;
+        (*tgt_addr++) = r | x | b | (map & 0x1F);
+        (*tgt_addr++) = (w ? 0x80 : 0) | tail;
+    }
+
+    return(tgt_addr);
+}
+
+/*
+ * Function: build_vmovdqu
+ *
+ * Description: Build the unaligned AVX move VMOVDQU xmm/ymm, [mem] (VEX.F3.0F 6F /r)
+ *              or VMOVDQU [mem], xmm/ymm (VEX.F3.0F 7F /r)
+ *
+ * Inputs: 
+ *
+ *  int   is_store               :  1 = store the vector register to memory, 0 = load
+ *  int   l                      :  VEX_L128 (xmm) or VEX_L256 (ymm)
+ *  int   vec_reg                :  vector register number (0-15)
+ *  int   mem_base_reg           :  base register encoding
+ *  long  displacement           :  displacement value to add to base register
+ *  volatile char *tgt_addr      :  starting memory address of where to store instruction
+ *
+ * Output: 
+ *
+ *  returns adjusted address after encoding instruction
+ *
+ */
+static inline volatile char *build_vmovdqu(int is_store, int l, int vec_reg, int mem_base_reg, long displacement, volatile char *tgt_addr)
+{
+    tgt_addr = build_vex(vec_reg, 0, mem_base_reg, VEX_MAP_0F, 0, 0, l, VEX_PP_F3, tgt_addr);
+    (*tgt_addr++) = is_store ? 0x7F : 0x6F;
+
+    return(build_modrm_mem(vec_reg, mem_base_reg, displacement, tgt_addr));
+}
+
+/*
+ * Function: build_vmovntdq
+ *
+ * Description: Build the non-temporal AVX store VMOVNTDQ [mem], xmm/ymm
+ *              (VEX.66.0F E7 /r).  The address must be aligned to the vector size.
+ *
+ * Inputs: 
+ *
+ *  int   l                      :  VEX_L128 (xmm) or VEX_L256 (ymm)
+ *  int   vec_reg                :  vector register number (0-15)
+ *  int   mem_base_reg           :  base register encoding
+ *  long  displacement           :  displacement value to add to base register
+ *  volatile char *tgt_addr      :  starting memory address of where to store instruction
+ *
+ * Output: 
+ *
+ *  returns adjusted address after encoding instruction
+ *
+ */
+static inline volatile char *build_vmovntdq(int l, int vec_reg, int mem_base_reg, long displacement, volatile char *tgt_addr)
+{
+    tgt_addr = build_vex(vec_reg, 0, mem_base_reg, VEX_MAP_0F, 0, 0, l, VEX_PP_66, tgt_addr);
+    (*tgt_addr++) = 0xE7;
+
+    return(build_modrm_mem(vec_reg, mem_base_reg, displacement, tgt_addr));
+}
+
+/*
+ * Function: build_vzeroupper
+ *
+ * Description: Build VZEROUPPER (VEX.128.0F 77), clears the upper halves of the
+ *              ymm registers so later SSE code does not pay the transition penalty
+ *
+ * Inputs: 
+ *
+ *  volatile char *tgt_addr      :  starting memory address of where to store instruction
+ *
+ * Output: 
+ *
+ *  returns adjusted address after encoding instruction
+ *
+ */
+static inline volatile char *build_vzeroupper(volatile char *tgt_addr)
+{
+    tgt_addr = build_vex(0, 0, 0, VEX_MAP_0F, 0, 0, VEX_L128, VEX_PP_NONE, tgt_addr);
+    (*tgt_addr++) = 0x77;
+
+    return(tgt_addr);
+}
+
 /*
  * Function: build_push_reg
  *
@@ -926,4 +1447,6 @@ static inline volatile char *build_pusha(short pusha_size, volatile char *tgt_ad
     (*tgt_addr++) = 0x60;
     
     return tgt_addr;
-}
\ No newline at end of file
+}
+
+#endif /* IA32_ENCODE_H */
@@ -0,0 +1,234 @@
+/*
+ * Description:
+ *
+ * Pre-built instruction templates for the fixed-shape encoders in ia32_encode.h
+ *
+ * Every build_* routine re-derives the REX byte, the 0x66 prefix, the opcode
+ * and the MOD field from its size/register arguments on each call.  For the
+ * generator hot loop the prefix/opcode/ModR/M image of each (opcode, size)
+ * pair is instead laid out at compile time in a static table, so encoding an
+ * instruction is one 8 byte store of the template with the REX and ModR/M
+ * register bits OR'd in, plus one store for the displacement or immediate.
+ *
+ * The tmpl_* routines take the same arguments as their build_* counterparts
+ * and produce byte-identical output (including the REX-before-0x66 ordering
+ * of the originals).  They do no argument checking, so callers must only pass
+ * sizes the matching build_* routine accepts, and must leave at least 16 bytes
+ * of slack after tgt_addr (the stores are wider than the instruction).
+ *
+ *  template image (little-endian, unused bytes zero)
+ * -----------------------------------------------------------------
+ * | LOCK? | REX? | 0x66? | 0x0F? | Opcode | ModR/M |  0 ... 0    |
+ * -----------------------------------------------------------------
+ */
+
+#ifndef IA32_TEMPLATE_H
+#define IA32_TEMPLATE_H
+
+#include "ia32_encode.h"
+
+typedef struct {
+    unsigned long bytes;        // prefix/opcode/ModR/M image
+    unsigned char len;          // bytes up to and including ModR/M (or opcode)
+    unsigned char rex_shift;    // bit position of the REX byte inside bytes
+    unsigned char modrm_shift;  // bit position of the byte that takes the register bits
+} ia32_tmpl_t;
+
+/*
+ * IA32_TMPL(lock, rex, rex_w, prefix66, escape, opcode, modrm)
+ *
+ * builds one template at compile time, all arguments are 0/1 flags except
+ * opcode and the constant part of the ModR/M byte
+ */
+#define TMPL_OPC_POS(lk, rx, p66, esc)  ((lk) + (rx) + (p66) + (esc))
+
+#define IA32_TMPL(lk, rx, w, p66, esc, opc, modrm) {                                              \
+    ((unsigned long)((lk) ? 0xF0 : 0))                                                          \
+  | ((unsigned long)((rx) ? (REX_BASE | ((w) ? REX_W : 0)) : 0) << (8 * (lk)))                  \
+  | ((unsigned long)((p66) ? PREFIX_16BIT : 0) << (8 * ((lk) + (rx))))                          \
+  | ((unsigned long)((esc) ? 0x0F : 0) << (8 * ((lk) + (rx) + (p66))))                          \
+  | ((unsigned long)(opc) << (8 * TMPL_OPC_POS(lk, rx, p66, esc)))                              \
+  | ((unsigned long)(modrm) << (8 * (TMPL_OPC_POS(lk, rx, p66, esc) + 1))),                     \
+    TMPL_OPC_POS(lk, rx, p66, esc) + 2,                                                         \
+    8 * (lk),                                                                                   \
+    8 * (TMPL_OPC_POS(lk, rx, p66, esc) + 1) }
+
+// register encoded in the low bits of the opcode (B8+r), no ModR/M byte
+#define IA32_TMPL_OPREG(rx, w, opc) {                                                             \
+    ((unsigned long)((rx) ? (REX_BASE | ((w) ? REX_W : 0)) : 0))                                \
+  | ((unsigned long)(opc) << (8 * (rx))),                                                       \
+    (rx) + 1,                                                                                   \
+    0,                                                                                          \
+    8 * (rx) }
+
+/*
+ * one row per size (ISZ_1, ISZ_2, ISZ_4, ISZ_8), one column per REX need
+ * (without, with).  ISZ_8 always carries REX.W so both columns match.
+ */
+#define IA32_TMPL_SIZES(lk, esc, opc8, opc, modrm) {                                              \
+    { IA32_TMPL(lk, 0, 0, 0, esc, opc8, modrm), IA32_TMPL(lk, 1, 0, 0, esc, opc8, modrm) },     \
+    { IA32_TMPL(lk, 0, 0, 1, esc, opc, modrm),  IA32_TMPL(lk, 1, 0, 1, esc, opc, modrm) },      \
+    { IA32_TMPL(lk, 0, 0, 0, esc, opc, modrm),  IA32_TMPL(lk, 1, 0, 0, esc, opc, modrm) },      \
+    { IA32_TMPL(lk, 1, 1, 0, esc, opc, modrm),  IA32_TMPL(lk, 1, 1, 0, esc, opc, modrm) } }
+
+static const ia32_tmpl_t tmpl_mov_rr_tab[4][2]  = IA32_TMPL_SIZES(0, 0, 0x8A, 0x8B, BASE_MODRM);  // 8A/8B /r, MOD=11
+static const ia32_tmpl_t tmpl_mov_st_tab[4][2]  = IA32_TMPL_SIZES(0, 0, 0x88, 0x89, 0);           // 88/89 /r
+static const ia32_tmpl_t tmpl_mov_ld_tab[4][2]  = IA32_TMPL_SIZES(0, 0, 0x8A, 0x8B, 0);           // 8A/8B /r
+
+// XADD/XCHG, indexed [use_lock][size][rex].  ISZ_8 rows are never used (see build_xadd)
+static const ia32_tmpl_t tmpl_xadd_tab[2][4][2] = { IA32_TMPL_SIZES(0, 1, 0xC0, 0xC1, 0),           // 0F C0/C1 /r
+                                                    IA32_TMPL_SIZES(1, 1, 0xC0, 0xC1, 0) };
+static const ia32_tmpl_t tmpl_xchg_tab[2][4][2] = { IA32_TMPL_SIZES(0, 0, 0x86, 0x87, 0),           // 86/87 /r
+                                                    IA32_TMPL_SIZES(1, 0, 0x86, 0x87, 0) };
+
+static const ia32_tmpl_t tmpl_mov_imm_tab[4][2] = {
+    { IA32_TMPL(0, 0, 0, 0, 0, 0xC6, BASE_MODRM), IA32_TMPL(0, 1, 0, 0, 0, 0xC6, BASE_MODRM) },  // C6 /0 ib
+    { IA32_TMPL(0, 0, 0, 1, 0, 0xC7, BASE_MODRM), IA32_TMPL(0, 1, 0, 1, 0, 0xC7, BASE_MODRM) },  // C7 /0 iw
+    { IA32_TMPL(0, 0, 0, 0, 0, 0xC7, BASE_MODRM), IA32_TMPL(0, 1, 0, 0, 0, 0xC7, BASE_MODRM) },  // C7 /0 id
+    { IA32_TMPL_OPREG(1, 1, 0xB8),                IA32_TMPL_OPREG(1, 1, 0xB8) } };               // REX.W B8+r io
+
+// displacement bytes for MOD=00/01/10/11
+static const unsigned char tmpl_disp_bytes[4] = { 0, 1, 4, 0 };
+
+// size (1,2,4,8) to template row
+#define TMPL_SZI(sz)       (__builtin_ctz(sz))
+// register needs REX.R/REX.B
+#define TMPL_EXT(r)        (((r) >> 3) & 1)
+// SPL/BPL/SIL/DIL need a bare REX in the byte forms
+#define TMPL_HI8(r)        ((0xF0 >> ((r) & 0xF)) & 1)
+
+/*
+ * Function: tmpl_disp_mod
+ *
+ * Description: pick the MOD field for a [base+disp] operand, same rules as build_reg_to_memory
+ *
+ * Output: 0 (no disp), 1 (disp8) or 2 (disp32)
+ */
+static inline int tmpl_disp_mod(long displacement)
+{
+    return (displacement != 0) + (displacement < -128 || displacement > 127);
+}
+
+/*
+ * Function: tmpl_emit
+ *
+ * Description: store a template with the REX and ModR/M bits patched in, then the
+ *              trailing displacement/immediate.  tail is always stored as 8 bytes,
+ *              only tail_bytes of it are kept.
+ *
+ * Output: returns adjusted address after encoding instruction
+ */
+static inline volatile char *tmpl_emit(const ia32_tmpl_t *t, unsigned rex_bits, unsigned modrm_bits,
+                                       long tail, int tail_bytes, volatile char *tgt_addr)
+{
+    *(volatile unsigned long *)tgt_addr = t->bytes
+                                        | ((unsigned long)rex_bits << t->rex_shift)
+                                        | ((unsigned long)modrm_bits << t->modrm_shift);
+    tgt_addr += t->len;
+    *(volatile long *)tgt_addr = tail;
+    return tgt_addr + tail_bytes;
+}
+
+/*
+ * Function: tmpl_mov_register_to_register
+ *
+ * Description: template form of build_mov_register_to_register
+ */
+static inline volatile char *tmpl_mov_register_to_register(short mov_size, int src_reg, int dest_reg, volatile char *tgt_addr)
+{
+    int szi = TMPL_SZI(mov_size);
+    unsigned rex = (TMPL_EXT(dest_reg) ? REX_R : 0) | (TMPL_EXT(src_reg) ? REX_B : 0);
+    int need = rex || (szi == 0 && (TMPL_HI8(src_reg) | TMPL_HI8(dest_reg)));
+
+    return tmpl_emit(&tmpl_mov_rr_tab[szi][need], rex,
+                     ((dest_reg & REG_MASK) << REG_SHIFT) | (src_reg & RM_MASK), 0, 0, tgt_addr);
+}
+
+/*
+ * Function: tmpl_imm_to_register
+ *
+ * Description: template form of build_imm_to_register
+ */
+static inline volatile char *tmpl_imm_to_register(short mov_size, long immediate_val, int dest_reg, volatile char *tgt_addr)
+{
+    int szi = TMPL_SZI(mov_size);
+    unsigned rex = TMPL_EXT(dest_reg) ? REX_B : 0;
+    int need = rex || (szi == 0 && TMPL_HI8(dest_reg));
+
+    // C7 id for ISZ_4, io after B8+r for ISZ_8, otherwise the operand size
+    return tmpl_emit(&tmpl_mov_imm_tab[szi][need], rex, dest_reg & RM_MASK,
+                     immediate_val, mov_size, tgt_addr);
+}
+
+/*
+ * Function: tmpl_reg_to_memory
+ *
+ * Description: template form of build_reg_to_memory, MOV [base+disp], src
+ */
+static inline volatile char *tmpl_reg_to_memory(short mov_size, int src_reg, int mem_base_reg, long displacement, volatile char *tgt_addr)
+{
+    int szi = TMPL_SZI(mov_size);
+    int mod = tmpl_disp_mod(displacement);
+    unsigned rex = (TMPL_EXT(src_reg) ? REX_R : 0) | (TMPL_EXT(mem_base_reg) ? REX_B : 0);
+    int need = rex || (szi == 0 && (TMPL_HI8(src_reg) | TMPL_HI8(mem_base_reg)));
+
+    return tmpl_emit(&tmpl_mov_st_tab[szi][need], rex,
+                     (mod << MODRM_SHIFT) | ((src_reg & REG_MASK) << REG_SHIFT) | (mem_base_reg & RM_MASK),
+                     displacement, tmpl_disp_bytes[mod], tgt_addr);
+}
+
+/*
+ * Function: tmpl_mov_memory_to_register
+ *
+ * Description: template form of build_mov_memory_to_register, MOV dest, [base+disp]
+ */
+static inline volatile char *tmpl_mov_memory_to_register(short mov_size, int mem_base_reg, int dest_reg, long displacement, volatile char *tgt_addr)
+{
+    int szi = TMPL_SZI(mov_size);
+    int mod = tmpl_disp_mod(displacement);
+    unsigned rex = (TMPL_EXT(dest_reg) ? REX_R : 0) | (TMPL_EXT(mem_base_reg) ? REX_B : 0);
+    int need = rex || (szi == 0 && (TMPL_HI8(dest_reg) | TMPL_HI8(mem_base_reg)));
+
+    return tmpl_emit(&tmpl_mov_ld_tab[szi][need], rex,
+                     (mod << MODRM_SHIFT) | ((dest_reg & REG_MASK) << REG_SHIFT) | (mem_base_reg & RM_MASK),
+                     displacement, tmpl_disp_bytes[mod], tgt_addr);
+}
+
+/*
+ * Function: tmpl_rm_reg
+ *
+ * Description: shared body of tmpl_xadd/tmpl_xchg.  displacement == -1 selects the
+ *              register form (MOD=11) exactly like build_xadd/build_xchg.
+ */
+static inline volatile char *tmpl_rm_reg(const ia32_tmpl_t tab[4][2], short op_size, int rm_reg, int reg,
+                                         long displacement, volatile char *tgt_addr)
+{
+    int mod = (displacement == -1) ? 3 : tmpl_disp_mod(displacement);
+    unsigned rex = (TMPL_EXT(reg) ? REX_R : 0) | (TMPL_EXT(rm_reg) ? REX_B : 0);
+
+    return tmpl_emit(&tab[TMPL_SZI(op_size)][rex != 0], rex,
+                     (mod << MODRM_SHIFT) | ((reg & REG_MASK) << REG_SHIFT) | (rm_reg & RM_MASK),
+                     displacement, tmpl_disp_bytes[mod], tgt_addr);
+}
+
+/*
+ * Function: tmpl_xadd
+ *
+ * Description: template form of build_xadd (sizes 1, 2 and 4 only)
+ */
+static inline volatile char *tmpl_xadd(short xadd_size, int rm_reg, int reg, long displacement, int use_lock, volatile char *tgt_addr)
+{
+    return tmpl_rm_reg(tmpl_xadd_tab[use_lock != 0], xadd_size, rm_reg, reg, displacement, tgt_addr);
+}
+
+/*
+ * Function: tmpl_xchg
+ *
+ * Description: template form of build_xchg (sizes 1, 2 and 4 only)
+ */
+static inline volatile char *tmpl_xchg(short xchg_size, int rm_reg, int reg, long displacement, int use_lock, volatile char *tgt_addr)
+{
+    return tmpl_rm_reg(tmpl_xchg_tab[use_lock != 0], xchg_size, rm_reg, reg, displacement, tgt_addr);
+}
+
+#endif /* IA32_TEMPLATE_H */
@@ -0,0 +1,30 @@
+/*
+ * Description:
+ *
+ * Compressed, rotating log sink behind a stdio FILE
+ *
+ * logsink_open() returns a FILE (fopencookie) that the rig writes to like any
+ * other log file.  Writes are copied into a ring of 64KB blocks in memory; a
+ * writer thread LZ4 compresses full blocks and writes them to disk as LZ4 frames
+ * (readable with lz4 -d), so a worker only waits when the whole ring is backed
+ * up.  Output goes to <path>.<n>.lz4, and a new file is started once the current
+ * one holds rotate_bytes of compressed data or is rotate_secs old (0 = never),
+ * checked after each block.  A block that has not filled up is written out after
+ * a second anyway, and a killed process loses what has not been written yet.
+ * When a new file cannot be created the rest of the log is dropped, and the
+ * number of dropped blocks goes to stderr at close.
+ *
+ * The writer thread does not survive fork(), so a forked worker opens a sink of
+ * its own; a process only ever writes to and closes the sinks it opened, and an
+ * atexit handler closes them, so everything is on disk when the process exits.
+ */
+
+#ifndef LOGSINK_H
+#define LOGSINK_H
+
+#include <stdio.h>
+
+// open the sink, NULL if the first file cannot be created
+FILE *logsink_open(const char *path, unsigned long rotate_bytes, double rotate_secs);
+
+#endif /* LOGSINK_H */
@@ -0,0 +1,74 @@
+/*
+ * Description:
+ *
+ * Live statistics of an encodeit run, shared with external monitors
+ *
+ * The parent creates a named POSIX shared memory object (default /encodeit.<pid>,
+ * see -M) that holds this block followed by the COMM area.  Every worker owns one
+ * cache line of counters and is the only writer of it, so updates are plain
+ * stores with no LOCK and no sharing between workers.  The one exception is
+ * hangs, which the parent's watchdog writes after it killed the worker.  The counters are followed
+ * by one coverage bitmap per worker (see the coverage section of encodeit.c).  A
+ * monitor maps the block read only (see monitor.c) and samples it without
+ * disturbing the run.
+ */
+
+#ifndef TESTRIG_STATS_H
+#define TESTRIG_STATS_H
+
+#define STATS_MAGIC    0x5354415453524954UL   // "TIRSTATS"
+#define STATS_VERSION  3
+#define STATS_NAME_MAX 64
+
+// coverage bins: instruction type, size, reg1, reg2, mod and lock packed into 19 bits
+#define COV_BIN_BITS   19
+#define COV_BINS       (1UL << COV_BIN_BITS)
+#define COV_WORDS      (COV_BINS / 64)
+
+// one worker's counters, one cache line
+typedef struct {
+    volatile unsigned long programs_generated;   // built or mutated programs
+    volatile unsigned long programs_executed;
+    volatile unsigned long instructions;         // instructions executed
+    volatile unsigned long faults;               // runs ended by a signal
+    volatile unsigned long miscompares;          // wrong totals / forbidden outcomes
+    volatile unsigned long cycles;               // TSC cycles spent in generated code
+    volatile unsigned long heartbeat_ns;         // CLOCK_MONOTONIC of the last update
+    volatile unsigned long hangs;                // killed by the watchdog, parent writes
+} __attribute__((aligned(64))) testrig_worker_stats_t;
+
+typedef struct {
+    unsigned long magic;            // STATS_MAGIC once the header is valid
+    unsigned int version;
+    unsigned int nworkers;
+    unsigned long stats_bytes;      // size of this block, the COMM area follows it
+    unsigned long cov_offset;       // first coverage bitmap, COV_WORDS longs per worker
+    unsigned long start_ns;         // CLOCK_MONOTONIC when the run started
+    int pid;
+    unsigned int seed;
+    char profile[16];
+    volatile int done;              // set by the parent when all workers finished
+    testrig_worker_stats_t worker[];
+} __attribute__((aligned(64))) testrig_stats_t;
+
+// bytes of the counters for n workers, page rounded, the coverage bitmaps start there
+static inline unsigned long stats_cov_offset(int nworkers, unsigned long pagesize)
+{
+    unsigned long n = sizeof(testrig_stats_t) + nworkers * sizeof(testrig_worker_stats_t);
+
+    return (n + pagesize - 1) & ~(pagesize - 1);
+}
+
+// bytes of the whole block for n workers
+static inline unsigned long stats_bytes(int nworkers, unsigned long pagesize)
+{
+    return stats_cov_offset(nworkers, pagesize) + nworkers * COV_WORDS * sizeof(unsigned long);
+}
+
+// single writer update, readers never see a torn value
+static inline void stats_add(volatile unsigned long *ctr, unsigned long v)
+{
+    __atomic_store_n(ctr, *ctr + v, __ATOMIC_RELAXED);
+}
+
+#endif /* TESTRIG_STATS_H */
@@ -0,0 +1,378 @@
+//
+// compressed, rotating log sink, see include/logsink.h
+//
+// The compressor is the greedy single-probe LZ4 block format encoder: a 4K entry
+// hash of 4-byte sequences, matches of 4 or more bytes within 64KB, and the
+// format's end rules (the last 5 bytes are literals, the last match starts 12
+// bytes before the end).  Every block is compressed on its own (LZ4 frame with
+// independent blocks, no checksums), a block that does not shrink is stored.
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "logsink.h"
+
+#define LOGSINK_BLOCK    65536   // LZ4 frame maximum block size 64KB
+#define LOGSINK_SLOTS    64      // 4MB of log may wait for the writer
+#define LZ4_HASH_LOG     12
+#define LZ4_MAGIC        0x184D2204U
+
+typedef struct logsink {
+	char base[256];
+	unsigned long rotate_bytes;
+	double rotate_secs;
+	int fd, seq;
+	unsigned long file_bytes, file_start_ns;
+	unsigned long dropped;   // blocks not on disk, no file or a short write
+	pid_t owner;
+	FILE *file;
+	struct logsink *next;
+
+	// ring of blocks: count full ones from head, the producers fill (head + count) % SLOTS
+	pthread_mutex_t lock;
+	pthread_cond_t more, room;
+	pthread_t writer;
+	char *slot[LOGSINK_SLOTS];
+	int len[LOGSINK_SLOTS];
+	int head, count, closing;
+	unsigned char *out;
+} logsink_t;
+
+static logsink_t *sinks;
+static pid_t sinks_atexit;
+
+static unsigned long logsink_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static unsigned int read32(const unsigned char *p)
+{
+	unsigned int v;
+
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static void write32(unsigned char *p, unsigned int v)
+{
+	memcpy(p, &v, 4);
+}
+
+/*
+ * XXH32 with seed 0 of up to 15 bytes, for the frame header checksum
+ */
+static unsigned int xxh32_small(const unsigned char *p, int len)
+{
+	const unsigned int P1 = 2654435761U, P2 = 2246822519U, P3 = 3266489917U, P4 = 668265263U, P5 = 374761393U;
+	unsigned int h = P5 + len;
+
+	for (; len >= 4; p += 4, len -= 4) {
+		h += read32(p) * P3;
+		h = ((h << 17) | (h >> 15)) * P4;
+	}
+	for (; len > 0; p++, len--) {
+		h += *p * P5;
+		h = ((h << 11) | (h >> 21)) * P1;
+	}
+	h ^= h >> 15;
+	h *= P2;
+	h ^= h >> 13;
+	h *= P3;
+	return h ^ (h >> 16);
+}
+
+/*
+ * one LZ4 length field continuation: 255s then the rest
+ */
+static unsigned char *lz4_length(unsigned char *op, int n)
+{
+	for (; n >= 255; n -= 255)
+		*op++ = 255;
+	*op++ = n;
+	return op;
+}
+
+/*
+ * one sequence: literals, then a match (mlen 0 for the closing literals)
+ */
+static unsigned char *lz4_sequence(unsigned char *op, const unsigned char *lit, int nlit, int offset, int mlen)
+{
+	unsigned char *token = op++;
+
+	*token = (nlit >= 15 ? 15 : nlit) << 4;
+	if (nlit >= 15)
+		op = lz4_length(op, nlit - 15);
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (!mlen)
+		return op;
+
+	*op++ = offset;
+	*op++ = offset >> 8;
+	mlen -= 4;
+	*token |= mlen >= 15 ? 15 : mlen;
+	if (mlen >= 15)
+		op = lz4_length(op, mlen - 15);
+	return op;
+}
+
+/*
+ * compress n bytes (n <= 64KB) into dst, which holds n + n / 255 + 16 bytes
+ *
+ * Returns: compressed size
+ */
+static int lz4_compress(const unsigned char *src, int n, unsigned char *dst)
+{
+	int table[1 << LZ4_HASH_LOG];
+	unsigned char *op = dst;
+	int ip = 0, anchor = 0, ref, len;
+	unsigned int seq, h;
+
+	memset(table, -1, sizeof(table));
+	while (ip <= n - 12) {
+		seq = read32(src + ip);
+		h = (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+		ref = table[h];
+		table[h] = ip;
+		if (ref < 0 || ip - ref > 65535 || read32(src + ref) != seq) {
+			ip++;
+			continue;
+		}
+		for (len = 4; ip + len < n - 5 && src[ref + len] == src[ip + len]; len++)
+			;
+		op = lz4_sequence(op, src + anchor, ip - anchor, ip - ref, len);
+		ip += len;
+		anchor = ip;
+	}
+	op = lz4_sequence(op, src + anchor, n - anchor, 0, 0);
+	return (int)(op - dst);
+}
+
+/*
+ * start <base>.<seq>.lz4 with the frame header, -1 if it cannot be created
+ */
+static int logsink_file(logsink_t *s)
+{
+	unsigned char hdr[7];
+	char path[300];
+
+	snprintf(path, sizeof(path), "%s.%d.lz4", s->base, s->seq);
+	s->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (s->fd < 0) {
+		perror(path);
+		return -1;
+	}
+	write32(hdr, LZ4_MAGIC);
+	hdr[4] = 0x60;   // version 01, independent blocks
+	hdr[5] = 0x40;   // 64KB blocks
+	hdr[6] = (xxh32_small(hdr + 4, 2) >> 8) & 0xFF;
+	s->file_bytes = write(s->fd, hdr, sizeof(hdr)) == sizeof(hdr) ? sizeof(hdr) : 0;
+	s->file_start_ns = logsink_ns();
+	return 0;
+}
+
+/*
+ * end the frame of the current file
+ */
+static void logsink_end(logsink_t *s)
+{
+	unsigned char end[4] = { 0, 0, 0, 0 };
+
+	if (s->fd < 0)
+		return;
+	if (write(s->fd, end, 4) != 4)
+		perror(s->base);
+	close(s->fd);
+	s->fd = -1;
+}
+
+/*
+ * compress and write one block, rotate when the file is full or old enough
+ */
+static void logsink_block(logsink_t *s, const char *buf, int n)
+{
+	int c;
+	ssize_t want;
+
+	// the next file could not be created, the rest of the log is lost
+	if (s->fd < 0) {
+		s->dropped++;
+		return;
+	}
+	c = lz4_compress((const unsigned char *)buf, n, s->out + 4);
+	if (c >= n) {
+		// stored, the high bit says uncompressed
+		memcpy(s->out + 4, buf, n);
+		write32(s->out, n | 0x80000000U);
+		c = n;
+	} else {
+		write32(s->out, c);
+	}
+	want = c + 4;
+	if (write(s->fd, s->out, want) != want) {
+		perror(s->base);
+		s->dropped++;
+	}
+	s->file_bytes += want;
+
+	if ((s->rotate_bytes && s->file_bytes >= s->rotate_bytes) ||
+	    (s->rotate_secs > 0 && logsink_ns() - s->file_start_ns >= s->rotate_secs * 1e9)) {
+		logsink_end(s);
+		s->seq++;
+		if (logsink_file(s) != 0)
+			fprintf(stderr, "%s: cannot rotate the log, dropping the rest\n", s->base);
+	}
+}
+
+static void *logsink_writer(void *arg)
+{
+	logsink_t *s = arg;
+	struct timespec until;
+	int idx;
+
+	pthread_mutex_lock(&s->lock);
+	for (;;) {
+		while (!s->count && !s->closing) {
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec++;
+			if (pthread_cond_timedwait(&s->more, &s->lock, &until) != 0 && !s->count &&
+			    s->len[s->head] > 0)
+				s->count = 1;   // idle for a second, write what there is
+		}
+		if (!s->count)
+			break;   // closing and drained
+		idx = s->head;
+		pthread_mutex_unlock(&s->lock);
+
+		logsink_block(s, s->slot[idx], s->len[idx]);
+
+		pthread_mutex_lock(&s->lock);
+		s->len[idx] = 0;
+		s->head = (s->head + 1) % LOGSINK_SLOTS;
+		s->count--;
+		pthread_cond_signal(&s->room);
+	}
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+static ssize_t logsink_write(void *cookie, const char *buf, size_t size)
+{
+	logsink_t *s = cookie;
+	size_t done = 0;
+	int idx, n;
+
+	// a forked child's copy of its parent's sink has no writer, drop
+	if (s->owner != getpid())
+		return size;
+
+	pthread_mutex_lock(&s->lock);
+	while (done < size) {
+		while (s->count == LOGSINK_SLOTS)
+			pthread_cond_wait(&s->room, &s->lock);
+		idx = (s->head + s->count) % LOGSINK_SLOTS;
+		n = LOGSINK_BLOCK - s->len[idx];
+		if ((size_t)n > size - done)
+			n = size - done;
+		memcpy(s->slot[idx] + s->len[idx], buf + done, n);
+		s->len[idx] += n;
+		done += n;
+		if (s->len[idx] == LOGSINK_BLOCK) {
+			s->count++;
+			pthread_cond_signal(&s->more);
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	return size;
+}
+
+static int logsink_close(void *cookie)
+{
+	logsink_t *s = cookie, **pp;
+	int k;
+
+	if (s->owner != getpid())
+		return 0;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->count < LOGSINK_SLOTS && s->len[(s->head + s->count) % LOGSINK_SLOTS] > 0)
+		s->count++;
+	s->closing = 1;
+	pthread_cond_signal(&s->more);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->writer, NULL);
+	logsink_end(s);
+	if (s->dropped)
+		fprintf(stderr, "%s: %lu log blocks (up to %dKB each) dropped\n", s->base, s->dropped, LOGSINK_BLOCK / 1024);
+
+	for (pp = &sinks; *pp; pp = &(*pp)->next)
+		if (*pp == s) {
+			*pp = s->next;
+			break;
+		}
+	for (k = 0; k < LOGSINK_SLOTS; k++)
+		free(s->slot[k]);
+	free(s->out);
+	free(s);
+	return 0;
+}
+
+/*
+ * atexit: close this process's sinks so the writer threads drain to disk
+ */
+static void logsink_close_all(void)
+{
+	logsink_t *s, *next;
+
+	for (s = sinks; s; s = next) {
+		next = s->next;
+		if (s->owner == getpid())
+			fclose(s->file);
+	}
+}
+
+FILE *logsink_open(const char *path, unsigned long rotate_bytes, double rotate_secs)
+{
+	cookie_io_functions_t io = { NULL, logsink_write, NULL, logsink_close };
+	logsink_t *s = calloc(1, sizeof(*s));
+	int k;
+
+	if (!s)
+		return NULL;
+	snprintf(s->base, sizeof(s->base), "%s", path);
+	s->rotate_bytes = rotate_bytes;
+	s->rotate_secs = rotate_secs;
+	s->owner = getpid();
+	for (k = 0; k < LOGSINK_SLOTS; k++)
+		s->slot[k] = malloc(LOGSINK_BLOCK);
+	s->out = malloc(4 + LOGSINK_BLOCK + LOGSINK_BLOCK / 255 + 16);
+	if (!s->slot[LOGSINK_SLOTS - 1] || !s->out || logsink_file(s) != 0) {
+		for (k = 0; k < LOGSINK_SLOTS; k++)
+			free(s->slot[k]);
+		free(s->out);
+		free(s);
+		return NULL;
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->more, NULL);
+	pthread_cond_init(&s->room, NULL);
+	pthread_create(&s->writer, NULL, logsink_writer, s);
+
+	s->file = fopencookie(s, "w", io);
+	s->next = sinks;
+	sinks = s;
+	if (sinks_atexit != getpid()) {
+		atexit(logsink_close_all);
+		sinks_atexit = getpid();
+	}
+	return s->file;
+}
@@ -0,0 +1,165 @@
+//
+// monitor: sample the live stats of a running encodeit
+//
+// usage: monitor [-i seconds] name
+//
+// Maps the shared memory object encodeit printed as "Stats = name" read only and
+// prints per-worker rates and the coverage bins hit so far every interval (1 s by
+// default) until the run is done.  Only reads, so the workers never see the monitor.
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "testrig_stats.h"
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * coverage bins hit by any worker
+ */
+static unsigned long cov_hit(const testrig_stats_t *st)
+{
+	const unsigned long *maps = (const unsigned long *)((const char *)st + st->cov_offset);
+	unsigned long n = 0, w, k;
+
+	for (k = 0; k < COV_WORDS; k++) {
+		unsigned long word = 0;
+
+		for (w = 0; w < st->nworkers; w++)
+			word |= maps[w * COV_WORDS + k];
+		n += __builtin_popcountl(word);
+	}
+	return n;
+}
+
+/*
+ * map the stats block of name, waits for the header to become valid
+ */
+static testrig_stats_t *stats_attach(const char *name)
+{
+	testrig_stats_t *hdr;
+	unsigned long size;
+	void *p;
+	int fd, tries;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+
+	// the header fits in the first page, map that to learn the full size
+	hdr = mmap(NULL, sizeof(*hdr), PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	for (tries = 0; __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC && tries < 50; tries++)
+		usleep(100000);
+	if (hdr->magic != STATS_MAGIC || hdr->version != STATS_VERSION) {
+		fprintf(stderr, "%s: not an encodeit stats block (version %u)\n", name, hdr->version);
+		munmap(hdr, sizeof(*hdr));
+		close(fd);
+		return NULL;
+	}
+	size = hdr->stats_bytes;
+	munmap(hdr, sizeof(*hdr));
+
+	p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+	return p;
+}
+
+int main(int argc, char *argv[])
+{
+	testrig_stats_t *st;
+	testrig_worker_stats_t *prev, tot, ptot;
+	double interval = 1.0;
+	unsigned long t_prev, t;
+	int opt, n, w, done;
+
+	while ((opt = getopt(argc, argv, "i:")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = atof(optarg);
+			break;
+		default:
+			argc = 0;
+		}
+	}
+	if (argc == 0 || optind != argc - 1 || interval <= 0) {
+		fprintf(stderr, "usage: %s [-i seconds] name\n", argv[0] ? argv[0] : "monitor");
+		exit(1);
+	}
+
+	st = stats_attach(argv[optind]);
+	if (!st)
+		exit(1);
+	n = st->nworkers;
+	prev = calloc(n, sizeof(*prev));
+	printf("encodeit pid %d, seed %u, profile %s, %d workers\n", st->pid, st->seed, st->profile, n);
+
+	t_prev = now_ns();
+	do {
+		double secs;
+
+		usleep((useconds_t)(interval * 1e6));
+		done = st->done;   // read first, so the last sample still follows it
+		t = now_ns();
+		secs = (t - t_prev) / 1e9;
+
+		memset(&tot, 0, sizeof(tot));
+		memset(&ptot, 0, sizeof(ptot));
+		printf("\n%8.1f s  worker  programs/s     instr/s    cycles/s     faults  miscompares  heartbeat\n",
+		       (t - st->start_ns) / 1e9);
+		for (w = 0; w < n; w++) {
+			testrig_worker_stats_t cur = st->worker[w];
+			unsigned long hb = cur.heartbeat_ns;
+
+			printf("            T%-4d %10.0f  %10.3g  %10.3g  %9lu  %11lu  %8.1f s\n", w,
+			       (cur.programs_executed - prev[w].programs_executed) / secs,
+			       (cur.instructions - prev[w].instructions) / secs,
+			       (cur.cycles - prev[w].cycles) / secs,
+			       cur.faults, cur.miscompares, hb ? (t - hb) / 1e9 : -1.0);
+			tot.programs_generated += cur.programs_generated;
+			tot.programs_executed += cur.programs_executed;
+			tot.instructions += cur.instructions;
+			tot.cycles += cur.cycles;
+			tot.faults += cur.faults;
+			tot.miscompares += cur.miscompares;
+			tot.hangs += cur.hangs;
+			ptot.programs_executed += prev[w].programs_executed;
+			ptot.instructions += prev[w].instructions;
+			ptot.cycles += prev[w].cycles;
+			prev[w] = cur;
+		}
+		printf("            total %10.0f  %10.3g  %10.3g  %9lu  %11lu\n",
+		       (tot.programs_executed - ptot.programs_executed) / secs,
+		       (tot.instructions - ptot.instructions) / secs,
+		       (tot.cycles - ptot.cycles) / secs, tot.faults, tot.miscompares);
+		printf("            %lu programs generated, %lu executed, %lu instructions, %lu hangs, %lu coverage bins\n",
+		       tot.programs_generated, tot.programs_executed, tot.instructions, tot.hangs, cov_hit(st));
+		fflush(stdout);
+		t_prev = t;
+	} while (!done);
+
+	printf("\nrun done\n");
+	return tot.faults || tot.miscompares || tot.hangs;
+}